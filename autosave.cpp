@@ -0,0 +1,119 @@
+#include "autosave.h"
+
+#include <chrono>
+#include <cstdio>
+#include <filesystem>
+
+// Write proj to a temporary file, then rename it over filename, so there's
+// never a half-written file there. Returns the size written, or 0 on error.
+static size_t WriteFileSafely(std::string const& filename, Proj const& proj)
+{
+    std::string tmp = filename + ".tmp";
+    size_t size;
+    {
+        FileSink out(tmp);
+        bool ok = out.Ok() && WriteProj(proj, out);
+        size = out.Pos();
+        if (!out.Close() || !ok) {
+            std::remove(tmp.c_str());
+            return 0;
+        }
+    }
+    std::error_code err;
+    std::filesystem::rename(tmp, filename, err);
+    if (err) {
+        std::remove(tmp.c_str());
+        return 0;
+    }
+    return size;
+}
+
+Autosaver::Autosaver()
+{
+    mThread = std::thread([this]() {Run();});
+}
+
+Autosaver::~Autosaver()
+{
+    {
+        std::lock_guard<std::mutex> lock(mLock);
+        mQuit = true;
+    }
+    mWake.notify_all();
+    mThread.join();
+}
+
+bool Autosaver::Save(Proj&& snapshot, std::string const& path)
+{
+    {
+        std::lock_guard<std::mutex> lock(mLock);
+        if (mPending || mBusy) {
+            return false;
+        }
+        mSnapshot = std::move(snapshot);
+        mPath = path;
+        mPending = true;
+        mStatus.state = Status::SAVING;
+        mStatus.path = path;
+    }
+    mWake.notify_one();
+    return true;
+}
+
+bool Autosaver::Busy() const
+{
+    std::lock_guard<std::mutex> lock(mLock);
+    return mPending || mBusy;
+}
+
+Autosaver::Status Autosaver::LastStatus() const
+{
+    std::lock_guard<std::mutex> lock(mLock);
+    return mStatus;
+}
+
+void Autosaver::Wait()
+{
+    std::unique_lock<std::mutex> lock(mLock);
+    mDone.wait(lock, [&]() {return !mPending && !mBusy;});
+}
+
+void Autosaver::Run()
+{
+    std::unique_lock<std::mutex> lock(mLock);
+    while (true) {
+        mWake.wait(lock, [&]() {return mQuit || mPending;});
+        if (!mPending) {
+            break;  // Quitting.
+        }
+        Proj proj = std::move(mSnapshot);
+        mSnapshot = Proj();
+        std::string path = mPath;
+        mPending = false;
+        mBusy = true;
+        lock.unlock();
+
+        auto start = std::chrono::steady_clock::now();
+        size_t bytes = WriteFileSafely(path, proj);
+        // Let go of the shared chunks now, so the editor doesn't have to
+        // copy them when it next modifies them.
+        proj = Proj();
+        auto end = std::chrono::steady_clock::now();
+
+        Status status;
+        status.state = (bytes > 0) ? Status::SAVED : Status::FAILED;
+        status.path = path;
+        status.bytes = bytes;
+        status.ms = std::chrono::duration<double, std::milli>(end - start).count();
+        status.when = std::time(nullptr);
+
+        // Report before we're marked as done, so Wait() covers it.
+        if (onDone) {
+            onDone(status);
+        }
+        lock.lock();
+        mStatus = status;
+        mBusy = false;
+        mDone.notify_all();
+    }
+}
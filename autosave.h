@@ -0,0 +1,60 @@
+#pragma once
+
+#include <cstdint>
+#include <ctime>
+#include <string>
+#include <functional>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+
+#include "proj.h"
+
+// Saves snapshots of a project in the background.
+// Taking a snapshot is just copying the Proj, which is cheap (the copy
+// shares its map chunks and charset with the original until either side
+// modifies them), so that's all the editing thread has to do. Serializing
+// and writing the file happen on the autosaver's own thread.
+class Autosaver
+{
+public:
+    struct Status
+    {
+        enum State {IDLE, SAVING, SAVED, FAILED};
+        State state{IDLE};
+        std::string path;
+        size_t bytes{0};        // Size of the file written.
+        double ms{0};           // How long it took.
+        std::time_t when{0};    // When it finished.
+    };
+
+    Autosaver();
+    // Waits for any save in progress to finish.
+    ~Autosaver();
+
+    // Start saving snapshot to path, returning straight away.
+    // Nothing else may touch snapshot (or its non-shared parts) afterward.
+    // Returns false (and does nothing) if the previous save is still going.
+    bool Save(Proj&& snapshot, std::string const& path);
+    bool Busy() const;
+    Status LastStatus() const;
+    // Wait until any save in progress is done.
+    void Wait();
+
+    // If set, called on the autosaver thread whenever a save finishes.
+    std::function<void(Status const&)> onDone;
+
+private:
+    void Run();
+
+    mutable std::mutex mLock;
+    std::condition_variable mWake;
+    std::condition_variable mDone;
+    Proj mSnapshot;
+    std::string mPath;
+    bool mPending{false};
+    bool mBusy{false};
+    bool mQuit{false};
+    Status mStatus;
+    std::thread mThread;
+};
@@ -0,0 +1,184 @@
+// Tile pixel expansion micro-benchmark (see ExpandPixels() in glyphs.h).
+// For a range of tile sizes, draws a screenful of random cells with each
+// ExpandPixels() kernel the CPU supports, and with the per-pixel loop
+// RenderCell() used to have, and prints millions of pixels per second.
+// "rows" draws a row at a time into a bigger image (as ExpandGlyph() does
+// for an uncached cell), "glyph" draws whole tiles into contiguous memory
+// (as for GlyphCache).
+//
+//   meson setup build -Dbenchmarks=true
+//   ninja -C build bench_glyphs
+//   ./build/bench_glyphs --secs 0.5
+//
+// Options:
+//   --cells WxH     cells drawn per run
+//   --secs F        time to spend on each measurement (at least 3 runs)
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "glyphs.h"
+
+// Runs fn until it's been going for secs (and at least 3 times), and
+// returns the average time in seconds.
+static double Time(double secs, std::function<void()> const& fn)
+{
+    int runs = 0;
+    double total = 0.0;
+    while (runs < 3 || total < secs) {
+        auto start = std::chrono::steady_clock::now();
+        fn();
+        auto end = std::chrono::steady_clock::now();
+        total += std::chrono::duration<double>(end - start).count();
+        ++runs;
+    }
+    return total / runs;
+}
+
+// The loop RenderCell() had before ExpandPixels(): a byte at a time, with
+// a branch per pixel.
+static void ExpandOld(uint8_t const* src, size_t n, uint32_t ink, uint32_t paper, uint8_t* dest)
+{
+    uint8_t inkb[4];
+    uint8_t paperb[4];
+    std::memcpy(inkb, &ink, 4);
+    std::memcpy(paperb, &paper, 4);
+    for (size_t i = 0; i < n; ++i) {
+        if (*src++ == 0) {
+            *dest++ = paperb[0];
+            *dest++ = paperb[1];
+            *dest++ = paperb[2];
+            *dest++ = 255;
+        } else {
+            *dest++ = inkb[0];
+            *dest++ = inkb[1];
+            *dest++ = inkb[2];
+            *dest++ = 255;
+        }
+    }
+}
+
+struct Kernel {
+    char const* name;
+    std::function<void(uint8_t const*, size_t, uint32_t, uint32_t, uint8_t*)> fn;
+};
+
+int main(int argc, char** argv)
+{
+    int cellsW = 40;
+    int cellsH = 25;
+    double secs = 0.5;
+    for (int i = 1; i < argc; ++i) {
+        std::string arg(argv[i]);
+        if (i + 1 >= argc) {
+            fprintf(stderr, "Missing param for %s\n", arg.c_str());
+            return 1;
+        }
+        char const* val = argv[++i];
+        if (arg == "--cells") {
+            if (sscanf(val, "%dx%d", &cellsW, &cellsH) != 2 || cellsW < 1 || cellsH < 1) {
+                fprintf(stderr, "Bad --cells (want WxH)\n");
+                return 1;
+            }
+        } else if (arg == "--secs") {
+            secs = atof(val);
+        } else {
+            fprintf(stderr, "Unknown option %s\n", arg.c_str());
+            return 1;
+        }
+    }
+
+    std::vector<Kernel> kernels = {{"old", ExpandOld}};
+    struct {
+        char const* name;
+        PixelKernel k;
+    } const all[] = {
+        {"scalar", PixelKernel::SCALAR},
+        {"sse2", PixelKernel::SSE2},
+        {"avx2", PixelKernel::AVX2},
+    };
+    for (auto const& a : all) {
+        if (HasPixelKernel(a.k)) {
+            PixelKernel k = a.k;
+            kernels.push_back({a.name, [k](uint8_t const* src, size_t n, uint32_t ink, uint32_t paper, uint8_t* dest) {
+                ExpandPixelsWith(k, src, n, ink, paper, dest);
+            }});
+        }
+    }
+
+    struct Size {
+        int tw;
+        int th;
+    } const sizes[] = {{8, 8}, {16, 16}, {32, 32}, {6, 8}, {12, 10}, {7, 9}};
+    int const ntiles = 256;
+    uint32_t const ink = 0xFF3366CC;
+    uint32_t const paper = 0xFF000000;
+    std::mt19937 rng(1234);
+
+    printf("# cells=%dx%d (Mpixels/sec)\n", cellsW, cellsH);
+    printf("%-6s %-6s", "tile", "mode");
+    for (Kernel const& k : kernels) {
+        printf(" %10s", k.name);
+    }
+    printf("\n");
+    for (Size const& size : sizes) {
+        size_t tilePixels = (size_t)size.tw * size.th;
+        std::vector<uint8_t> images(tilePixels * ntiles);
+        for (auto& pix : images) {
+            pix = (uint8_t)(rng() & 1);
+        }
+        std::vector<int> cells((size_t)cellsW * cellsH);
+        for (auto& tile : cells) {
+            tile = (int)(rng() % ntiles);
+        }
+        size_t stride = (size_t)cellsW * size.tw * 4;
+        size_t pixels = cells.size() * tilePixels;
+        std::vector<uint8_t> image(stride * cellsH * size.th);
+        std::vector<uint8_t> expect(image.size());
+
+        for (int mode = 0; mode < 2; ++mode) {
+            // Draws every cell with fn, into image.
+            auto draw = [&](Kernel const& kernel) {
+                for (int cy = 0; cy < cellsH; ++cy) {
+                    for (int cx = 0; cx < cellsW; ++cx) {
+                        uint8_t const* src = images.data() + (cells[cy * cellsW + cx] * tilePixels);
+                        if (mode == 1) {
+                            uint8_t* dest = image.data() + ((size_t)(cy * cellsW + cx) * tilePixels * 4);
+                            kernel.fn(src, tilePixels, ink, paper, dest);
+                            continue;
+                        }
+                        uint8_t* dest = image.data() + (cy * size.th * stride) + (cx * size.tw * 4);
+                        for (int y = 0; y < size.th; ++y) {
+                            kernel.fn(src, size.tw, ink, paper, dest);
+                            src += size.tw;
+                            dest += stride;
+                        }
+                    }
+                }
+            };
+            std::string tile = std::to_string(size.tw) + "x" + std::to_string(size.th);
+            printf("%-6s %-6s", tile.c_str(), mode ? "glyph" : "rows");
+            draw(kernels[1]);
+            expect = image;
+            for (Kernel const& kernel : kernels) {
+                std::fill(image.begin(), image.end(), 0);
+                draw(kernel);
+                if (image != expect) {
+                    printf("\n%s: wrong output\n", kernel.name);
+                    return 1;
+                }
+                double t = Time(secs, [&]() {draw(kernel);});
+                printf(" %10.1f", (double)pixels / t / 1e6);
+                fflush(stdout);
+            }
+            printf("\n");
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,146 @@
+// Load/save benchmark, on a synthetic project (see synth.h).
+// For each file format we can write, prints the file size, save and load
+// times, heap allocations and peak RSS. The project is always the same
+// for the same options, so the output can be diffed between builds (the
+// bytes and allocs columns should match exactly).
+//
+//   meson setup build -Dbenchmarks=true
+//   ninja -C build bench_projio
+//   ./build/bench_projio --maps 64 --size 128x128 --entropy 0.1
+//
+// Options:
+//   --maps N        number of maps
+//   --size WxH      map size, in cells
+//   --entropy F     fraction of cells which are noise (0 to 1)
+//   --ents N        ents per map
+//   --tiles N       charset size
+//   --seed N        random seed
+//   --secs F        time to spend on each measurement (at least 3 runs)
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <functional>
+#include <string>
+
+#include "proj.h"
+#include "stats.h"
+#include "synth.h"
+
+// Runs fn until it's been going for secs (and at least 3 times), and
+// returns the average time in ms.
+static double Time(double secs, std::function<void()> const& fn)
+{
+    int runs = 0;
+    double total = 0.0;
+    while (runs < 3 || total < secs) {
+        auto start = std::chrono::steady_clock::now();
+        fn();
+        auto end = std::chrono::steady_clock::now();
+        total += std::chrono::duration<double>(end - start).count();
+        ++runs;
+    }
+    return (total * 1000.0) / runs;
+}
+
+static double MB(size_t bytes)
+{
+    return (double)bytes / (1024.0 * 1024.0);
+}
+
+int main(int argc, char** argv)
+{
+    SynthParams params;
+    double secs = 1.0;
+    for (int i = 1; i < argc; ++i) {
+        std::string arg(argv[i]);
+        if (i + 1 >= argc) {
+            fprintf(stderr, "Missing param for %s\n", arg.c_str());
+            return 1;
+        }
+        char const* val = argv[++i];
+        if (arg == "--maps") {
+            params.maps = atoi(val);
+        } else if (arg == "--size") {
+            if (sscanf(val, "%dx%d", &params.w, &params.h) != 2) {
+                fprintf(stderr, "Bad --size (want WxH)\n");
+                return 1;
+            }
+        } else if (arg == "--entropy") {
+            params.entropy = (float)atof(val);
+        } else if (arg == "--ents") {
+            params.entsPerMap = atoi(val);
+        } else if (arg == "--tiles") {
+            params.tiles = atoi(val);
+        } else if (arg == "--seed") {
+            params.seed = (uint32_t)strtoul(val, nullptr, 10);
+        } else if (arg == "--secs") {
+            secs = atof(val);
+        } else {
+            fprintf(stderr, "Unknown option %s\n", arg.c_str());
+            return 1;
+        }
+    }
+    if (params.maps < 0 || params.w < 1 || params.h < 1 || params.w > 65535 || params.h > 65535) {
+        fprintf(stderr, "Bad project size\n");
+        return 1;
+    }
+
+    printf("# maps=%d size=%dx%d entropy=%.3f ents=%d tiles=%d seed=%u\n",
+        params.maps, params.w, params.h, params.entropy, params.entsPerMap, params.tiles, params.seed);
+    Proj proj = SynthProj(params);
+
+    struct Format {
+        char const* name;
+        std::function<void(Proj const&, Sink&)> write;
+    };
+    Format const formats[] = {
+        {"r1", [](Proj const& p, Sink& out) {WriteProjR1(p, out);}},
+        {"r2", [](Proj const& p, Sink& out) {WriteProjR2(p, out);}},
+        {"r7", [](Proj const& p, Sink& out) {WriteProj(p, out, false);}},
+        {"r7z", [](Proj const& p, Sink& out) {WriteProj(p, out, true);}},
+    };
+
+    // save/load: average ms for a whole file (load decodes every map).
+    // open: ms to open the file without decoding the maps (R3 onward).
+    // allocs: heap allocations for one load.
+    // peak: peak RSS during the saves/loads, in MB.
+    printf("%-6s %12s %10s %10s %10s %10s %10s %10s\n",
+        "format", "bytes", "save_ms", "load_ms", "open_ms", "allocs", "save_peak", "load_peak");
+    for (Format const& format : formats) {
+        std::vector<uint8_t> file;
+        ResetPeakRSS();
+        double saveMs = Time(secs, [&]() {
+            file.clear();
+            MemSink sink(file);
+            format.write(proj, sink);
+        });
+        size_t savePeak = PeakRSS();
+        auto data = FileData::FromVector(std::vector<uint8_t>(file));
+
+        uint64_t allocs = 0;
+        bool ok = true;
+        ResetPeakRSS();
+        double loadMs = Time(secs, [&]() {
+            Proj loaded;
+            ReadError err;
+            uint64_t before = AllocCount();
+            if (!ReadProj(loaded, file.data(), file.data() + file.size(), &err)) {
+                fprintf(stderr, "%s: load failed: %s\n", format.name, err.ToString().c_str());
+                ok = false;
+            }
+            allocs = AllocCount() - before;
+        });
+        size_t loadPeak = PeakRSS();
+        double openMs = Time(secs, [&]() {
+            Proj loaded;
+            ok = ReadProj(loaded, data) && ok;
+        });
+        if (!ok) {
+            return 1;
+        }
+        printf("%-6s %12zu %10.2f %10.2f %10.2f %10llu %10.1f %10.1f\n",
+            format.name, file.size(), saveMs, loadMs, openMs, (unsigned long long)allocs, MB(savePeak), MB(loadPeak));
+    }
+    return 0;
+}
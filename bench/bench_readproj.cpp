@@ -0,0 +1,54 @@
+// How fast can we parse project files?
+// Reads synthetic projects (see synth.h) of increasing size (compressed and
+// not), with every map decoded, and prints the throughput in MB/s of file
+// data. See bench_projio for a fuller picture.
+//
+//   meson setup build -Dbenchmarks=true
+//   ninja -C build bench_readproj && ./build/bench_readproj
+
+#include <chrono>
+#include <cstdio>
+
+#include "proj.h"
+#include "synth.h"
+
+int main()
+{
+    struct Size {
+        int nmaps;
+        int size;
+    };
+    Size const sizes[] = {{1, 64}, {4, 128}, {16, 256}, {32, 512}, {16, 2048}};
+
+    printf("%8s %8s %10s %10s %10s\n", "maps", "size", "compress", "bytes", "MB/s");
+    for (Size const& sz : sizes) {
+        SynthParams params;
+        params.maps = sz.nmaps;
+        params.w = sz.size;
+        params.h = sz.size;
+        Proj proj = SynthProj(params);
+        for (bool compress : {false, true}) {
+            std::vector<uint8_t> file;
+            WriteProj(proj, file, compress);
+
+            // Run for a while, to even things out.
+            int runs = 0;
+            double secs = 0.0;
+            while (runs < 3 || secs < 1.0) {
+                Proj loaded;
+                auto start = std::chrono::steady_clock::now();
+                ReadError err;
+                if (!ReadProj(loaded, file.data(), file.data() + file.size(), &err)) {
+                    printf("FAILED: %s\n", err.ToString().c_str());
+                    return 1;
+                }
+                auto end = std::chrono::steady_clock::now();
+                secs += std::chrono::duration<double>(end - start).count();
+                ++runs;
+            }
+            double mb = (double)file.size() * runs / (1024.0 * 1024.0);
+            printf("%8d %8d %10s %10zu %10.1f\n", sz.nmaps, sz.size, compress ? "yes" : "no", file.size(), mb / secs);
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,62 @@
+#include "synth.h"
+
+#include <algorithm>
+#include <format>
+#include <random>
+
+Proj SynthProj(SynthParams const& params)
+{
+    Proj proj;
+    DefaultProj(&proj);
+    // Not std::uniform_int_distribution etc, as their output differs
+    // between standard libraries.
+    std::mt19937 rng(params.seed);
+    int tiles = std::max(params.tiles, 1);
+
+    Charset& charset = proj.charset;
+    charset.tw = 8;
+    charset.th = 8;
+    charset.ntiles = tiles;
+    {
+        std::vector<uint8_t> images((size_t)charset.tw * charset.th * charset.ntiles);
+        for (auto& pix : images) {
+            pix = (uint8_t)(rng() & 1);
+        }
+        charset.SetImages(std::move(images));
+    }
+
+    uint32_t noise = (uint32_t)(params.entropy * 65536.0f);
+    proj.maps.clear();
+    for (int m = 0; m < params.maps; ++m) {
+        Tilemap map(params.w, params.h);
+        for (int y = 0; y < params.h; ++y) {
+            for (int x = 0; x < params.w; ++x) {
+                int kind = ((x / 24) + (y / 24) + m) % 4;
+                if (kind == 0) {
+                    continue;   // Empty.
+                }
+                Cell c;
+                if ((rng() & 0xFFFF) < noise) {
+                    c = Cell{(uint16_t)(rng() % tiles), (uint8_t)(rng() % 16), (uint8_t)(rng() % 16)};
+                } else if (kind == 1) {
+                    c = Cell{(uint16_t)((y % 8) % tiles), 1, 0};  // Runs.
+                } else {
+                    c = Cell{(uint16_t)(((x % 4) + (y % 4) * 4) % tiles), (uint8_t)kind, 0};
+                }
+                map.SetCell(TilePoint(x, y), c);
+            }
+        }
+        map.Compact();
+        for (int i = 0; i < params.entsPerMap; ++i) {
+            Ent ent;
+            static char const* kinds[] = {"monster", "door", "key", "spawn"};
+            ent.SetAttr("kind", kinds[rng() % 4]);
+            ent.SetAttr("name", std::format("ent{}_{}", m, i));
+            ent.SetAttrInt("x", (int)(rng() % ((uint32_t)params.w * 8 + 1)));
+            ent.SetAttrInt("y", (int)(rng() % ((uint32_t)params.h * 8 + 1)));
+            map.ents.push_back(ent);
+        }
+        proj.maps.push_back(std::move(map));
+    }
+    return proj;
+}
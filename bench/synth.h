@@ -0,0 +1,26 @@
+#pragma once
+
+#include <cstdint>
+
+#include "proj.h"
+
+// Synthetic projects, for benchmarks.
+
+struct SynthParams
+{
+    int maps{16};
+    int w{256};
+    int h{256};
+    // Fraction (0 to 1) of cells which are random noise rather than part
+    // of the repeating background. 0 is very compressible, 1 is hopeless.
+    float entropy{0.25f};
+    int entsPerMap{20};
+    int tiles{256};         // Charset size (8x8 tiles).
+    uint32_t seed{1234};
+};
+
+// Always the same project for the same params, so results can be compared
+// between builds.
+// Each map has a mix of empty areas, and a background pattern (the same on
+// every map, roughly like repeated room layouts) sprinkled with noise.
+Proj SynthProj(SynthParams const& params);
@@ -1,34 +1,167 @@
 #include "cmd.h"
+#include "compress.h"
+#include "journal.h"
 #include "model.h"
+#include "workers.h"
 #include <cassert>
 #include <algorithm>
+#include <iterator>
+#include <mutex>
+
+// Rough memory usage, for Cost() implementations.
+static size_t CostOf(Ent const& ent)
+{
+    // (The attr names are interned, so are shared.)
+    size_t n = sizeof(Ent) + ent.attrs.capacity() * sizeof(EntAttr);
+    for (auto const& attr : ent.attrs) {
+        n += attr.value.capacity();
+    }
+    return n;
+}
+
+static size_t CostOf(Tilemap const& map)
+{
+    size_t n = sizeof(Tilemap) + map.CellMemUsage();
+    for (auto const& ent : map.ents) {
+        n += CostOf(ent);
+    }
+    return n;
+}
+
+// Recycling for MapDrawCmds.
+// Freed cmds are kept on a list (linked through their first bytes), and
+// the mBackedUp bitmap is handed on from one cmd to the next, as are the
+// (empty) backup vectors, with room for every chunk of the map.
+static std::mutex sDrawCmdPoolLock;
+static void* sDrawCmdPool = nullptr;
+static int sDrawCmdPoolSize = 0;
+static constexpr int DRAWCMD_POOL_MAX = 16;
+static std::vector<bool> sSpareBackedUp;
+static std::vector<TilePoint> sSpareChunkPos;
+static std::vector<std::shared_ptr<CellChunk>> sSpareChunks;
+
+// Hand v on to spare, if it's got more room.
+template<typename T> static void recycle(std::vector<T>& v, std::vector<T>& spare)
+{
+    v.clear();
+    if (v.capacity() > spare.capacity()) {
+        spare.swap(v);
+    }
+}
+
+void* MapDrawCmd::operator new(size_t size)
+{
+    assert(size == sizeof(MapDrawCmd));
+    {
+        std::lock_guard<std::mutex> lock(sDrawCmdPoolLock);
+        if (sDrawCmdPool) {
+            void* p = sDrawCmdPool;
+            sDrawCmdPool = *(void**)p;
+            --sDrawCmdPoolSize;
+            return p;
+        }
+    }
+    return ::operator new(size);
+}
+
+void MapDrawCmd::operator delete(void* p)
+{
+    {
+        std::lock_guard<std::mutex> lock(sDrawCmdPoolLock);
+        if (sDrawCmdPoolSize < DRAWCMD_POOL_MAX) {
+            *(void**)p = sDrawCmdPool;
+            sDrawCmdPool = p;
+            ++sDrawCmdPoolSize;
+            return;
+        }
+    }
+    ::operator delete(p);
+}
 
 MapDrawCmd::MapDrawCmd(Model& ed, int mapNum) :
     Cmd(ed, DONE),
     mMapNum(mapNum)
 {
-    Proj& proj = mEd.proj;
-    Tilemap& map = proj.maps[mMapNum];
+    Tilemap const& map = mEd.GetMap(mMapNum);
     mDamageExtent = MapRect(TilePoint(0,0),0,0);
-    mBackup = map;
+    {
+        std::lock_guard<std::mutex> lock(sDrawCmdPoolLock);
+        mBackedUp.swap(sSpareBackedUp);
+        mChunkPos.swap(sSpareChunkPos);
+        mChunks.swap(sSpareChunks);
+    }
+    // All the room we could need, so drawing doesn't allocate.
+    size_t nchunks = (size_t)map.ChunksW() * map.ChunksH();
+    mBackedUp.assign(nchunks, false);
+    mChunkPos.reserve(nchunks);
+    mChunks.reserve(nchunks);
+}
+
+void MapDrawCmd::AboutToDraw(MapRect const& area)
+{
+    Tilemap const& map = mEd.proj.maps[mMapNum];
+    assert((int)mBackedUp.size() == map.ChunksW() * map.ChunksH());    // Not after Commit()!
+    MapRect r = map.Bounds().Clip(area);
+    if (r.IsEmpty()) {
+        return;
+    }
+
+    // Back up any chunks we haven't already got.
+    for (int cy = r.y / CHUNK_SIZE; cy <= (r.y + r.h - 1) / CHUNK_SIZE; ++cy) {
+        for (int cx = r.x / CHUNK_SIZE; cx <= (r.x + r.w - 1) / CHUNK_SIZE; ++cx) {
+            int idx = (cy * map.ChunksW()) + cx;
+            if (mBackedUp[idx]) {
+                continue;
+            }
+            mBackedUp[idx] = true;
+            mChunkPos.push_back(TilePoint(cx, cy));
+            mChunks.push_back(map.SharedChunk(cx, cy));
+        }
+    }
 }
 
 void MapDrawCmd::AddDamage(MapRect const& damage)
 {
     mEd.modified = true;
     mDamageExtent.Merge(damage);
-    for (auto l : mEd.listeners) {
-        l->ProjMapModified(mMapNum, damage);
-    }
+    mEd.NotifyMapModified(mMapNum, damage);
 }
 
 void MapDrawCmd::Commit()
 {
-    // Trim down saved area to just that which was changed.
-    // Just so we don't save a copy of the whole map for every edit!
+    // The chunks are all we need from here on, and they're kept in
+    // vectors just big enough (the big ones go back to the pool).
     assert(State() == DONE);
-    mBackupPos = mDamageExtent.Pos();
-    mBackup = mBackup.Copy(mDamageExtent);
+    std::vector<TilePoint> chunkPos(mChunkPos.begin(), mChunkPos.end());
+    std::vector<std::shared_ptr<CellChunk>> chunks(std::make_move_iterator(mChunks.begin()), std::make_move_iterator(mChunks.end()));
+    chunkPos.swap(mChunkPos);
+    chunks.swap(mChunks);
+    std::vector<bool> backedUp;
+    backedUp.swap(mBackedUp);
+    std::lock_guard<std::mutex> lock(sDrawCmdPoolLock);
+    recycle(backedUp, sSpareBackedUp);
+    recycle(chunkPos, sSpareChunkPos);
+    recycle(chunks, sSpareChunks);
+}
+
+size_t MapDrawCmd::Cost() const
+{
+    size_t n = sizeof(*this) + mChunks.capacity() * (sizeof(TilePoint) + sizeof(mChunks[0])) + mPacked.capacity();
+    for (auto const& chunk : mChunks) {
+        if (chunk) {
+            n += sizeof(CellChunk) / chunk.use_count();
+        }
+    }
+    return n;
+}
+
+void MapDrawCmd::Compress()
+{
+    if (!mPacked.empty()) {
+        return; // Already done.
+    }
+    assert(mBackedUp.empty());  // Commit()ed?
+    PackChunks(mChunks, mPacked);
 }
 
 void MapDrawCmd::Do()
@@ -48,28 +181,78 @@ void MapDrawCmd::Swap()
     Proj& proj = mEd.proj;
     Tilemap& map = proj.maps[mMapNum];
 
-    MapRect r = mBackup.Bounds();
-    TilePoint liveRowStart(mBackupPos);
-    TilePoint backupRowStart(0, 0);
-    for (int y = 0; y < r.h; ++y) {
-        Cell* live = map.CellPtr(liveRowStart);
-        Cell* backup = mBackup.CellPtr(backupRowStart);
-        //Cell* backup = mBackup.CellPtr(TilePoint(0,y));
-        for (int x = 0; x < r.w; ++x) {
-            Cell tmp = *live;
-            *live = *backup;
-            *backup = tmp;
-            //std::swap(*live, *backup);
-            ++live;
-            ++backup;
-        }
-        ++liveRowStart.y;
-        ++backupRowStart.y;
+    UnpackChunks(mChunks, mPacked);
+
+    for (size_t i = 0; i < mChunks.size(); ++i) {
+        TilePoint const& pos = mChunkPos[i];
+        auto live = map.SharedChunk(pos.x, pos.y);
+        map.SetSharedChunk(pos.x, pos.y, mChunks[i]);
+        mChunks[i] = live;
+    }
+    // Cells outside the damaged area weren't changed, so no need to
+    // tell anyone about them.
+    mEd.NotifyMapModified(mMapNum, mDamageExtent);
+}
+
+//
+// CompoundCmd
+//
+CompoundCmd::~CompoundCmd()
+{
+    for (Cmd* cmd : mCmds) {
+        delete cmd;
+    }
+}
+
+void CompoundCmd::Add(Cmd* cmd)
+{
+    assert(cmd->State() == mState);
+    mCmds.push_back(cmd);
+}
+
+void CompoundCmd::Do()
+{
+    mEd.HoldNotifications();
+    for (Cmd* cmd : mCmds) {
+        cmd->Do();
     }
-    MapRect affected(mBackup.Bounds());
-    affected.Translate(mBackupPos);
-    for (auto l : mEd.listeners) {
-        l->ProjMapModified(mMapNum, affected);
+    mEd.ReleaseNotifications();
+    mState = DONE;
+}
+
+void CompoundCmd::Undo()
+{
+    mEd.HoldNotifications();
+    for (auto it = mCmds.rbegin(); it != mCmds.rend(); ++it) {
+        (*it)->Undo();
+    }
+    mEd.ReleaseNotifications();
+    mState = NOT_DONE;
+}
+
+size_t CompoundCmd::Cost() const
+{
+    size_t n = sizeof(*this) + mCmds.capacity() * sizeof(Cmd*);
+    for (Cmd const* cmd : mCmds) {
+        n += cmd->Cost();
+    }
+    return n;
+}
+
+void CompoundCmd::Compress()
+{
+    for (Cmd* cmd : mCmds) {
+        cmd->Compress();
+    }
+}
+
+void CompoundCmd::Record(Cmd const& cmd)
+{
+    assert(!mCmds.empty() && mCmds.back() == &cmd);
+    RecordOut out(mRecord);
+    cmd.Write(out);
+    if (out.lossy) {
+        mLossy = true;
     }
 }
 
@@ -78,11 +261,14 @@ void MapDrawCmd::Swap()
 //
 void InsertMapsCmd::Do()
 {
+    for (size_t i = 0; i < mPacked.size(); ++i) {
+        mNewMaps[i].Unpack(mPacked[i]);
+    }
+    mPacked.clear();
+
     auto dest = mEd.proj.maps.begin() + mPos;
     mEd.proj.maps.insert(dest, mNewMaps.begin(), mNewMaps.end());
-    for (auto l : mEd.listeners) {
-        l->ProjMapsInserted(mPos, mNewMaps.size());
-    }
+    mEd.NotifyMapsInserted(mPos, mNewMaps.size());
 
     mEd.modified = true;
     mState = DONE;
@@ -92,12 +278,33 @@ void InsertMapsCmd::Undo()
 {
     auto& maps = mEd.proj.maps;
     maps.erase(maps.begin() + mPos, maps.begin() + mPos + mNewMaps.size());
-    for (auto l : mEd.listeners) {
-        l->ProjMapsRemoved(mPos, mNewMaps.size());
-    }
+    mEd.NotifyMapsRemoved(mPos, mNewMaps.size());
     mState = NOT_DONE;
 }
 
+size_t InsertMapsCmd::Cost() const
+{
+    size_t n = sizeof(*this);
+    for (auto const& map : mNewMaps) {
+        n += CostOf(map);
+    }
+    for (auto const& packed : mPacked) {
+        n += packed.capacity();
+    }
+    return n;
+}
+
+void InsertMapsCmd::Compress()
+{
+    if (!mPacked.empty()) {
+        return;
+    }
+    mPacked.resize(mNewMaps.size());
+    for (size_t i = 0; i < mNewMaps.size(); ++i) {
+        mNewMaps[i].Pack(mPacked[i]);
+    }
+}
+
 //
 // DeleteMapsCmd
 //
@@ -124,9 +331,7 @@ void DeleteMapsCmd::Do()
     maps.erase(beginIt, endIt);
 
     // Tell everyone.
-    for (auto l : mEd.listeners) {
-        l->ProjMapsRemoved(mBeginMap, mEndMap - mBeginMap);
-    }
+    mEd.NotifyMapsRemoved(mBeginMap, mEndMap - mBeginMap);
 
     mEd.modified = true;
     mState = DONE;
@@ -134,18 +339,44 @@ void DeleteMapsCmd::Do()
 
 void DeleteMapsCmd::Undo()
 {
+    for (size_t i = 0; i < mPacked.size(); ++i) {
+        mBackup[i].Unpack(mPacked[i]);
+    }
+    mPacked.clear();
+
     auto& maps = mEd.proj.maps;
-    maps.insert(maps.begin() + mBeginMap, mBackup.begin(), mBackup.end());
+    maps.insert(maps.begin() + mBeginMap,
+        std::make_move_iterator(mBackup.begin()),
+        std::make_move_iterator(mBackup.end()));
     mBackup.clear();
-    for (auto l : mEd.listeners) {
-        l->ProjMapsInserted(mBeginMap, mBackup.size());
-    }
+    mEd.NotifyMapsInserted(mBeginMap, mEndMap - mBeginMap);
 
     mEd.modified = true;
     mState = NOT_DONE;
 }
 
+size_t DeleteMapsCmd::Cost() const
+{
+    size_t n = sizeof(*this);
+    for (auto const& map : mBackup) {
+        n += CostOf(map);
+    }
+    for (auto const& packed : mPacked) {
+        n += packed.capacity();
+    }
+    return n;
+}
 
+void DeleteMapsCmd::Compress()
+{
+    if (!mPacked.empty()) {
+        return;
+    }
+    mPacked.resize(mBackup.size());
+    for (size_t i = 0; i < mBackup.size(); ++i) {
+        mBackup[i].Pack(mPacked[i]);
+    }
+}
 
 
 //
@@ -153,10 +384,14 @@ void DeleteMapsCmd::Undo()
 //
 void ReplaceCharsetCmd::Do()
 {
-    std::swap(mEd.proj.charset, mTiles);
-    for (auto l : mEd.listeners) {
-        l->ProjCharsetModified();
+    if (!mPacked.empty()) {
+        std::vector<uint8_t> images(mTiles.tw * mTiles.th * mTiles.ntiles);
+        RLEDecode(mPacked.data(), mPacked.data() + mPacked.size(), 1, images.data(), images.size());
+        mTiles.SetImages(std::move(images));
+        mPacked = std::vector<uint8_t>();
     }
+    std::swap(mEd.proj.charset, mTiles);
+    mEd.NotifyCharsetModified();
     mEd.modified = true;
     mState = DONE;
 }
@@ -167,6 +402,26 @@ void ReplaceCharsetCmd::Undo()
     mState = NOT_DONE;
 }
 
+size_t ReplaceCharsetCmd::Cost() const
+{
+    size_t n = sizeof(*this) + mPacked.capacity();
+    if (!mTiles.ImagesShared()) {
+        n += mTiles.Images().size();
+    }
+    return n;
+}
+
+void ReplaceCharsetCmd::Compress()
+{
+    // No point if the images are still in use elsewhere.
+    if (!mPacked.empty() || mTiles.Images().empty() || mTiles.ImagesShared()) {
+        return;
+    }
+    RLEEncode(mTiles.Images().data(), mTiles.Images().size(), 1, mPacked);
+    mPacked.shrink_to_fit();
+    mTiles.SetImages(std::vector<uint8_t>());
+}
+
 //
 // ResizeMapCmd
 //
@@ -179,10 +434,9 @@ ResizeMapCmd::ResizeMapCmd(Model& ed, int mapNum, MapRect r) :
 
 void ResizeMapCmd::Swap()
 {
+    mOther.Unpack(mPacked);
     std::swap(mEd.proj.maps[mMapNum], mOther);
-    for (auto l : mEd.listeners) {
-        l->ProjNuke();
-    }
+    mEd.NotifyNuke();
     mEd.modified = true;
 }
 
@@ -198,6 +452,18 @@ void ResizeMapCmd::Undo()
     mState = NOT_DONE;
 }
 
+size_t ResizeMapCmd::Cost() const
+{
+    return sizeof(*this) + CostOf(mOther) + mPacked.capacity();
+}
+
+void ResizeMapCmd::Compress()
+{
+    if (mPacked.empty()) {
+        mOther.Pack(mPacked);
+    }
+}
+
 
 //
 // ExchangeMapsCmd
@@ -212,9 +478,7 @@ ExchangeMapsCmd::ExchangeMapsCmd(Model& ed, int map1, int map2) :
 void ExchangeMapsCmd::Swap()
 {
     std::swap(mEd.proj.maps[mMap1], mEd.proj.maps[mMap2]);
-    for (auto l : mEd.listeners) {
-        l->ProjNuke();
-    }
+    mEd.NotifyNuke();
     mEd.modified = true;
 }
 
@@ -230,6 +494,116 @@ void ExchangeMapsCmd::Undo()
     mState = NOT_DONE;
 }
 
+//
+// RemapCmd
+//
+RemapCmd::RemapCmd(Model& ed, std::vector<int> const& mapNums, RemapTable const& table) :
+    Cmd(ed), mMapNums(mapNums), mTable(table)
+{
+    // No duplicates, or we'd have two threads on the same map.
+    std::sort(mMapNums.begin(), mMapNums.end());
+    mMapNums.erase(std::unique(mMapNums.begin(), mMapNums.end()), mMapNums.end());
+    for (int mapNum : mMapNums) {
+        assert(mapNum >= 0 && mapNum < (int)ed.proj.maps.size());
+    }
+    mInvertible = mTable.Invert(mInverse);
+    mPlanes = mTable.ChangedPlanes();
+}
+
+// Apply table to all our maps, one row of chunks per job.
+void RemapCmd::Apply(RemapTable const& table)
+{
+    struct Job {
+        int map;    // index into mMapNums
+        int cy;
+    };
+    // Decode any maps still in the file first (each is independent).
+    std::vector<char> bad(mMapNums.size());
+    ParallelFor((int)mMapNums.size(), [&](int i) {
+        bad[i] = !mEd.GetMap(mMapNums[i]).Materialize();
+    });
+    std::vector<Job> jobs;
+    for (int i = 0; i < (int)mMapNums.size(); ++i) {
+        if (bad[i]) {
+            continue;   // Bad cells are read-only (see Tilemap::IsBad()).
+        }
+        Tilemap& map = mEd.GetMap(mMapNums[i]);
+        map.OwnChunkTable();
+        for (int cy = 0; cy < map.ChunksH(); ++cy) {
+            jobs.push_back(Job{i, cy});
+        }
+    }
+
+    std::vector<MapRect> damage(jobs.size());
+    ParallelFor((int)jobs.size(), [&](int j) {
+        Tilemap& map = mEd.proj.maps[mMapNums[jobs[j].map]];
+        MapRect band(0, jobs[j].cy * CHUNK_SIZE, map.w, CHUNK_SIZE);
+        damage[j] = Remap(map, table, band, mPlanes);
+    });
+
+    mDamage.assign(mMapNums.size(), MapRect());
+    for (size_t j = 0; j < jobs.size(); ++j) {
+        mDamage[jobs[j].map].Merge(damage[j]);
+    }
+}
+
+void RemapCmd::Do()
+{
+    if (!mInvertible) {
+        // Keep the old cells (just shares them, until they're remapped).
+        mBefore.clear();
+        for (int mapNum : mMapNums) {
+            mBefore.push_back(mEd.GetMap(mapNum));
+            mBefore.back().ents.clear();
+        }
+    }
+    Apply(mTable);
+
+    mEd.HoldNotifications();
+    for (size_t i = 0; i < mMapNums.size(); ++i) {
+        if (!mDamage[i].IsEmpty()) {
+            mEd.NotifyMapModified(mMapNums[i], mDamage[i]);
+        }
+    }
+    mEd.ReleaseNotifications();
+    mEd.modified = true;
+    mState = DONE;
+}
+
+void RemapCmd::Undo()
+{
+    if (mInvertible) {
+        Apply(mInverse);
+    } else {
+        for (size_t i = 0; i < mMapNums.size(); ++i) {
+            Tilemap& map = mEd.GetMap(mMapNums[i]);
+            std::swap(map.ents, mBefore[i].ents);
+            map = std::move(mBefore[i]);
+        }
+        mBefore.clear();
+    }
+
+    mEd.HoldNotifications();
+    for (size_t i = 0; i < mMapNums.size(); ++i) {
+        if (!mDamage[i].IsEmpty()) {
+            mEd.NotifyMapModified(mMapNums[i], mDamage[i]);
+        }
+    }
+    mEd.ReleaseNotifications();
+    mEd.modified = true;
+    mState = NOT_DONE;
+}
+
+size_t RemapCmd::Cost() const
+{
+    size_t tables = mTable.tile.capacity() * sizeof(uint16_t) + mTable.ink.capacity() + mTable.paper.capacity();
+    size_t n = sizeof(*this) + (tables * 2) + mMapNums.capacity() * (sizeof(int) + sizeof(MapRect));
+    for (auto const& map : mBefore) {
+        n += CostOf(map);
+    }
+    return n;
+}
+
 //
 // InsertEntsCmd
 //
@@ -240,9 +614,7 @@ void InsertEntsCmd::Do()
     assert(mPos >= 0 && mPos <= (int)map.ents.size());
     auto dest = map.ents.begin() + mPos;
     map.ents.insert(dest, mNewEnts.begin(), mNewEnts.end());
-    for (auto l : mEd.listeners) {
-        l->ProjEntsInserted(mMapNum, mPos, mNewEnts.size());
-    }
+    mEd.NotifyEntsInserted(mMapNum, mPos, mNewEnts.size());
 
     mEd.modified = true;
     mState = DONE;
@@ -252,12 +624,19 @@ void InsertEntsCmd::Undo()
 {
     Tilemap& map = mEd.proj.maps[mMapNum];
     map.ents.erase(map.ents.begin() + mPos, map.ents.begin() + mPos + mNewEnts.size());
-    for (auto l : mEd.listeners) {
-        l->ProjEntsRemoved(mMapNum, mPos, mNewEnts.size());
-    }
+    mEd.NotifyEntsRemoved(mMapNum, mPos, mNewEnts.size());
     mState = NOT_DONE;
 }
 
+size_t InsertEntsCmd::Cost() const
+{
+    size_t n = sizeof(*this);
+    for (auto const& ent : mNewEnts) {
+        n += CostOf(ent);
+    }
+    return n;
+}
+
 //
 // DeleteEntsCmd
 //
@@ -277,9 +656,7 @@ void DeleteEntsCmd::Do()
     ents.erase(beginIt, endIt);
 
     // Tell everyone.
-    for (auto l : mEd.listeners) {
-        l->ProjEntsRemoved(mMapNum, mPos, mCount);
-    }
+    mEd.NotifyEntsRemoved(mMapNum, mPos, mCount);
 
     mEd.modified = true;
     mState = DONE;
@@ -291,14 +668,21 @@ void DeleteEntsCmd::Undo()
     auto& ents = mEd.GetMap(mMapNum).ents;
     ents.insert(ents.begin() + mPos, mBackup.begin(), mBackup.end());
     mBackup.clear();
-    for (auto l : mEd.listeners) {
-        l->ProjEntsInserted(mMapNum, mPos, mCount);
-    }
+    mEd.NotifyEntsInserted(mMapNum, mPos, mCount);
 
     mEd.modified = true;
     mState = NOT_DONE;
 }
 
+size_t DeleteEntsCmd::Cost() const
+{
+    size_t n = sizeof(*this);
+    for (auto const& ent : mBackup) {
+        n += CostOf(ent);
+    }
+    return n;
+}
+
 
 //
 // EditEntCmd
@@ -309,9 +693,7 @@ void EditEntCmd::Do()
     Tilemap& map = mEd.proj.maps[mMapNum];
 
     std::swap(map.ents[mEntNum], mEnt);
-    for (auto l : mEd.listeners) {
-        l->ProjEntChanged(mMapNum, mEntNum, mEnt, map.ents[mEntNum]);
-    }
+    mEd.NotifyEntChanged(mMapNum, mEntNum, mEnt, map.ents[mEntNum]);
 
     mEd.modified = true;
     mState = DONE;
@@ -323,6 +705,57 @@ void EditEntCmd::Undo()
     mState = NOT_DONE;
 }
 
+size_t EditEntCmd::Cost() const
+{
+    return sizeof(*this) + CostOf(mEnt);
+}
+
+// Apply fn to every value in one plane of the map (eg &CellChunk::tile),
+// a chunk at a time. fn(v) returns the new value.
+// Chunks which don't need changing are left alone (and stay shared), and
+// uniform chunks are dealt with as a single cell.
+template<typename T, typename F> static void remapPlane(Tilemap& map, T (CellChunk::*plane)[CHUNK_CELLS], F fn)
+{
+    if (!map.Materialize()) {
+        return;     // Bad cells are read-only (see Tilemap::IsBad()).
+    }
+    // Uniform chunks we've seen and their replacements, for sharing.
+    std::vector<std::pair<CellChunk const*, std::shared_ptr<CellChunk>>> uniforms;
+
+    for (int cy = 0; cy < map.ChunksH(); ++cy) {
+        for (int cx = 0; cx < map.ChunksW(); ++cx) {
+            std::shared_ptr<CellChunk> src = map.SharedChunk(cx, cy);
+            T const* in = (*src).*plane;
+            if (src->uniform) {
+                if (fn(in[0]) == in[0]) {
+                    continue;
+                }
+                auto it = std::find_if(uniforms.begin(), uniforms.end(),
+                    [&](auto const& u) {return u.first == src.get();});
+                if (it == uniforms.end()) {
+                    auto out = std::make_shared<CellChunk>(*src);
+                    std::fill(std::begin((*out).*plane), std::end((*out).*plane), fn(in[0]));
+                    uniforms.emplace_back(src.get(), out);
+                    it = uniforms.end() - 1;
+                }
+                map.SetSharedChunk(cx, cy, it->second);
+                continue;
+            }
+
+            bool changes = std::any_of(in, in + CHUNK_CELLS,
+                [&](T v) {return fn(v) != v;});
+            if (!changes) {
+                continue;
+            }
+            src.reset();    // So Chunk() doesn't need to copy.
+            T* out = map.Chunk(cx, cy).*plane;
+            for (int i = 0; i < CHUNK_CELLS; ++i) {
+                out[i] = fn(out[i]);
+            }
+        }
+    }
+}
+
 //
 // RemapTilesCmd
 //
@@ -330,13 +763,9 @@ void EditEntCmd::Undo()
 
 static void swapTiles(Tilemap& map, uint16_t a, uint16_t b)
 {
-    for (Cell& cell : map.cells) {
-        if (cell.tile == a) {
-            cell.tile = b;
-        } else if (cell.tile == b) {
-            cell.tile = a;
-        }
-    }
+    remapPlane(map, &CellChunk::tile, [=](uint16_t t) -> uint16_t {
+        return t == a ? b : (t == b ? a : t);
+    });
 }
 
 void RemapTilesCmd::Do()
@@ -344,9 +773,7 @@ void RemapTilesCmd::Do()
     Proj& proj = mEd.proj;
     Tilemap& map = proj.maps[mMapNum];
     swapTiles(map, mTileA, mTileB);
-    for (auto l : mEd.listeners) {
-        l->ProjMapModified(mMapNum, map.Bounds());
-    }
+    mEd.NotifyMapModified(mMapNum, map.Bounds());
     mState = DONE;
 }
 
@@ -355,9 +782,7 @@ void RemapTilesCmd::Undo()
     Proj& proj = mEd.proj;
     Tilemap& map = proj.maps[mMapNum];
     swapTiles(map, mTileA, mTileB);
-    for (auto l : mEd.listeners) {
-        l->ProjMapModified(mMapNum, map.Bounds());
-    }
+    mEd.NotifyMapModified(mMapNum, map.Bounds());
     mState = NOT_DONE;
 }
 
@@ -369,13 +794,9 @@ void RemapTilesCmd::Undo()
 
 static void swapInk(Tilemap& map, uint16_t a, uint16_t b)
 {
-    for (Cell& cell : map.cells) {
-        if (cell.ink == a) {
-            cell.ink = b;
-        } else if (cell.ink == b) {
-            cell.ink = a;
-        }
-    }
+    remapPlane(map, &CellChunk::ink, [=](uint8_t i) -> uint8_t {
+        return i == a ? b : (i == b ? a : i);
+    });
 }
 
 void RemapInkCmd::Do()
@@ -383,9 +804,7 @@ void RemapInkCmd::Do()
     Proj& proj = mEd.proj;
     Tilemap& map = proj.maps[mMapNum];
     swapInk(map, mInkA, mInkB);
-    for (auto l : mEd.listeners) {
-        l->ProjMapModified(mMapNum, map.Bounds());
-    }
+    mEd.NotifyMapModified(mMapNum, map.Bounds());
     mState = DONE;
 }
 
@@ -394,10 +813,383 @@ void RemapInkCmd::Undo()
     Proj& proj = mEd.proj;
     Tilemap& map = proj.maps[mMapNum];
     swapInk(map, mInkA, mInkB);
-    for (auto l : mEd.listeners) {
-        l->ProjMapModified(mMapNum, map.Bounds());
-    }
+    mEd.NotifyMapModified(mMapNum, map.Bounds());
     mState = NOT_DONE;
 }
 
 
+
+
+//
+// Journal records (see Cmd::Write() and journal.h)
+//
+
+// Written out to the journal, so don't renumber!
+enum {
+    CMD_COMPOUND = 1,
+    CMD_MAPDRAW,
+    CMD_INSERTMAPS,
+    CMD_DELETEMAPS,
+    CMD_REPLACECHARSET,
+    CMD_RESIZEMAP,
+    CMD_EXCHANGEMAPS,
+    CMD_REMAP,
+    CMD_INSERTENTS,
+    CMD_DELETEENTS,
+    CMD_EDITENT,
+    CMD_REMAPTILES,
+    CMD_REMAPINK
+};
+
+Cmd* ReadCmd(Model& ed, RecordIn& in, Cmd::CmdState state)
+{
+    Cmd* cmd = nullptr;
+    switch (in.U8()) {
+        case CMD_COMPOUND: cmd = CompoundCmd::Read(ed, in, state); break;
+        case CMD_MAPDRAW: cmd = MapDrawCmd::Read(ed, in, state); break;
+        case CMD_INSERTMAPS: cmd = InsertMapsCmd::Read(ed, in, state); break;
+        case CMD_DELETEMAPS: cmd = DeleteMapsCmd::Read(ed, in, state); break;
+        case CMD_REPLACECHARSET: cmd = ReplaceCharsetCmd::Read(ed, in, state); break;
+        case CMD_RESIZEMAP: cmd = ResizeMapCmd::Read(ed, in, state); break;
+        case CMD_EXCHANGEMAPS: cmd = ExchangeMapsCmd::Read(ed, in, state); break;
+        case CMD_REMAP: cmd = RemapCmd::Read(ed, in, state); break;
+        case CMD_INSERTENTS: cmd = InsertEntsCmd::Read(ed, in, state); break;
+        case CMD_DELETEENTS: cmd = DeleteEntsCmd::Read(ed, in, state); break;
+        case CMD_EDITENT: cmd = EditEntCmd::Read(ed, in, state); break;
+        case CMD_REMAPTILES: cmd = RemapTilesCmd::Read(ed, in, state); break;
+        case CMD_REMAPINK: cmd = RemapInkCmd::Read(ed, in, state); break;
+        default: in.ok = false; break;
+    }
+    if (!in.ok) {
+        delete cmd;
+        return nullptr;
+    }
+    return cmd;
+}
+
+// Map numbers and the like can't be checked against the Proj (it might not
+// match until earlier parts of a CompoundCmd are done), but they can at
+// least be sane.
+static int readIndex(RecordIn& in)
+{
+    int i = in.Int();
+    if (i < 0) {
+        in.ok = false;
+        return 0;
+    }
+    return i;
+}
+
+void CompoundCmd::Write(RecordOut& out) const
+{
+    out.U8(CMD_COMPOUND);
+    out.U32((uint32_t)mCmds.size());
+    out.Bytes(mRecord.data(), mRecord.size());
+    if (mLossy) {
+        out.lossy = true;
+    }
+}
+
+Cmd* CompoundCmd::Read(Model& ed, RecordIn& in, CmdState state)
+{
+    CompoundCmd* cmd = new CompoundCmd(ed, state);
+    uint32_t n = in.U32();
+    for (uint32_t i = 0; i < n && in.ok; ++i) {
+        Cmd* sub = ReadCmd(ed, in, state);
+        if (sub) {
+            cmd->mCmds.push_back(sub);
+        }
+    }
+    return cmd;
+}
+
+// Both the old and new chunks are written.
+void MapDrawCmd::Write(RecordOut& out) const
+{
+    assert(mPacked.empty());
+    Tilemap const& map = mEd.proj.maps[mMapNum];
+    out.U8(CMD_MAPDRAW);
+    out.Int(mMapNum);
+    out.Rect(mDamageExtent);
+    out.U32((uint32_t)mChunkPos.size());
+    for (size_t i = 0; i < mChunkPos.size(); ++i) {
+        TilePoint const& pos = mChunkPos[i];
+        out.Int(pos.x);
+        out.Int(pos.y);
+        out.Chunk(*mChunks[i]);
+        out.Chunk(map.ChunkConst(pos.x, pos.y));
+    }
+}
+
+Cmd* MapDrawCmd::Read(Model& ed, RecordIn& in, CmdState state)
+{
+    MapDrawCmd* cmd = new MapDrawCmd(ed, state);
+    cmd->mMapNum = readIndex(in);
+    cmd->mDamageExtent = in.Rect();
+    uint32_t n = in.U32();
+    for (uint32_t i = 0; i < n && in.ok; ++i) {
+        int cx = readIndex(in);
+        int cy = readIndex(in);
+        auto before = in.Chunk();
+        auto after = in.Chunk();
+        cmd->mChunkPos.push_back(TilePoint(cx, cy));
+        cmd->mChunks.push_back(state == DONE ? before : after);
+    }
+    return cmd;
+}
+
+void InsertMapsCmd::Write(RecordOut& out) const
+{
+    assert(mPacked.empty());
+    out.U8(CMD_INSERTMAPS);
+    out.Int(mPos);
+    out.Maps(mNewMaps);
+}
+
+Cmd* InsertMapsCmd::Read(Model& ed, RecordIn& in, CmdState state)
+{
+    int pos = readIndex(in);
+    InsertMapsCmd* cmd = new InsertMapsCmd(ed, in.Maps(), pos);
+    cmd->mState = state;
+    return cmd;
+}
+
+void DeleteMapsCmd::Write(RecordOut& out) const
+{
+    assert(mPacked.empty());
+    out.U8(CMD_DELETEMAPS);
+    out.Int(mBeginMap);
+    out.Int(mEndMap);
+    out.Maps(mBackup);
+}
+
+Cmd* DeleteMapsCmd::Read(Model& ed, RecordIn& in, CmdState state)
+{
+    DeleteMapsCmd* cmd = new DeleteMapsCmd(ed, state);
+    cmd->mBeginMap = readIndex(in);
+    cmd->mEndMap = readIndex(in);
+    std::vector<Tilemap> backup = in.Maps();
+    if (cmd->mEndMap < cmd->mBeginMap || (int)backup.size() != cmd->mEndMap - cmd->mBeginMap) {
+        in.ok = false;
+    }
+    if (state == DONE) {
+        cmd->mBackup = std::move(backup);
+    }
+    return cmd;
+}
+
+void ReplaceCharsetCmd::Write(RecordOut& out) const
+{
+    assert(mPacked.empty());
+    out.U8(CMD_REPLACECHARSET);
+    out.Tiles(mTiles);
+    out.Tiles(mEd.proj.charset);
+}
+
+Cmd* ReplaceCharsetCmd::Read(Model& ed, RecordIn& in, CmdState state)
+{
+    Charset before = in.Tiles();
+    Charset after = in.Tiles();
+    ReplaceCharsetCmd* cmd = new ReplaceCharsetCmd(ed, state == DONE ? before : after);
+    cmd->mState = state;
+    return cmd;
+}
+
+void ResizeMapCmd::Write(RecordOut& out) const
+{
+    assert(mPacked.empty());
+    out.U8(CMD_RESIZEMAP);
+    out.Int(mMapNum);
+    out.Map(mOther);
+    out.Map(mEd.proj.maps[mMapNum]);
+}
+
+Cmd* ResizeMapCmd::Read(Model& ed, RecordIn& in, CmdState state)
+{
+    ResizeMapCmd* cmd = new ResizeMapCmd(ed, state);
+    cmd->mMapNum = readIndex(in);
+    Tilemap before = in.Map();
+    Tilemap after = in.Map();
+    cmd->mOther = std::move(state == DONE ? before : after);
+    return cmd;
+}
+
+void ExchangeMapsCmd::Write(RecordOut& out) const
+{
+    out.U8(CMD_EXCHANGEMAPS);
+    out.Int(mMap1);
+    out.Int(mMap2);
+}
+
+Cmd* ExchangeMapsCmd::Read(Model& ed, RecordIn& in, CmdState state)
+{
+    ExchangeMapsCmd* cmd = new ExchangeMapsCmd(ed, state);
+    cmd->mMap1 = readIndex(in);
+    cmd->mMap2 = readIndex(in);
+    return cmd;
+}
+
+// Tables are written as just the entries which aren't identity.
+template<typename T> static void writeTable(RecordOut& out, std::vector<T> const& table)
+{
+    uint32_t n = 0;
+    for (size_t i = 0; i < table.size(); ++i) {
+        n += (table[i] != (T)i) ? 1 : 0;
+    }
+    out.U32(n);
+    for (size_t i = 0; i < table.size(); ++i) {
+        if (table[i] != (T)i) {
+            out.U32((uint32_t)i);
+            out.U32(table[i]);
+        }
+    }
+}
+
+template<typename T> static void readTable(RecordIn& in, std::vector<T>& table)
+{
+    uint32_t n = in.U32();
+    for (uint32_t i = 0; i < n && in.ok; ++i) {
+        uint32_t idx = in.U32();
+        uint32_t v = in.U32();
+        if (idx >= table.size() || v >= table.size()) {
+            in.ok = false;
+            return;
+        }
+        table[idx] = (T)v;
+    }
+}
+
+void RemapCmd::Write(RecordOut& out) const
+{
+    out.U8(CMD_REMAP);
+    out.U32((uint32_t)mMapNums.size());
+    for (size_t i = 0; i < mMapNums.size(); ++i) {
+        out.Int(mMapNums[i]);
+        out.Rect(mDamage[i]);
+    }
+    writeTable(out, mTable.tile);
+    writeTable(out, mTable.ink);
+    writeTable(out, mTable.paper);
+    if (!mInvertible) {
+        out.Maps(mBefore);
+    }
+}
+
+Cmd* RemapCmd::Read(Model& ed, RecordIn& in, CmdState state)
+{
+    RemapCmd* cmd = new RemapCmd(ed, state);
+    uint32_t n = in.U32();
+    for (uint32_t i = 0; i < n && in.ok; ++i) {
+        cmd->mMapNums.push_back(readIndex(in));
+        cmd->mDamage.push_back(in.Rect());
+    }
+    readTable(in, cmd->mTable.tile);
+    readTable(in, cmd->mTable.ink);
+    readTable(in, cmd->mTable.paper);
+    cmd->mInvertible = cmd->mTable.Invert(cmd->mInverse);
+    cmd->mPlanes = cmd->mTable.ChangedPlanes();
+    if (!cmd->mInvertible) {
+        std::vector<Tilemap> before = in.Maps();
+        if (before.size() != cmd->mMapNums.size()) {
+            in.ok = false;
+        }
+        if (state == DONE) {
+            cmd->mBefore = std::move(before);
+        }
+    }
+    return cmd;
+}
+
+void InsertEntsCmd::Write(RecordOut& out) const
+{
+    out.U8(CMD_INSERTENTS);
+    out.Int(mMapNum);
+    out.Int(mPos);
+    out.Ents(mNewEnts);
+}
+
+Cmd* InsertEntsCmd::Read(Model& ed, RecordIn& in, CmdState state)
+{
+    int mapNum = readIndex(in);
+    int pos = readIndex(in);
+    InsertEntsCmd* cmd = new InsertEntsCmd(ed, mapNum, in.Ents(), pos);
+    cmd->mState = state;
+    return cmd;
+}
+
+void DeleteEntsCmd::Write(RecordOut& out) const
+{
+    out.U8(CMD_DELETEENTS);
+    out.Int(mMapNum);
+    out.Int(mPos);
+    out.Ents(mBackup);
+}
+
+Cmd* DeleteEntsCmd::Read(Model& ed, RecordIn& in, CmdState state)
+{
+    int mapNum = readIndex(in);
+    int pos = readIndex(in);
+    std::vector<Ent> backup = in.Ents();
+    DeleteEntsCmd* cmd = new DeleteEntsCmd(ed, mapNum, pos, (int)backup.size());
+    cmd->mState = state;
+    if (state == DONE) {
+        cmd->mBackup = std::move(backup);
+    }
+    return cmd;
+}
+
+void EditEntCmd::Write(RecordOut& out) const
+{
+    out.U8(CMD_EDITENT);
+    out.Int(mMapNum);
+    out.Int(mEntNum);
+    out.Entity(mEnt);
+    out.Entity(mEd.proj.maps[mMapNum].ents[mEntNum]);
+}
+
+Cmd* EditEntCmd::Read(Model& ed, RecordIn& in, CmdState state)
+{
+    int mapNum = readIndex(in);
+    int entNum = readIndex(in);
+    Ent before = in.Entity();
+    Ent after = in.Entity();
+    EditEntCmd* cmd = new EditEntCmd(ed, mapNum, state == DONE ? before : after, entNum);
+    cmd->mState = state;
+    return cmd;
+}
+
+void RemapTilesCmd::Write(RecordOut& out) const
+{
+    out.U8(CMD_REMAPTILES);
+    out.Int(mMapNum);
+    out.Int(mTileA);
+    out.Int(mTileB);
+}
+
+Cmd* RemapTilesCmd::Read(Model& ed, RecordIn& in, CmdState state)
+{
+    int mapNum = readIndex(in);
+    uint16_t a = (uint16_t)in.Int();
+    uint16_t b = (uint16_t)in.Int();
+    RemapTilesCmd* cmd = new RemapTilesCmd(ed, mapNum, a, b);
+    cmd->mState = state;
+    return cmd;
+}
+
+void RemapInkCmd::Write(RecordOut& out) const
+{
+    out.U8(CMD_REMAPINK);
+    out.Int(mMapNum);
+    out.Int(mInkA);
+    out.Int(mInkB);
+}
+
+Cmd* RemapInkCmd::Read(Model& ed, RecordIn& in, CmdState state)
+{
+    int mapNum = readIndex(in);
+    uint8_t a = (uint8_t)in.Int();
+    uint8_t b = (uint8_t)in.Int();
+    RemapInkCmd* cmd = new RemapInkCmd(ed, mapNum, a, b);
+    cmd->mState = state;
+    return cmd;
+}
@@ -1,8 +1,11 @@
 #pragma once
 
 #include "proj.h"
+#include "draw.h"
 
 class Model;
+class RecordOut;
+class RecordIn;
 
 class Cmd
 {
@@ -13,27 +16,96 @@ public:
     virtual void Do() = 0;
     virtual void Undo() = 0;
     CmdState State() const {return mState;}
+
+    // Approximate memory used by this cmd, in bytes.
+    virtual size_t Cost() const {return sizeof(*this);}
+    // Squash down any data held for undo/redo, to save memory.
+    // Do() and Undo() unpack it again as needed.
+    virtual void Compress() {}
+
+    // Write out enough to recreate the cmd in either state, for the undo
+    // journal (see journal.h).
+    // Called just after the cmd has been done (and before any Compress()),
+    // so the Proj holds the "after" data.
+    virtual void Write(RecordOut& out) const = 0;
+
+    // Where the cmd was recorded in the undo journal (-1 = not recorded).
+    int64_t journalPos{-1};
 protected:
     Model& mEd;
     CmdState mState;
 };
 
-class MapDrawCmd : public Cmd
+// Recreate a cmd from a record made by Cmd::Write(), in the given state.
+// Returns nullptr upon bad data.
+Cmd* ReadCmd(Model& ed, RecordIn& in, Cmd::CmdState state);
+
+// A group of Cmds, done and undone as a single step.
+// Usually built via Model::BeginTransaction()/EndTransaction().
+// Listeners get merged notifications for the whole group.
+class CompoundCmd : public Cmd
+{
+public:
+    CompoundCmd() = delete;
+    CompoundCmd(Model& ed, CmdState initial = DONE) : Cmd(ed, initial) {}
+    virtual ~CompoundCmd();
+    // Takes ownership. cmd should be in the same state as this.
+    void Add(Cmd* cmd);
+    bool IsEmpty() const {return mCmds.empty();}
+    virtual void Do();
+    virtual void Undo();
+    virtual size_t Cost() const;
+    virtual void Compress();
+    virtual void Write(RecordOut& out) const;
+    static Cmd* Read(Model& ed, RecordIn& in, CmdState state);
+    // Record cmd (just added) for the journal, while the Proj still
+    // matches it.
+    void Record(Cmd const& cmd);
+private:
+    std::vector<Cmd*> mCmds;
+    std::vector<uint8_t> mRecord;   // Write()s of mCmds, if journaled
+    bool mLossy{false};             // (see RecordOut::lossy)
+};
+
+// Records drawing on a map.
+// Pass it in as the IDrawListener to the drawing functions so it can back up
+// the parts of the map which are about to be changed, then call AddDamage()
+// afterward to tell everyone about the changes.
+class MapDrawCmd : public Cmd, public IDrawListener
 {
 public:
     MapDrawCmd() = delete;
     MapDrawCmd(Model& ed, int mapNum);
 
+    // IDrawListener
+    virtual void AboutToDraw(MapRect const& area);
+
     void AddDamage(MapRect const& damage);
     void Commit();  // no more plonking!
+    // Number of chunks backed up so far.
+    size_t NumBackedUp() const {return mChunks.size();}
+
+    // One of these is made for every stroke, so they're recycled.
+    static void* operator new(size_t size);
+    static void operator delete(void* p);
 
     virtual void Do();
     virtual void Undo();
+    virtual size_t Cost() const;
+    virtual void Compress();
+    virtual void Write(RecordOut& out) const;
+    static Cmd* Read(Model& ed, RecordIn& in, CmdState state);
 private:
+    MapDrawCmd(Model& ed, CmdState state) : Cmd(ed, state) {}
+    // The backup is held as chunks of the map. Backing up a chunk just
+    // shares it - the map makes its own copy when it's drawn upon.
+    // So the cost depends on how much is drawn, not on the size of the map.
     void Swap();
     int mMapNum;
-    TilePoint mBackupPos;   // position of mBackup upon map
-    Tilemap mBackup;
+    std::vector<bool> mBackedUp;  // which chunks we've got (until Commit(), then recycled)
+    std::vector<TilePoint> mChunkPos;   // chunk coords of backups
+    std::vector<std::shared_ptr<CellChunk>> mChunks;
+    std::vector<uint8_t> mPacked;   // if compressed
     MapRect mDamageExtent;
 };
 
@@ -42,12 +114,20 @@ class InsertMapsCmd : public Cmd
 {
 public:
     InsertMapsCmd() = delete;
+    // The maps share their cells with newMaps (until modified).
     InsertMapsCmd(Model& ed, std::vector<Tilemap> const& newMaps, int pos) :
         Cmd(ed), mNewMaps(newMaps), mPos(pos) {}
+    InsertMapsCmd(Model& ed, std::vector<Tilemap>&& newMaps, int pos) :
+        Cmd(ed), mNewMaps(std::move(newMaps)), mPos(pos) {}
     virtual void Do();
     virtual void Undo();
+    virtual size_t Cost() const;
+    virtual void Compress();
+    virtual void Write(RecordOut& out) const;
+    static Cmd* Read(Model& ed, RecordIn& in, CmdState state);
 private:
     std::vector<Tilemap> mNewMaps;
+    std::vector<std::vector<uint8_t>> mPacked;
     int mPos;
 };
 
@@ -58,8 +138,14 @@ public:
     DeleteMapsCmd(Model& ed, int beginMap, int endMap);
     virtual void Do();
     virtual void Undo();
+    virtual size_t Cost() const;
+    virtual void Compress();
+    virtual void Write(RecordOut& out) const;
+    static Cmd* Read(Model& ed, RecordIn& in, CmdState state);
 private:
+    DeleteMapsCmd(Model& ed, CmdState state) : Cmd(ed, state) {}
     std::vector<Tilemap> mBackup;
+    std::vector<std::vector<uint8_t>> mPacked;
     int mBeginMap;
     int mEndMap;
 };
@@ -72,8 +158,13 @@ public:
         Cmd(ed), mTiles(newTiles) {}
     virtual void Do();
     virtual void Undo();
+    virtual size_t Cost() const;
+    virtual void Compress();
+    virtual void Write(RecordOut& out) const;
+    static Cmd* Read(Model& ed, RecordIn& in, CmdState state);
 private:
     Charset mTiles;
+    std::vector<uint8_t> mPacked;   // mTiles.images, if compressed
 };
 
 // Change the size of a given map.
@@ -84,10 +175,16 @@ public:
     ResizeMapCmd(Model& ed, int mapNum, MapRect newDimensions);
     virtual void Do();
     virtual void Undo();
+    virtual size_t Cost() const;
+    virtual void Compress();
+    virtual void Write(RecordOut& out) const;
+    static Cmd* Read(Model& ed, RecordIn& in, CmdState state);
 private:
+    ResizeMapCmd(Model& ed, CmdState state) : Cmd(ed, state) {}
     void Swap();
     int mMapNum;
     Tilemap mOther;
+    std::vector<uint8_t> mPacked;   // mOther's cells, if compressed
 };
 
 // Exchange two maps.
@@ -98,12 +195,41 @@ public:
     ExchangeMapsCmd(Model& ed, int map1, int map2);
     virtual void Do();
     virtual void Undo();
+    virtual void Write(RecordOut& out) const;
+    static Cmd* Read(Model& ed, RecordIn& in, CmdState state);
 private:
+    ExchangeMapsCmd(Model& ed, CmdState state) : Cmd(ed, state) {}
     void Swap();
     int mMap1;
     int mMap2;
 };
 
+// Remap cells on a set of maps through lookup tables (eg to reorganise the
+// charset). Big jobs are split across worker threads.
+// Undone by remapping through the inverse tables if there are any,
+// otherwise by restoring the old cells.
+class RemapCmd : public Cmd
+{
+public:
+    RemapCmd() = delete;
+    RemapCmd(Model& ed, std::vector<int> const& mapNums, RemapTable const& table);
+    virtual void Do();
+    virtual void Undo();
+    virtual size_t Cost() const;
+    virtual void Write(RecordOut& out) const;
+    static Cmd* Read(Model& ed, RecordIn& in, CmdState state);
+private:
+    RemapCmd(Model& ed, CmdState state) : Cmd(ed, state) {}
+    void Apply(RemapTable const& table);
+    std::vector<int> mMapNums;
+    RemapTable mTable;
+    RemapTable mInverse;
+    bool mInvertible;
+    int mPlanes;    // DRAWFLAG_* bits
+    std::vector<MapRect> mDamage;   // per map, from Do()
+    std::vector<Tilemap> mBefore;   // if not invertible
+};
+
 class InsertEntsCmd : public Cmd
 {
 public:
@@ -112,6 +238,9 @@ public:
         Cmd(ed), mMapNum(mapNum), mPos(pos), mNewEnts(newEnts) {}
     virtual void Do();
     virtual void Undo();
+    virtual size_t Cost() const;
+    virtual void Write(RecordOut& out) const;
+    static Cmd* Read(Model& ed, RecordIn& in, CmdState state);
 private:
     int mMapNum;
     int mPos;
@@ -126,6 +255,9 @@ public:
         Cmd(ed), mMapNum(mapNum), mPos(pos), mCount(count) {}
     virtual void Do();
     virtual void Undo();
+    virtual size_t Cost() const;
+    virtual void Write(RecordOut& out) const;
+    static Cmd* Read(Model& ed, RecordIn& in, CmdState state);
 private:
     int mMapNum;
     int mPos;
@@ -142,6 +274,9 @@ public:
         Cmd(ed), mMapNum(mapNum), mEnt(newData), mEntNum(entNum) {}
     virtual void Do();
     virtual void Undo();
+    virtual size_t Cost() const;
+    virtual void Write(RecordOut& out) const;
+    static Cmd* Read(Model& ed, RecordIn& in, CmdState state);
 private:
     int mMapNum;
     Ent mEnt;
@@ -158,6 +293,8 @@ public:
         Cmd(ed), mMapNum(mapNum), mTileA(tileA), mTileB(tileB) {}
     virtual void Do();
     virtual void Undo();
+    virtual void Write(RecordOut& out) const;
+    static Cmd* Read(Model& ed, RecordIn& in, CmdState state);
 private:
     int mMapNum;
     uint16_t mTileA;
@@ -173,6 +310,8 @@ public:
         Cmd(ed), mMapNum(mapNum), mInkA(inkA), mInkB(inkB) {}
     virtual void Do();
     virtual void Undo();
+    virtual void Write(RecordOut& out) const;
+    static Cmd* Read(Model& ed, RecordIn& in, CmdState state);
 private:
     int mMapNum;
     uint8_t mInkA;
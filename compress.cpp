@@ -0,0 +1,255 @@
+#include "compress.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cstring>
+
+// Packet format:
+// header byte h, then:
+//   h < 0x80: (h+1) literal elements follow.
+//   h >= 0x80: one element follows, repeated (h-0x80)+1 times.
+static constexpr size_t MAXPACKET = 128;
+
+void RLEEncode(uint8_t const* src, size_t n, size_t elemSize, std::vector<uint8_t>& out)
+{
+    auto same = [=](size_t i, size_t j) -> bool {
+        return std::memcmp(src + i * elemSize, src + j * elemSize, elemSize) == 0;
+    };
+
+    size_t i = 0;
+    while (i < n) {
+        // How long a run starts here?
+        size_t run = 1;
+        while (i + run < n && run < MAXPACKET && same(i, i + run)) {
+            ++run;
+        }
+        if (run > 1) {
+            out.push_back((uint8_t)(0x80 + (run - 1)));
+            out.insert(out.end(), src + i * elemSize, src + (i + 1) * elemSize);
+            i += run;
+            continue;
+        }
+
+        // Literals, up until the next run (of 2 or more).
+        size_t lit = 1;
+        while (i + lit < n && lit < MAXPACKET) {
+            if (i + lit + 1 < n && same(i + lit, i + lit + 1)) {
+                break;
+            }
+            ++lit;
+        }
+        out.push_back((uint8_t)(lit - 1));
+        out.insert(out.end(), src + i * elemSize, src + (i + lit) * elemSize);
+        i += lit;
+    }
+}
+
+uint8_t const* RLEDecode(uint8_t const* src, uint8_t const* end, size_t elemSize, uint8_t* dest, size_t n)
+{
+    size_t i = 0;
+    while (i < n) {
+        if (src >= end) {
+            return nullptr;
+        }
+        uint8_t h = *src++;
+        if (h & 0x80) {
+            size_t run = (h - 0x80) + 1;
+            if (run > n - i || (size_t)(end - src) < elemSize) {
+                return nullptr;
+            }
+            for (size_t j = 0; j < run; ++j) {
+                std::memcpy(dest, src, elemSize);
+                dest += elemSize;
+            }
+            src += elemSize;
+            i += run;
+        } else {
+            size_t lit = h + 1;
+            if (lit > n - i || (size_t)(end - src) < lit * elemSize) {
+                return nullptr;
+            }
+            std::memcpy(dest, src, lit * elemSize);
+            dest += lit * elemSize;
+            src += lit * elemSize;
+            i += lit;
+        }
+    }
+    return src;
+}
+
+
+void PackChunks(std::vector<std::shared_ptr<CellChunk>>& chunks, std::vector<uint8_t>& packed)
+{
+    for (auto& chunk : chunks) {
+        if (chunk && chunk.use_count() == 1) {
+            // Planes compress better separately.
+            RLEEncode((uint8_t const*)chunk->tile, CHUNK_CELLS, sizeof(uint16_t), packed);
+            RLEEncode(chunk->ink, CHUNK_CELLS, 1, packed);
+            RLEEncode(chunk->paper, CHUNK_CELLS, 1, packed);
+            chunk.reset();
+        }
+    }
+    packed.shrink_to_fit();
+}
+
+void UnpackChunks(std::vector<std::shared_ptr<CellChunk>>& chunks, std::vector<uint8_t>& packed)
+{
+    uint8_t const* p = packed.data();
+    uint8_t const* end = packed.data() + packed.size();
+    for (auto& chunk : chunks) {
+        if (!chunk) {
+            chunk = std::make_shared<CellChunk>();
+            p = RLEDecode(p, end, sizeof(uint16_t), (uint8_t*)chunk->tile, CHUNK_CELLS);
+            assert(p);
+            p = RLEDecode(p, end, 1, chunk->ink, CHUNK_CELLS);
+            assert(p);
+            p = RLEDecode(p, end, 1, chunk->paper, CHUNK_CELLS);
+            assert(p);
+        }
+    }
+    assert(p == end);
+    packed = std::vector<uint8_t>();
+}
+
+
+
+// LZ format: a series of sequences, each:
+//   u8 token: high nibble = literal count, low nibble = match length - 4.
+//     A nibble of 15 means more of the count follows, as bytes which are
+//     added on until one is less than 255.
+//   (literal bytes)
+//   u16 match offset (back from the current output position)
+// The last sequence stops after its literals.
+static constexpr size_t LZ_MINMATCH = 4;
+static constexpr size_t LZ_MAXOFFSET = 65535;
+static constexpr int LZ_HASHBITS = 14;
+
+static void LZPushCount(std::vector<uint8_t>& out, size_t n)
+{
+    while (n >= 255) {
+        out.push_back(255);
+        n -= 255;
+    }
+    out.push_back((uint8_t)n);
+}
+
+static void LZPushSequence(std::vector<uint8_t>& out, uint8_t const* lit, size_t nlit, size_t offset, size_t matchLen)
+{
+    size_t m = matchLen ? matchLen - LZ_MINMATCH : 0;
+    out.push_back((uint8_t)((std::min<size_t>(nlit, 15) << 4) | std::min<size_t>(m, 15)));
+    if (nlit >= 15) {
+        LZPushCount(out, nlit - 15);
+    }
+    out.insert(out.end(), lit, lit + nlit);
+    if (matchLen) {
+        out.push_back((uint8_t)(offset & 0xFF));
+        out.push_back((uint8_t)(offset >> 8));
+        if (m >= 15) {
+            LZPushCount(out, m - 15);
+        }
+    }
+}
+
+void LZEncode(uint8_t const* src, size_t n, std::vector<uint8_t>& out)
+{
+    auto read32 = [&](size_t i) -> uint32_t {
+        uint32_t v;
+        std::memcpy(&v, src + i, 4);
+        return v;
+    };
+    auto hash = [](uint32_t v) -> uint32_t {
+        return (v * 2654435761u) >> (32 - LZ_HASHBITS);
+    };
+    // Last position each hash was seen at (+1, so 0 means none).
+    std::vector<uint32_t> table(size_t(1) << LZ_HASHBITS, 0);
+
+    size_t lit = 0;     // Start of pending literals.
+    size_t i = 0;
+    while (n >= LZ_MINMATCH && i <= n - LZ_MINMATCH) {
+        uint32_t v = read32(i);
+        uint32_t& slot = table[hash(v)];
+        size_t cand = slot;
+        slot = (uint32_t)(i + 1);
+        if (cand == 0 || i - (cand - 1) > LZ_MAXOFFSET || read32(cand - 1) != v) {
+            ++i;
+            continue;
+        }
+        --cand;
+        size_t len = LZ_MINMATCH;
+        while (i + len < n && src[cand + len] == src[i + len]) {
+            ++len;
+        }
+        LZPushSequence(out, src + lit, i - lit, i - cand, len);
+        // Keep the table up to date within the match (cheaply).
+        size_t stop = std::min(i + len, n - LZ_MINMATCH + 1);
+        for (size_t j = i + 1; j < stop; j += 2) {
+            table[hash(read32(j))] = (uint32_t)(j + 1);
+        }
+        i += len;
+        lit = i;
+    }
+    LZPushSequence(out, src + lit, n - lit, 0, 0);
+}
+
+bool LZDecode(uint8_t const* src, uint8_t const* end, uint8_t* dest, size_t n)
+{
+    auto readCount = [&](size_t& count) -> bool {
+        uint8_t b;
+        do {
+            if (src >= end) {
+                return false;
+            }
+            b = *src++;
+            count += b;
+        } while (b == 255);
+        return true;
+    };
+
+    size_t i = 0;
+    while (true) {
+        if (src >= end) {
+            return false;
+        }
+        uint8_t token = *src++;
+        size_t nlit = token >> 4;
+        if (nlit == 15 && !readCount(nlit)) {
+            return false;
+        }
+        if (nlit > n - i || nlit > (size_t)(end - src)) {
+            return false;
+        }
+        if (nlit > 0) {
+            std::memcpy(dest + i, src, nlit);   // (dest may be null if n is 0)
+        }
+        src += nlit;
+        i += nlit;
+        if (src == end) {
+            // Last sequence.
+            return i == n;
+        }
+
+        if (end - src < 2) {
+            return false;
+        }
+        size_t offset = src[0] | (src[1] << 8);
+        src += 2;
+        size_t len = (token & 0x0F);
+        if (len == 15 && !readCount(len)) {
+            return false;
+        }
+        len += LZ_MINMATCH;
+        if (offset == 0 || offset > i || len > n - i) {
+            return false;
+        }
+        // May overlap (that's how runs are encoded), so byte by byte.
+        uint8_t const* from = dest + i - offset;
+        if (offset >= len) {
+            std::memcpy(dest + i, from, len);
+        } else {
+            for (size_t j = 0; j < len; ++j) {
+                dest[i + j] = from[j];
+            }
+        }
+        i += len;
+    }
+}
@@ -0,0 +1,35 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <vector>
+
+#include "proj.h"
+
+// Simple compression for stashing away data which isn't likely to be
+// needed for a while (eg old undo entries), and for project files.
+
+// PackBits-style run-length encoding.
+// Works on elements of elemSize bytes (eg sizeof(Cell) for cells), so runs
+// of whole cells can be detected. Appends to out.
+void RLEEncode(uint8_t const* src, size_t n, size_t elemSize, std::vector<uint8_t>& out);
+
+// Decode exactly n elements into dest.
+// Returns pointer to the end of the consumed input, or nullptr if the
+// input is bad or runs out.
+uint8_t const* RLEDecode(uint8_t const* src, uint8_t const* end, size_t elemSize, uint8_t* dest, size_t n);
+
+// A fast LZ77 compressor (in the style of LZ4), for finding repeats which
+// RLE misses (eg repeated rows of a map). Appends to out.
+void LZEncode(uint8_t const* src, size_t n, std::vector<uint8_t>& out);
+// Decode exactly n bytes into dest. src..end must be exactly the output of
+// one LZEncode(). Returns false if the input is bad.
+bool LZDecode(uint8_t const* src, uint8_t const* end, uint8_t* dest, size_t n);
+
+// Pack the cells of any unshared chunks in the list into packed, and set
+// them to null. Shared chunks are left alone (packing them wouldn't save
+// anything).
+void PackChunks(std::vector<std::shared_ptr<CellChunk>>& chunks, std::vector<uint8_t>& packed);
+// Restore the null chunks in the list from packed, then empty packed.
+void UnpackChunks(std::vector<std::shared_ptr<CellChunk>>& chunks, std::vector<uint8_t>& packed);
+
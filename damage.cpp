@@ -0,0 +1,52 @@
+#include "damage.h"
+
+static int area(MapRect const& r)
+{
+    return r.w * r.h;
+}
+
+// Merge a into b if it doesn't add any cells which weren't in either.
+static bool mergeable(MapRect const& a, MapRect const& b)
+{
+    MapRect both = a;
+    both.Merge(b);
+    return area(both) <= area(a) + area(b) - area(a.Intersect(b));
+}
+
+void DamageRegion::Add(MapRect const& r)
+{
+    if (r.IsEmpty()) {
+        return;
+    }
+    MapRect merged = r;
+    // Growing the rect might make it mergeable with ones we've already
+    // passed, so keep going until nothing changes.
+    bool again = true;
+    while (again) {
+        again = false;
+        for (size_t i = 0; i < mRects.size(); ++i) {
+            if (mergeable(mRects[i], merged)) {
+                merged.Merge(mRects[i]);
+                mRects.erase(mRects.begin() + i);
+                again = true;
+                break;
+            }
+        }
+    }
+    mRects.push_back(merged);
+
+    if (mRects.size() > MAX_RECTS) {
+        MapRect all = Bounds();
+        mRects.clear();
+        mRects.push_back(all);
+    }
+}
+
+MapRect DamageRegion::Bounds() const
+{
+    MapRect all;
+    for (auto const& r : mRects) {
+        all.Merge(r);
+    }
+    return all;
+}
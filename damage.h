@@ -0,0 +1,26 @@
+#pragma once
+
+#include <vector>
+
+#include "proj.h"
+
+// Collects up damaged areas of a map as a short list of rects.
+// Overlapping and adjacent rects are merged where that doesn't add any
+// undamaged cells, so a drag across a map doesn't turn into a redraw of
+// its whole bounding box.
+class DamageRegion
+{
+public:
+    // Past this many rects, everything is merged into one.
+    static constexpr size_t MAX_RECTS = 32;
+
+    void Add(MapRect const& r);
+    bool IsEmpty() const {return mRects.empty();}
+    void Clear() {mRects.clear();}
+    std::vector<MapRect> const& Rects() const {return mRects;}
+    // Bounding box of the whole region.
+    MapRect Bounds() const;
+
+private:
+    std::vector<MapRect> mRects;
+};
@@ -1,5 +1,6 @@
 #include "draw.h"
 #include "model.h"
+#include "simd.h"
 
 #include <algorithm>
 
@@ -12,28 +13,55 @@ static Cell combine(Cell const& dest, Cell const& pen, int drawFlags)
     };
 }
 
-MapRect Plonk(Tilemap &map, TilePoint const& pos, Cell const& pen, int drawFlags)
+// Set the planes selected by drawFlags, for n cells.
+static void fillSpan(PlanesView dest, int n, Cell const& pen, int drawFlags)
+{
+    if (drawFlags & DRAWFLAG_TILE) {
+        std::fill_n(dest.tile, n, pen.tile);
+    }
+    if (drawFlags & DRAWFLAG_INK) {
+        std::fill_n(dest.ink, n, pen.ink);
+    }
+    if (drawFlags & DRAWFLAG_PAPER) {
+        std::fill_n(dest.paper, n, pen.paper);
+    }
+}
+
+MapRect Plonk(Tilemap &map, TilePoint const& pos, Cell const& pen, int drawFlags, IDrawListener* listener)
 {
     assert(map.Bounds().Contains(pos));
-    map.CellAt(pos) = combine(map.CellAt(pos), pen, drawFlags);
+    if (listener) {
+        listener->AboutToDraw(MapRect(pos, 1, 1));
+    }
+    map.SetCell(pos, combine(map.CellAt(pos), pen, drawFlags));
     return MapRect(pos, 1, 1);
 }
 
-MapRect DrawRect(Tilemap& map, MapRect const& area, Cell const& pen, int drawFlags)
+MapRect DrawRect(Tilemap& map, MapRect const& area, Cell const& pen, int drawFlags, IDrawListener* listener)
 {
     // clip to map
     MapRect destRect = map.Bounds().Clip(area);
-    // transform clipped area into brush space
-    MapRect srcRect = destRect;
-    srcRect.x -= destRect.x;
-    srcRect.y -= destRect.y;
+    if (listener) {
+        listener->AboutToDraw(destRect);
+    }
+    if (destRect.IsEmpty()) {
+        return destRect;
+    }
 
-    // do it
-    for (int y=0; y<srcRect.h; ++y) {
-        Cell *dest = map.CellPtr(TilePoint(destRect.x, destRect.y + y));
-        for (int x=0; x<srcRect.w; ++x) {
-            *dest = combine(*dest, pen, drawFlags);
-            ++dest;
+    // do it, a chunk at a time
+    bool whole = (drawFlags & DRAWFLAG_ALL) == DRAWFLAG_ALL;
+    for (int cy = destRect.y / CHUNK_SIZE; cy <= (destRect.y + destRect.h - 1) / CHUNK_SIZE; ++cy) {
+        for (int cx = destRect.x / CHUNK_SIZE; cx <= (destRect.x + destRect.w - 1) / CHUNK_SIZE; ++cx) {
+            MapRect chunkRect = map.ChunkBounds(cx, cy);
+            MapRect r = chunkRect.Intersect(destRect);
+            if (whole && r == chunkRect) {
+                // Covers the whole chunk, so just replace it.
+                map.FillChunk(cx, cy, pen);
+                continue;
+            }
+            map.ForEachSpan(r, [&](TilePoint const& pos, PlanesView dest, int n) {
+                fillSpan(dest, n, pen, drawFlags);
+            });
         }
     }
     return destRect;
@@ -43,7 +71,7 @@ MapRect DrawRect(Tilemap& map, MapRect const& area, Cell const& pen, int drawFla
 
 // Do floodfill, return damaged area.
 // TODO: work out how drawFlags should work here.
-MapRect FloodFill(Tilemap& map, TilePoint const& start, Cell pen, int drawFlags)
+MapRect FloodFill(Tilemap& map, TilePoint const& start, Cell pen, int drawFlags, IDrawListener* listener)
 {
     MapRect damage;
 
@@ -67,52 +95,61 @@ MapRect FloodFill(Tilemap& map, TilePoint const& start, Cell pen, int drawFlags)
         return true;
     };
 
-    auto apply = [=](Cell& dest, Cell const& pen) {
-        if (drawFlags & DRAWFLAG_TILE) {
-            dest.tile = pen.tile;
-        }
-        if (drawFlags & DRAWFLAG_INK) {
-            dest.ink= pen.ink;
-        }
-        if (drawFlags & DRAWFLAG_PAPER) {
-            dest.paper= pen.paper;
-        }
-    };
+    // Read via const, to avoid unsharing chunks we don't change.
+    Tilemap const& cmap = map;
 
     // Sample the tile at the start point for what we'll be replacing.
-    Cell old = map.CellAt(start);
+    Cell old = cmap.CellAt(start);
     if (match(old, pen)) {
         // already done...
         return damage;
     }
 
+    // Like match(), but only reads the planes we need.
+    auto matchOld = [&](TilePoint const& tp) -> bool {
+        ConstPlanesView v = cmap.PlanesConst(tp);
+        if ((drawFlags & DRAWFLAG_TILE) && v.tile[0] != old.tile) {
+            return false;
+        }
+        if ((drawFlags & DRAWFLAG_INK) && v.ink[0] != old.ink) {
+            return false;
+        }
+        if ((drawFlags & DRAWFLAG_PAPER) && v.paper[0] != old.paper) {
+            return false;
+        }
+        return true;
+    };
+
     std::vector<TilePoint> q;
     q.push_back(start);
     while(!q.empty())
     {
         TilePoint pt = q.back();
         q.pop_back();
-        if (!match(map.CellAt(pt), old)) {
+        if (!matchOld(pt)) {
             continue;
         }
 
         // scan left and right to find span
         int y = pt.y;
         int l = pt.x;
-        while (l > 0 && match(map.CellAt(TilePoint(l - 1, y)),old)) {
+        while (l > 0 && matchOld(TilePoint(l - 1, y))) {
             --l;
         }
         int r = pt.x;
-        while (r < map.w - 1 && match(map.CellAt(TilePoint(r + 1, y)), old)) {
+        while (r < map.w - 1 && matchOld(TilePoint(r + 1, y))) {
             ++r;
         }
 
         // fill the span
-        Cell* dest = map.CellPtr(TilePoint(l, y));
-        int x;
-        for (x = l; x <= r; ++x ) {
-            apply(*dest++, pen);
+        MapRect span(TilePoint(l, y), (r + 1) - l, 1);
+        if (listener) {
+            listener->AboutToDraw(span);
         }
+        map.ForEachSpan(span, [&](TilePoint const& pos, PlanesView dest, int n) {
+            fillSpan(dest, n, pen, drawFlags);
+        });
+        int x;
 
         // expand the damage box to include the affected span
         damage.Merge(MapRect(TilePoint(l, y), (r + 1 ) - l, 1));
@@ -123,7 +160,7 @@ MapRect FloodFill(Tilemap& map, TilePoint const& start, Cell pen, int drawFlags)
         {
             for (x = l; x <= r; ++x)
             {
-                if (match(map.CellAt(TilePoint(x, y)), old)) {
+                if (matchOld(TilePoint(x, y))) {
                     q.push_back(TilePoint(x, y));
                 }
             }
@@ -135,7 +172,7 @@ MapRect FloodFill(Tilemap& map, TilePoint const& start, Cell pen, int drawFlags)
         {
             for (x = l; x <= r; ++x)
             {
-                if (match(map.CellAt(TilePoint(x, y)), old)) {
+                if (matchOld(TilePoint(x, y))) {
                     q.push_back(TilePoint(x, y));
                 }
             }
@@ -145,73 +182,311 @@ MapRect FloodFill(Tilemap& map, TilePoint const& start, Cell pen, int drawFlags)
 }
 
 
-MapRect DrawBrush(Tilemap& map, TilePoint const& pos, Tilemap const& brush, Cell const& transparent, int drawFlags)
+MapRect DrawBrush(Tilemap& map, TilePoint const& pos, Tilemap const& brush, Cell const& transparent, int drawFlags, IDrawListener* listener)
 {
     // clip brush area on map
     MapRect destRect = map.Bounds().Clip(MapRect(pos, brush.w, brush.h));
-    // transform clipped area into brush space
-    MapRect srcRect = destRect;
-    srcRect.x -= destRect.x;
-    srcRect.y -= destRect.y;
+    if (listener) {
+        listener->AboutToDraw(destRect);
+    }
 
     // copy
-    for (int y=0; y<srcRect.h; ++y) {
-        Cell const *src = brush.CellPtrConst(TilePoint(srcRect.x, srcRect.y + y));
-        Cell *dest = map.CellPtr(TilePoint(destRect.x, destRect.y + y));
-        for (int x=0; x<srcRect.w; ++x) {
-            Cell c = *src++;
+    map.ForEachSpan(destRect, [&](TilePoint const& p, PlanesView dest, int n) {
+        // transform into brush space
+        TilePoint srcPos(p.x - pos.x, p.y - pos.y);
+        for (int x = 0; x < n; ++x) {
+            Cell c = brush.CellAt(TilePoint(srcPos.x + x, srcPos.y));
             if (c.tile != transparent.tile) {
-                *dest = combine(*dest, c, drawFlags);
+                dest.Set(x, combine(dest.Get(x), c, drawFlags));
             }
-            ++dest;
         }
-    }
+    });
     return destRect;
 }
 
-MapRect EraseBrush(Tilemap& map, TilePoint const& pos, Tilemap const& brush, Cell const& transparent, int drawFlags)
+MapRect EraseBrush(Tilemap& map, TilePoint const& pos, Tilemap const& brush, Cell const& transparent, int drawFlags, IDrawListener* listener)
 {
     // clip brush area on map
     MapRect destRect = map.Bounds().Clip(MapRect(pos, brush.w, brush.h));
-    // transform clipped area into brush space
-    MapRect srcRect = destRect;
-    srcRect.x -= destRect.x;
-    srcRect.y -= destRect.y;
+    if (listener) {
+        listener->AboutToDraw(destRect);
+    }
 
     // copy
-    for (int y=0; y<srcRect.h; ++y) {
-        Cell const *src = brush.CellPtrConst(TilePoint(srcRect.x, srcRect.y + y));
-        Cell *dest = map.CellPtr(TilePoint(destRect.x, destRect.y + y));
-        for (int x=0; x<srcRect.w; ++x) {
-            Cell c = *src++;
+    map.ForEachSpan(destRect, [&](TilePoint const& p, PlanesView dest, int n) {
+        // transform into brush space
+        TilePoint srcPos(p.x - pos.x, p.y - pos.y);
+        for (int x = 0; x < n; ++x) {
+            Cell c = brush.CellAt(TilePoint(srcPos.x + x, srcPos.y));
             if (c.tile != transparent.tile) {
-                *dest = combine(*dest, transparent, drawFlags);
+                dest.Set(x, combine(dest.Get(x), transparent, drawFlags));
             }
-            ++dest;
         }
-    }
+    });
     return destRect;
 }
 
 
 void HFlip(Tilemap& map)
 {
-    auto x0 = map.cells.begin();
     for (int y = 0; y < map.h; ++y) {
-        auto x1 = x0 + map.w;
-        std::reverse(x0, x1);
-        x0 = x1;    // next line
+        for (int x = 0; x < map.w / 2; ++x) {
+            TilePoint a(x, y);
+            TilePoint b(map.w - 1 - x, y);
+            Cell tmp = map.CellAt(a);
+            map.SetCell(a, map.CellAt(b));
+            map.SetCell(b, tmp);
+        }
     }
 }
 
 void VFlip(Tilemap& map)
 {
-    auto a = map.cells.begin();
-    auto b = a + (map.w * (map.h - 1)); // start of last line
     for (int y = 0; y < map.h / 2; ++y) {
-        std::swap_ranges(a, a + map.w, b);
-        a += map.w;
-        b -= map.w;
+        for (int x = 0; x < map.w; ++x) {
+            TilePoint a(x, y);
+            TilePoint b(x, map.h - 1 - y);
+            Cell tmp = map.CellAt(a);
+            map.SetCell(a, map.CellAt(b));
+            map.SetCell(b, tmp);
+        }
+    }
+}
+
+
+RemapTable::RemapTable() : tile(65536), ink(256), paper(256)
+{
+    for (int i = 0; i < 65536; ++i) {
+        tile[i] = (uint16_t)i;
+    }
+    for (int i = 0; i < 256; ++i) {
+        ink[i] = (uint8_t)i;
+        paper[i] = (uint8_t)i;
+    }
+}
+
+template<typename T> static bool invertTable(std::vector<T> const& fwd, std::vector<T>& inv)
+{
+    std::vector<bool> seen(fwd.size());
+    for (size_t i = 0; i < fwd.size(); ++i) {
+        if (seen[fwd[i]]) {
+            return false;
+        }
+        seen[fwd[i]] = true;
+        inv[fwd[i]] = (T)i;
+    }
+    return true;
+}
+
+bool RemapTable::Invert(RemapTable& inv) const
+{
+    return invertTable(tile, inv.tile) &&
+        invertTable(ink, inv.ink) &&
+        invertTable(paper, inv.paper);
+}
+
+template<typename T> static bool isIdentity(std::vector<T> const& lut)
+{
+    for (size_t i = 0; i < lut.size(); ++i) {
+        if (lut[i] != (T)i) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// The inner loop: out[i] = lut[in[i]] for a chunk's worth of a plane.
+// Compilers don't vectorise table lookups well (if at all), so with AVX2
+// there are hand-written kernels: a gather for the 16 bit tile plane, and
+// for the 8 bit planes, the 256 entry table as 16 rows of 16 bytes, looked
+// up with a byte shuffle each.
+template<typename T> static void lookupScalar(T const* in, T* out, T const* lut)
+{
+    for (int i = 0; i < CHUNK_CELLS; ++i) {
+        out[i] = lut[in[i]];
+    }
+}
+
+#ifdef SIMD_X86
+
+static_assert(CHUNK_CELLS % 64 == 0);
+
+// 8 entries of a 65536 entry lut, as 32 bit ints.
+TARGET_AVX2
+static inline __m256i gather8(uint16_t const* lut, __m128i indices)
+{
+    __m256i const lastIndex = _mm256_set1_epi32(0xFFFF);
+    __m256i idx = _mm256_cvtepu16_epi32(indices);
+    // Gathers read 32 bits, so entry 0xFFFF (which would read past the end
+    // of lut) is patched in afterward.
+    __m256i safe = _mm256_min_epu32(idx, _mm256_set1_epi32(0xFFFE));
+    __m256i v = _mm256_and_si256(_mm256_i32gather_epi32((int const*)lut, safe, 2), lastIndex);
+    return _mm256_blendv_epi8(v, _mm256_set1_epi32(lut[0xFFFF]), _mm256_cmpeq_epi32(idx, lastIndex));
+}
+
+// lut has 65536 entries.
+TARGET_AVX2
+static void lookupAVX2(uint16_t const* in, uint16_t* out, uint16_t const* lut)
+{
+    for (int i = 0; i < CHUNK_CELLS; i += 16) {
+        __m256i lo = gather8(lut, _mm_loadu_si128((__m128i const*)(in + i)));
+        __m256i hi = gather8(lut, _mm_loadu_si128((__m128i const*)(in + i + 8)));
+        // Pack back down to 16 bits (packus works within 128 bit lanes,
+        // hence the permute).
+        __m256i packed = _mm256_permute4x64_epi64(_mm256_packus_epi32(lo, hi), 0xD8);
+        _mm256_storeu_si256((__m256i*)(out + i), packed);
+    }
+}
+
+// lut has 256 entries.
+TARGET_AVX2
+static void lookupAVX2(uint8_t const* in, uint8_t* out, uint8_t const* lut)
+{
+    __m256i rows[16];
+    for (int h = 0; h < 16; ++h) {
+        rows[h] = _mm256_broadcastsi128_si256(_mm_loadu_si128((__m128i const*)(lut + (h * 16))));
+    }
+    // For row h, shuffling with (index - h * 16) + 0x70 (saturating) picks
+    // out the entry for indices in the row, and gives 0 for the rest (as the
+    // top bit's set). OR the rows together.
+    __m256i const bias = _mm256_set1_epi8(0x70);
+    __m256i const step = _mm256_set1_epi8(16);
+    // Two vectors at a time, to keep more shuffles in flight.
+    for (int i = 0; i < CHUNK_CELLS; i += 64) {
+        __m256i a = _mm256_loadu_si256((__m256i const*)(in + i));
+        __m256i b = _mm256_loadu_si256((__m256i const*)(in + i + 32));
+        __m256i outA = _mm256_setzero_si256();
+        __m256i outB = _mm256_setzero_si256();
+        for (int h = 0; h < 16; ++h) {
+            outA = _mm256_or_si256(outA, _mm256_shuffle_epi8(rows[h], _mm256_adds_epu8(a, bias)));
+            outB = _mm256_or_si256(outB, _mm256_shuffle_epi8(rows[h], _mm256_adds_epu8(b, bias)));
+            a = _mm256_sub_epi8(a, step);
+            b = _mm256_sub_epi8(b, step);
+        }
+        _mm256_storeu_si256((__m256i*)(out + i), outA);
+        _mm256_storeu_si256((__m256i*)(out + i + 32), outB);
+    }
+}
+
+#endif  // SIMD_X86
+
+template<typename T> static void lookupPlane(T const* in, T* out, T const* lut)
+{
+#ifdef SIMD_X86
+    if (CPUHasAVX2()) {
+        lookupAVX2(in, out, lut);
+        return;
+    }
+#endif
+    lookupScalar(in, out, lut);
+}
+
+// Extend changed to cover cells in row y (of length n) which differ.
+template<typename T> static void diffRow(T const* a, T const* b, int n, int& first, int& last)
+{
+    for (int x = 0; x < n; ++x) {
+        if (a[x] != b[x]) {
+            first = std::min(first, x);
+            last = std::max(last, x);
+        }
     }
 }
 
+int RemapTable::ChangedPlanes() const
+{
+    return (isIdentity(tile) ? 0 : DRAWFLAG_TILE) |
+        (isIdentity(ink) ? 0 : DRAWFLAG_INK) |
+        (isIdentity(paper) ? 0 : DRAWFLAG_PAPER);
+}
+
+MapRect Remap(Tilemap& map, RemapTable const& table, MapRect const& area, int drawFlags)
+{
+    MapRect r = map.Bounds().Clip(area);
+    MapRect damage;
+    if (r.IsEmpty()) {
+        return damage;
+    }
+    bool doTile = drawFlags & DRAWFLAG_TILE;
+    bool doInk = drawFlags & DRAWFLAG_INK;
+    bool doPaper = drawFlags & DRAWFLAG_PAPER;
+    if (!doTile && !doInk && !doPaper) {
+        return damage;
+    }
+
+    // Uniform chunks we've seen and their replacements, for sharing.
+    std::vector<std::pair<CellChunk const*, std::shared_ptr<CellChunk>>> uniforms;
+    // Remapped planes.
+    uint16_t tile[CHUNK_CELLS];
+    uint8_t ink[CHUNK_CELLS];
+    uint8_t paper[CHUNK_CELLS];
+
+    for (int cy = r.y / CHUNK_SIZE; cy <= (r.y + r.h - 1) / CHUNK_SIZE; ++cy) {
+        for (int cx = r.x / CHUNK_SIZE; cx <= (r.x + r.w - 1) / CHUNK_SIZE; ++cx) {
+            MapRect bounds = map.ChunkBounds(cx, cy);
+            std::shared_ptr<CellChunk> src = map.SharedChunk(cx, cy);
+            if (src->uniform) {
+                Cell c = src->At(0, 0).Get(0);
+                Cell c2 = combine(c, table.Apply(c), drawFlags);
+                if (c2 == c) {
+                    continue;
+                }
+                auto it = std::find_if(uniforms.begin(), uniforms.end(),
+                    [&](auto const& u) {return u.first == src.get();});
+                if (it == uniforms.end()) {
+                    uniforms.emplace_back(src.get(), CellChunk::Uniform(c2));
+                    it = uniforms.end() - 1;
+                }
+                map.SetSharedChunk(cx, cy, it->second);
+                damage.Merge(bounds);
+                continue;
+            }
+
+            if (doTile) {
+                lookupPlane(src->tile, tile, table.tile.data());
+            }
+            if (doInk) {
+                lookupPlane(src->ink, ink, table.ink.data());
+            }
+            if (doPaper) {
+                lookupPlane(src->paper, paper, table.paper.data());
+            }
+
+            // Find out what actually changed (within the map).
+            MapRect changed;
+            for (int y = 0; y < bounds.h; ++y) {
+                int i = y * CHUNK_SIZE;
+                int first = bounds.w;
+                int last = -1;
+                if (doTile) {
+                    diffRow(src->tile + i, tile + i, bounds.w, first, last);
+                }
+                if (doInk) {
+                    diffRow(src->ink + i, ink + i, bounds.w, first, last);
+                }
+                if (doPaper) {
+                    diffRow(src->paper + i, paper + i, bounds.w, first, last);
+                }
+                if (last >= first) {
+                    changed.Merge(MapRect(bounds.x + first, bounds.y + y, (last - first) + 1, 1));
+                }
+            }
+            if (changed.IsEmpty()) {
+                continue;
+            }
+
+            src.reset();    // So Chunk() doesn't need to copy.
+            CellChunk& dest = map.Chunk(cx, cy);
+            if (doTile) {
+                std::copy(tile, tile + CHUNK_CELLS, dest.tile);
+            }
+            if (doInk) {
+                std::copy(ink, ink + CHUNK_CELLS, dest.ink);
+            }
+            if (doPaper) {
+                std::copy(paper, paper + CHUNK_CELLS, dest.paper);
+            }
+            damage.Merge(changed);
+        }
+    }
+    return damage;
+}
@@ -5,13 +5,48 @@
 
 // Self-contained functions which just draw stuff on a Tilemap.
 
-MapRect Plonk(Tilemap &map, TilePoint const& pos, Cell const& pen, int drawFlags);
-MapRect DrawRect(Tilemap& map, MapRect const& area, Cell const& pen, int drawFlags);
-MapRect FloodFill(Tilemap& map, TilePoint const& start, Cell pen, int drawFlags);
-MapRect DrawBrush(Tilemap& map, TilePoint const& pos, Tilemap const& brush, Cell const& transparent, int drawFlags);
-MapRect EraseBrush(Tilemap& map, TilePoint const& pos, Tilemap const& brush, Cell const& transparent, int drawFlags);
+// Optional hook for the drawing functions.
+// AboutToDraw() is called with an area of the map just before any cells
+// within it are modified (eg so the area can be backed up for undo).
+// The area may extend outside the map.
+class IDrawListener
+{
+public:
+    virtual ~IDrawListener() = default;
+    virtual void AboutToDraw(MapRect const& area) = 0;
+};
+
+MapRect Plonk(Tilemap &map, TilePoint const& pos, Cell const& pen, int drawFlags, IDrawListener* listener = nullptr);
+MapRect DrawRect(Tilemap& map, MapRect const& area, Cell const& pen, int drawFlags, IDrawListener* listener = nullptr);
+MapRect FloodFill(Tilemap& map, TilePoint const& start, Cell pen, int drawFlags, IDrawListener* listener = nullptr);
+MapRect DrawBrush(Tilemap& map, TilePoint const& pos, Tilemap const& brush, Cell const& transparent, int drawFlags, IDrawListener* listener = nullptr);
+MapRect EraseBrush(Tilemap& map, TilePoint const& pos, Tilemap const& brush, Cell const& transparent, int drawFlags, IDrawListener* listener = nullptr);
 
 
 void HFlip(Tilemap& map);
 void VFlip(Tilemap& map);
 
+
+// Lookup tables for remapping cell values. Starts off as identity.
+struct RemapTable
+{
+    RemapTable();
+    std::vector<uint16_t> tile;     // 65536 entries
+    std::vector<uint8_t> ink;       // 256 entries
+    std::vector<uint8_t> paper;     // 256 entries
+
+    Cell Apply(Cell const& c) const {
+        return Cell{tile[c.tile], ink[c.ink], paper[c.paper]};
+    }
+    // Set inv to the reverse mapping.
+    // Returns false if the tables aren't one-to-one (so can't be inverted).
+    bool Invert(RemapTable& inv) const;
+    // Which planes the table actually changes (as DRAWFLAG_* bits).
+    int ChangedPlanes() const;
+};
+
+// Remap the planes selected by drawFlags, for all cells in the chunks
+// touching area. Returns the area actually changed.
+// Separate areas (which don't share chunks - eg rows of chunks) can be
+// done in parallel, as long as map.OwnChunkTable() has been called first.
+MapRect Remap(Tilemap& map, RemapTable const& table, MapRect const& area, int drawFlags);
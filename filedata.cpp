@@ -0,0 +1,278 @@
+#include "filedata.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#else
+#include <fcntl.h>
+#include <io.h>
+#include <sys/stat.h>
+#endif
+
+FileData::~FileData()
+{
+#ifndef _WIN32
+    if (mMapped) {
+        munmap((void*)mData, mSize);
+    }
+#endif
+}
+
+std::shared_ptr<FileData const> FileData::FromVector(std::vector<uint8_t>&& data)
+{
+    std::shared_ptr<FileData> f(new FileData());
+    f->mBuf = std::move(data);
+    f->mData = f->mBuf.data();
+    f->mSize = f->mBuf.size();
+    return f;
+}
+
+std::shared_ptr<FileData const> FileData::Open(std::string const& filename)
+{
+#ifndef _WIN32
+    int fd = open(filename.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return nullptr;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+        close(fd);
+        return nullptr;
+    }
+    if (st.st_size == 0) {
+        // Can't map nothing.
+        close(fd);
+        return FromVector(std::vector<uint8_t>());
+    }
+    void* p = mmap(nullptr, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);  // The mapping holds its own reference.
+    if (p != MAP_FAILED) {
+        std::shared_ptr<FileData> f(new FileData());
+        f->mData = (uint8_t const*)p;
+        f->mSize = (size_t)st.st_size;
+        f->mMapped = true;
+        return f;
+    }
+    // Fall through and read it instead.
+#endif
+    FILE* fp = fopen(filename.c_str(), "rb");
+    if (!fp) {
+        return nullptr;
+    }
+    std::vector<uint8_t> buf;
+    uint8_t tmp[65536];
+    size_t n;
+    while ((n = fread(tmp, 1, sizeof(tmp), fp)) > 0) {
+        buf.insert(buf.end(), tmp, tmp + n);
+    }
+    bool ok = !ferror(fp);
+    fclose(fp);
+    if (!ok) {
+        return nullptr;
+    }
+    return FromVector(std::move(buf));
+}
+
+
+SharedBytes::SharedBytes(std::vector<uint8_t>&& data) :
+    mOwn(std::make_shared<std::vector<uint8_t>>(std::move(data)))
+{
+    mData = mOwn->data();
+    mSize = mOwn->size();
+}
+
+SharedBytes::SharedBytes(std::shared_ptr<FileData const> const& file, size_t offset, size_t size) :
+    mFile(file),
+    mData(file->Data() + offset),
+    mSize(size)
+{
+}
+
+uint8_t* SharedBytes::MutableData()
+{
+    if (IsShared()) {
+        mOwn = std::make_shared<std::vector<uint8_t>>(mData, mData + mSize);
+        mFile.reset();
+        mData = mOwn->data();
+    }
+    if (!mOwn) {
+        // Empty.
+        return nullptr;
+    }
+    return mOwn->data();
+}
+
+
+Sink::Sink() : mBuf(BUFSIZE)
+{
+}
+
+void Sink::Drain()
+{
+    if (mUsed > 0 && mOk) {
+        mOk = Put(mBuf.data(), mUsed);
+    }
+    mDrained += mUsed;
+    mUsed = 0;
+}
+
+void Sink::Write(uint8_t const* p, size_t n)
+{
+    if (n == 0) {
+        return;     // (p may be null)
+    }
+    if (n <= BUFSIZE - mUsed) {
+        std::memcpy(mBuf.data() + mUsed, p, n);
+        mUsed += n;
+        return;
+    }
+    Drain();
+    if (n < BUFSIZE) {
+        std::memcpy(mBuf.data(), p, n);
+        mUsed = n;
+        return;
+    }
+    // Big enough to pass straight on.
+    if (mOk) {
+        mOk = Put(p, n);
+    }
+    mDrained += n;
+}
+
+void Sink::Patch(size_t pos, uint8_t const* p, size_t n)
+{
+    assert(pos + n <= Pos());
+    if (pos < mDrained && pos + n > mDrained) {
+        // Straddles the buffer - drain it first, to keep it simple.
+        Drain();
+    }
+    if (pos >= mDrained) {
+        std::memcpy(mBuf.data() + (pos - mDrained), p, n);
+    } else if (mOk) {
+        mOk = PutAt(pos, p, n);
+    }
+}
+
+bool Sink::Flush()
+{
+    Drain();
+    return mOk;
+}
+
+
+MemSink::~MemSink()
+{
+    Flush();
+}
+
+bool MemSink::Put(uint8_t const* p, size_t n)
+{
+    mOut.insert(mOut.end(), p, p + n);
+    return true;
+}
+
+bool MemSink::PutAt(size_t pos, uint8_t const* p, size_t n)
+{
+    std::memcpy(mOut.data() + mBase + pos, p, n);
+    return true;
+}
+
+
+FileSink::FileSink(int fd) : mFD(fd)
+{
+#ifndef _WIN32
+    mStart = lseek(fd, 0, SEEK_CUR);
+#else
+    mStart = _lseeki64(fd, 0, SEEK_CUR);
+#endif
+    if (mStart < 0) {
+        Fail();
+    }
+}
+
+FileSink::FileSink(std::string const& filename) : mOwned(true)
+{
+#ifndef _WIN32
+    mFD = open(filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+#else
+    mFD = _open(filename.c_str(), _O_WRONLY | _O_CREAT | _O_TRUNC | _O_BINARY, _S_IREAD | _S_IWRITE);
+#endif
+    if (mFD < 0) {
+        Fail();
+    }
+}
+
+FileSink::~FileSink()
+{
+    Close();
+}
+
+bool FileSink::Close()
+{
+    bool ok = Flush();
+    if (mOwned && mFD >= 0) {
+#ifndef _WIN32
+        ok = (close(mFD) == 0) && ok;
+#else
+        ok = (_close(mFD) == 0) && ok;
+#endif
+        mFD = -1;
+        Fail();     // No more writing.
+    }
+    return ok;
+}
+
+bool FileSink::Put(uint8_t const* p, size_t n)
+{
+    while (n > 0) {
+#ifndef _WIN32
+        ssize_t got = write(mFD, p, n);
+        if (got < 0 && errno == EINTR) {
+            continue;
+        }
+#else
+        int got = _write(mFD, p, (unsigned)std::min(n, (size_t)1 << 30));
+#endif
+        if (got <= 0) {
+            return false;
+        }
+        p += got;
+        n -= (size_t)got;
+    }
+    return true;
+}
+
+bool FileSink::PutAt(size_t pos, uint8_t const* p, size_t n)
+{
+#ifndef _WIN32
+    while (n > 0) {
+        ssize_t got = pwrite(mFD, p, n, (off_t)(mStart + pos));
+        if (got < 0 && errno == EINTR) {
+            continue;
+        }
+        if (got <= 0) {
+            return false;
+        }
+        p += got;
+        pos += (size_t)got;
+        n -= (size_t)got;
+    }
+    return true;
+#else
+    // No pwrite(), so go there and back again.
+    int64_t here = _lseeki64(mFD, 0, SEEK_CUR);
+    if (here < 0 || _lseeki64(mFD, mStart + (int64_t)pos, SEEK_SET) < 0) {
+        return false;
+    }
+    bool ok = Put(p, n);
+    return (_lseeki64(mFD, here, SEEK_SET) >= 0) && ok;
+#endif
+}
@@ -0,0 +1,186 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <string>
+#include <vector>
+#include <memory>
+
+// The read-only contents of a file.
+// Where possible the file is memory-mapped rather than read in, so only the
+// parts actually used are paged in, and they don't count against the heap.
+//
+// NOTE: bytes of a mapped file which are in use mustn't be changed while
+// it's open. A full save writes a new file and renames it over the old one
+// (the mapping keeps the old version). An incremental save (AppendProj())
+// changes the file in place, but only appends to it and rewrites the
+// header: sections already in the file are never overwritten, so anything
+// decoded from them later still sees what was loaded. Nothing reads the
+// header back out of a FileData after opening it.
+class FileData
+{
+public:
+    ~FileData();
+    FileData(FileData const&) = delete;
+    FileData& operator=(FileData const&) = delete;
+
+    // Map (or failing that, read) a whole file. Returns null on error.
+    static std::shared_ptr<FileData const> Open(std::string const& filename);
+    // Wrap data which is already in memory.
+    static std::shared_ptr<FileData const> FromVector(std::vector<uint8_t>&& data);
+
+    uint8_t const* Data() const {return mData;}
+    size_t Size() const {return mSize;}
+    bool IsMapped() const {return mMapped;}
+
+private:
+    FileData() = default;
+    uint8_t const* mData{nullptr};
+    size_t mSize{0};
+    bool mMapped{false};
+    std::vector<uint8_t> mBuf;  // If not mapped.
+};
+
+
+// A block of bytes, shared between copies until one of them modifies it.
+// The bytes can also live in a FileData (eg straight out of a mapped file),
+// in which case they're copied out the first time they're modified.
+// Looks enough like a std::vector for reading.
+class SharedBytes
+{
+public:
+    SharedBytes() = default;
+    explicit SharedBytes(std::vector<uint8_t>&& data);
+    // View of size bytes at offset in file.
+    SharedBytes(std::shared_ptr<FileData const> const& file, size_t offset, size_t size);
+
+    uint8_t const* data() const {return mData;}
+    size_t size() const {return mSize;}
+    bool empty() const {return mSize == 0;}
+    uint8_t const* begin() const {return mData;}
+    uint8_t const* end() const {return mData + mSize;}
+    uint8_t const& operator[](size_t i) const {return mData[i];}
+
+    // Unshares the bytes, ready to be modified.
+    uint8_t* MutableData();
+    // True if the bytes are still in use elsewhere (another copy, or a file).
+    bool IsShared() const {return mFile || mOwn.use_count() > 1;}
+
+private:
+    std::shared_ptr<std::vector<uint8_t>> mOwn;
+    std::shared_ptr<FileData const> mFile;
+    uint8_t const* mData{nullptr};
+    size_t mSize{0};
+};
+
+
+// Somewhere to write a file to, a piece at a time (see WriteProj()).
+// Small writes are collected up in a fixed-size buffer and passed on in big
+// pieces, so writing a file takes the same memory however big it is.
+class Sink
+{
+public:
+    static constexpr size_t BUFSIZE = 64 * 1024;
+
+    Sink();
+    virtual ~Sink() {}
+    Sink(Sink const&) = delete;
+    Sink& operator=(Sink const&) = delete;
+
+    void Write(uint8_t const* p, size_t n);
+    void U8(uint8_t v) {
+        if (mUsed == BUFSIZE) {
+            Drain();
+        }
+        mBuf[mUsed++] = v;
+    }
+    void U16LE(uint16_t v) {
+        uint8_t* p = Space(2);
+        p[0] = v & 0xFF;
+        p[1] = v >> 8;
+        mUsed += 2;
+    }
+    void U32LE(uint32_t v) {
+        uint8_t* p = Space(4);
+        for (int i = 0; i < 4; ++i) {
+            p[i] = (v >> (i * 8)) & 0xFF;
+        }
+        mUsed += 4;
+    }
+    // For filling in the buffer directly: returns room for n bytes
+    // (n <= BUFSIZE). Follow up with Wrote() to say how many were used.
+    uint8_t* Space(size_t n) {
+        if (BUFSIZE - mUsed < n) {
+            Drain();
+        }
+        return mBuf.data() + mUsed;
+    }
+    void Wrote(size_t n) {
+        mUsed += n;
+    }
+    // Overwrite n bytes which have already been written, at pos.
+    void Patch(size_t pos, uint8_t const* p, size_t n);
+
+    // Number of bytes written so far.
+    size_t Pos() const {return mDrained + mUsed;}
+    // Pass on everything written so far. Returns false if anything has
+    // failed along the way.
+    bool Flush();
+    bool Ok() const {return mOk;}
+
+protected:
+    // Pass on n bytes.
+    virtual bool Put(uint8_t const* p, size_t n) = 0;
+    // Overwrite n bytes already passed on, at pos.
+    virtual bool PutAt(size_t pos, uint8_t const* p, size_t n) = 0;
+    void Fail() {mOk = false;}
+
+private:
+    void Drain();
+
+    std::vector<uint8_t> mBuf;
+    size_t mUsed{0};
+    size_t mDrained{0};
+    bool mOk{true};
+};
+
+// Writes to the end of a vector (which is complete once the MemSink is
+// flushed or gone).
+class MemSink : public Sink
+{
+public:
+    explicit MemSink(std::vector<uint8_t>& out) : mOut(out), mBase(out.size()) {}
+    virtual ~MemSink();
+
+protected:
+    virtual bool Put(uint8_t const* p, size_t n);
+    virtual bool PutAt(size_t pos, uint8_t const* p, size_t n);
+
+private:
+    std::vector<uint8_t>& mOut;
+    size_t mBase;
+};
+
+// Writes to a file descriptor, starting at its current position.
+class FileSink : public Sink
+{
+public:
+    explicit FileSink(int fd);
+    // Create (or truncate) filename. Check Ok() to see if that worked.
+    explicit FileSink(std::string const& filename);
+    // Closes the file (if we opened it).
+    virtual ~FileSink();
+
+    // Flush, and close the file if we opened it. Returns false if anything
+    // failed.
+    bool Close();
+
+protected:
+    virtual bool Put(uint8_t const* p, size_t n);
+    virtual bool PutAt(size_t pos, uint8_t const* p, size_t n);
+
+private:
+    int mFD{-1};
+    bool mOwned{false};
+    int64_t mStart{0};
+};
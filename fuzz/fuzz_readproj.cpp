@@ -0,0 +1,37 @@
+// libFuzzer harness for the project file reader.
+//
+//   CXX=clang++ meson setup build-fuzz -Dfuzz=true
+//   ninja -C build-fuzz fuzz_readproj
+//   ./build-fuzz/fuzz_readproj corpus/
+//
+// Any project files make a good starting corpus.
+
+#include <cstdlib>
+
+#include "proj.h"
+
+extern "C" int LLVMFuzzerTestOneInput(uint8_t const* data, size_t size)
+{
+    // Everything decoded up front...
+    Proj proj;
+    ReadError err;
+    if (ReadProj(proj, data, data + size, &err)) {
+        // Anything we can read, we should be able to write and read back.
+        std::vector<uint8_t> out;
+        WriteProj(proj, out);
+        Proj again;
+        if (!ReadProj(again, out.data(), out.data() + out.size(), &err)) {
+            abort();
+        }
+    }
+
+    // ...and with the maps left in the file until they're used.
+    auto file = FileData::FromVector(std::vector<uint8_t>(data, data + size));
+    Proj lazy;
+    if (ReadProj(lazy, file, nullptr, &err)) {
+        for (auto const& map : lazy.maps) {
+            map.Materialize();
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,357 @@
+#include "glyphs.h"
+#include "simd.h"
+
+#include <algorithm>
+#include <cstring>
+
+typedef void (*ExpandFn)(uint8_t const* src, size_t n, uint32_t ink, uint32_t paper, uint8_t* dest);
+
+static void ExpandScalar(uint8_t const* src, size_t n, uint32_t ink, uint32_t paper, uint8_t* dest)
+{
+    for (size_t i = 0; i < n; ++i) {
+        uint32_t pix = src[i] ? ink : paper;
+        std::memcpy(dest + (i * 4), &pix, 4);
+    }
+}
+
+#ifdef SIMD_X86
+
+// Where mask is all ones, paper, else ink.
+static inline __m128i Select(__m128i mask, __m128i ink, __m128i paper)
+{
+    return _mm_or_si128(_mm_and_si128(mask, paper), _mm_andnot_si128(mask, ink));
+}
+
+static void ExpandSSE2(uint8_t const* src, size_t n, uint32_t ink, uint32_t paper, uint8_t* dest)
+{
+    __m128i const vink = _mm_set1_epi32((int)ink);
+    __m128i const vpaper = _mm_set1_epi32((int)paper);
+    __m128i const zero = _mm_setzero_si128();
+    size_t i = 0;
+    // 16 pixels at a time: compare the bytes, then widen each byte of the
+    // mask out to a whole pixel.
+    for (; i + 16 <= n; i += 16) {
+        __m128i isPaper = _mm_cmpeq_epi8(_mm_loadu_si128((__m128i const*)(src + i)), zero);
+        __m128i lo = _mm_unpacklo_epi8(isPaper, isPaper);
+        __m128i hi = _mm_unpackhi_epi8(isPaper, isPaper);
+        __m128i* out = (__m128i*)(dest + (i * 4));
+        _mm_storeu_si128(out + 0, Select(_mm_unpacklo_epi16(lo, lo), vink, vpaper));
+        _mm_storeu_si128(out + 1, Select(_mm_unpackhi_epi16(lo, lo), vink, vpaper));
+        _mm_storeu_si128(out + 2, Select(_mm_unpacklo_epi16(hi, hi), vink, vpaper));
+        _mm_storeu_si128(out + 3, Select(_mm_unpackhi_epi16(hi, hi), vink, vpaper));
+    }
+    for (; i + 4 <= n; i += 4) {
+        uint32_t four;
+        std::memcpy(&four, src + i, 4);
+        __m128i isPaper = _mm_cmpeq_epi8(_mm_cvtsi32_si128((int)four), zero);
+        isPaper = _mm_unpacklo_epi8(isPaper, isPaper);
+        isPaper = _mm_unpacklo_epi16(isPaper, isPaper);
+        _mm_storeu_si128((__m128i*)(dest + (i * 4)), Select(isPaper, vink, vpaper));
+    }
+    ExpandScalar(src + i, n - i, ink, paper, dest + (i * 4));
+}
+
+TARGET_AVX2
+static void ExpandAVX2(uint8_t const* src, size_t n, uint32_t ink, uint32_t paper, uint8_t* dest)
+{
+    __m256i const vink = _mm256_set1_epi32((int)ink);
+    __m256i const vpaper = _mm256_set1_epi32((int)paper);
+    __m256i const zero = _mm256_setzero_si256();
+    size_t i = 0;
+    // 8 pixels at a time: widen the bytes to pixels first, then compare.
+    for (; i + 8 <= n; i += 8) {
+        __m256i px = _mm256_cvtepu8_epi32(_mm_loadl_epi64((__m128i const*)(src + i)));
+        __m256i isPaper = _mm256_cmpeq_epi32(px, zero);
+        _mm256_storeu_si256((__m256i*)(dest + (i * 4)), _mm256_blendv_epi8(vink, vpaper, isPaper));
+    }
+    // Not ExpandSSE2() for the rest, as mixing in non-VEX SSE instructions
+    // is slow.
+    if (i + 4 <= n) {
+        uint32_t four;
+        std::memcpy(&four, src + i, 4);
+        __m128i px = _mm_cvtepu8_epi32(_mm_cvtsi32_si128((int)four));
+        __m128i isPaper = _mm_cmpeq_epi32(px, _mm256_castsi256_si128(zero));
+        __m128i pix = _mm_blendv_epi8(_mm256_castsi256_si128(vink), _mm256_castsi256_si128(vpaper), isPaper);
+        _mm_storeu_si128((__m128i*)(dest + (i * 4)), pix);
+        i += 4;
+    }
+    for (; i < n; ++i) {
+        uint32_t pix = src[i] ? ink : paper;
+        std::memcpy(dest + (i * 4), &pix, 4);
+    }
+}
+
+#endif  // SIMD_X86
+
+bool HasPixelKernel(PixelKernel k)
+{
+    switch (k) {
+        case PixelKernel::SCALAR:
+            return true;
+#ifdef SIMD_X86
+        case PixelKernel::SSE2:
+            return true;
+        case PixelKernel::AVX2:
+            return CPUHasAVX2();
+#endif
+        default:
+            return false;
+    }
+}
+
+static ExpandFn Kernel(PixelKernel k)
+{
+    switch (k) {
+#ifdef SIMD_X86
+        case PixelKernel::SSE2:
+            return ExpandSSE2;
+        case PixelKernel::AVX2:
+            return ExpandAVX2;
+#endif
+        default:
+            return ExpandScalar;
+    }
+}
+
+static ExpandFn BestKernel()
+{
+    for (PixelKernel k : {PixelKernel::AVX2, PixelKernel::SSE2}) {
+        if (HasPixelKernel(k)) {
+            return Kernel(k);
+        }
+    }
+    return ExpandScalar;
+}
+
+void ExpandPixels(uint8_t const* src, size_t n, uint32_t ink, uint32_t paper, uint8_t* dest)
+{
+    static ExpandFn const fn = BestKernel();
+    fn(src, n, ink, paper, dest);
+}
+
+void ExpandPixelsWith(PixelKernel k, uint8_t const* src, size_t n, uint32_t ink, uint32_t paper, uint8_t* dest)
+{
+    Kernel(k)(src, n, ink, paper, dest);
+}
+
+// Box outline, for tiles the charset doesn't have.
+static bool Placeholder(int x, int y, int tw, int th)
+{
+    if (x < 1 || y < 1 || x > tw - 2 || y > th - 2) {
+        return false;
+    }
+    return x == 1 || y == 1 || x == tw - 2 || y == th - 2;
+}
+
+// Colour i as an RGBX pixel (in memory order).
+static uint32_t Colour(Palette const& palette, int i)
+{
+    uint8_t rgbx[4] = {0, 0, 0, 255};
+    if (i < palette.ncolours && (size_t)(i + 1) * 4 <= palette.colours.size()) {
+        std::memcpy(rgbx, palette.colours.data() + (i * 4), 3);
+    }
+    uint32_t pix;
+    std::memcpy(&pix, rgbx, 4);
+    return pix;
+}
+
+void ExpandGlyph(Charset const& charset, Palette const& palette, Cell const& c, uint8_t* dest, size_t stride)
+{
+    uint32_t ink = Colour(palette, c.ink);
+    uint32_t paper = Colour(palette, c.paper);
+    int tw = charset.tw;
+    int th = charset.th;
+    if (c.tile < charset.ntiles) {
+        uint8_t const* src = charset.RawConst(c.tile);
+        if (stride == (size_t)tw * 4) {
+            // Contiguous rows (eg into GlyphCache), so do it in one go.
+            ExpandPixels(src, (size_t)tw * th, ink, paper, dest);
+            return;
+        }
+        for (int y = 0; y < th; ++y) {
+            ExpandPixels(src, tw, ink, paper, dest + (y * stride));
+            src += tw;
+        }
+        return;
+    }
+    for (int y = 0; y < th; ++y) {
+        uint8_t* out = dest + (y * stride);
+        for (int x = 0; x < tw; ++x) {
+            uint32_t pix = Placeholder(x, y, tw, th) ? ink : paper;
+            std::memcpy(out + (x * 4), &pix, 4);
+        }
+    }
+}
+
+template<size_t ROWBYTES>
+static void CopyRows(uint8_t const* src, int th, uint8_t* dest, size_t stride)
+{
+    for (int y = 0; y < th; ++y) {
+        std::memcpy(dest, src, ROWBYTES);
+        src += ROWBYTES;
+        dest += stride;
+    }
+}
+
+void CopyGlyph(uint8_t const* glyph, int tw, int th, uint8_t* dest, size_t stride)
+{
+    // Fixed-size copies for the common widths, so they're inlined.
+    switch (tw) {
+        case 8:
+            CopyRows<8 * 4>(glyph, th, dest, stride);
+            return;
+        case 16:
+            CopyRows<16 * 4>(glyph, th, dest, stride);
+            return;
+    }
+    size_t rowBytes = (size_t)tw * 4;
+    for (int y = 0; y < th; ++y) {
+        std::memcpy(dest, glyph, rowBytes);
+        glyph += rowBytes;
+        dest += stride;
+    }
+}
+
+
+GlyphCache::GlyphCache(size_t maxBytes) : mMaxBytes(maxBytes)
+{
+}
+
+uint8_t const* GlyphCache::Get(Charset const& charset, Palette const& palette, Cell const& c)
+{
+    Source src{charset.Images().data(), charset.tw, charset.th, charset.ntiles,
+        palette.colours.data(), palette.ncolours};
+    if (!(src == mSource) || mGlyphBytes == 0) {
+        Invalidate();
+        mSource = src;
+        mGlyphBytes = std::max((size_t)charset.tw * charset.th * 4, (size_t)1);
+        mCapacity = std::max(mMaxBytes / mGlyphBytes, (size_t)1);
+        size_t buckets = 16;
+        mShift = 28;
+        while (buckets < mCapacity * 2) {
+            buckets *= 2;
+            --mShift;
+        }
+        mIndex.assign(buckets, Entry{0, -1});
+    }
+
+    uint32_t key = ((uint32_t)c.tile << 16) | ((uint32_t)c.ink << 8) | c.paper;
+    // Maps are full of runs of the same cell.
+    if (mHead >= 0 && mSlots[mHead].key == key) {
+        return mPixels.data() + (mHead * mGlyphBytes);
+    }
+    int slot = Find(key);
+    if (slot >= 0) {
+        if (slot != mHead) {
+            Unlink(slot);
+            PushFront(slot);
+        }
+        return mPixels.data() + (slot * mGlyphBytes);
+    }
+
+    if (mSlots.size() < mCapacity) {
+        slot = (int)mSlots.size();
+        mSlots.push_back(Slot{key, -1, -1});
+        mPixels.resize(mSlots.size() * mGlyphBytes);
+    } else {
+        // Reuse the least recently used.
+        slot = mTail;
+        Erase(mSlots[slot].key);
+        Unlink(slot);
+        mSlots[slot].key = key;
+    }
+    PushFront(slot);
+    Insert(key, slot);
+    uint8_t* pixels = mPixels.data() + (slot * mGlyphBytes);
+    ExpandGlyph(charset, palette, c, pixels, (size_t)charset.tw * 4);
+    return pixels;
+}
+
+void GlyphCache::Invalidate()
+{
+    mSource = Source();
+    mGlyphBytes = 0;
+    mPixels.clear();
+    mSlots.clear();
+    mIndex.clear();
+    mShift = 32;
+    mHead = -1;
+    mTail = -1;
+}
+
+void GlyphCache::Unlink(int slot)
+{
+    Slot& s = mSlots[slot];
+    if (s.prev >= 0) {
+        mSlots[s.prev].next = s.next;
+    } else {
+        mHead = s.next;
+    }
+    if (s.next >= 0) {
+        mSlots[s.next].prev = s.prev;
+    } else {
+        mTail = s.prev;
+    }
+    s.prev = -1;
+    s.next = -1;
+}
+
+void GlyphCache::PushFront(int slot)
+{
+    Slot& s = mSlots[slot];
+    s.prev = -1;
+    s.next = mHead;
+    if (mHead >= 0) {
+        mSlots[mHead].prev = slot;
+    }
+    mHead = slot;
+    if (mTail < 0) {
+        mTail = slot;
+    }
+}
+
+int GlyphCache::Find(uint32_t key) const
+{
+    size_t mask = mIndex.size() - 1;
+    for (size_t i = Bucket(key); ; i = (i + 1) & mask) {
+        Entry const& e = mIndex[i];
+        if (e.slot < 0 || e.key == key) {
+            return e.slot;
+        }
+    }
+}
+
+void GlyphCache::Insert(uint32_t key, int slot)
+{
+    size_t mask = mIndex.size() - 1;
+    size_t i = Bucket(key);
+    while (mIndex[i].slot >= 0) {
+        i = (i + 1) & mask;
+    }
+    mIndex[i] = Entry{key, slot};
+}
+
+void GlyphCache::Erase(uint32_t key)
+{
+    size_t mask = mIndex.size() - 1;
+    size_t i = Bucket(key);
+    while (mIndex[i].key != key || mIndex[i].slot < 0) {
+        i = (i + 1) & mask;
+    }
+    // Shift back any following entries which would no longer be found.
+    size_t j = i;
+    while (true) {
+        j = (j + 1) & mask;
+        if (mIndex[j].slot < 0) {
+            break;
+        }
+        size_t home = Bucket(mIndex[j].key);
+        // Can the entry at j move back to i? (ie is i between its home
+        // bucket and j, cyclically)
+        if (((j - home) & mask) >= ((j - i) & mask)) {
+            mIndex[i] = mIndex[j];
+            i = j;
+        }
+    }
+    mIndex[i].slot = -1;
+}
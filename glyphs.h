@@ -0,0 +1,92 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "proj.h"
+
+// Tiles expanded out to pixels for display.
+// Pixels are RGBX, 4 bytes each (as QImage::Format_RGBX8888).
+
+// Expand n tile pixels to RGBX: ink where src is non-zero, paper where it's
+// zero. dest needs room for n * 4 bytes (no alignment needed).
+// Picks the fastest kernel the CPU supports, the first time it's called.
+void ExpandPixels(uint8_t const* src, size_t n, uint32_t ink, uint32_t paper, uint8_t* dest);
+
+// The ExpandPixels() kernels, so they can be compared (see
+// bench/bench_glyphs.cpp).
+enum class PixelKernel {SCALAR, SSE2, AVX2};
+// Is kernel k built in, and does this CPU support it?
+bool HasPixelKernel(PixelKernel k);
+// As ExpandPixels(), with kernel k (which must be supported).
+void ExpandPixelsWith(PixelKernel k, uint8_t const* src, size_t n, uint32_t ink, uint32_t paper, uint8_t* dest);
+
+// Draw cell c into dest (rows stride bytes apart), as tw x th pixels.
+// Tiles the charset doesn't have are drawn as a box outline, and colours the
+// palette doesn't have as black.
+void ExpandGlyph(Charset const& charset, Palette const& palette, Cell const& c, uint8_t* dest, size_t stride);
+// Copy a tw x th glyph (as from GlyphCache) into dest (rows stride bytes
+// apart).
+void CopyGlyph(uint8_t const* glyph, int tw, int th, uint8_t* dest, size_t stride);
+
+// Glyphs already expanded, keyed by (tile, ink, paper), so drawing a cell
+// is just a copy of each row. Holds a bounded number, dropping the least
+// recently used.
+// A different charset or palette (different image data) is spotted, but
+// changes made to them in place aren't, so call Invalidate() on
+// ProjCharsetModified() etc.
+class GlyphCache
+{
+public:
+    explicit GlyphCache(size_t maxBytes = 4 * 1024 * 1024);
+
+    // The glyph for c: tw x th pixels, rows tw * 4 bytes apart. Only valid
+    // until the next call.
+    uint8_t const* Get(Charset const& charset, Palette const& palette, Cell const& c);
+    // Forget all the glyphs.
+    void Invalidate();
+    size_t Count() const {return mSlots.size();}
+
+private:
+    // What the glyphs were expanded from.
+    struct Source {
+        uint8_t const* images{nullptr};
+        int tw{0};
+        int th{0};
+        int ntiles{0};
+        uint8_t const* colours{nullptr};
+        int ncolours{0};
+        bool operator==(Source const&) const = default;
+    };
+    // Glyph slots, in a list from most to least recently used.
+    struct Slot {
+        uint32_t key;
+        int prev;
+        int next;
+    };
+
+    void Unlink(int slot);
+    void PushFront(int slot);
+    // The index table: open addressing (linear probing), at most half full.
+    size_t Bucket(uint32_t key) const {return (key * 0x9E3779B1u) >> mShift;}
+    int Find(uint32_t key) const;
+    void Insert(uint32_t key, int slot);
+    void Erase(uint32_t key);
+
+    size_t mMaxBytes;
+    Source mSource;
+    size_t mGlyphBytes{0};
+    size_t mCapacity{0};        // In glyphs.
+    std::vector<uint8_t> mPixels;   // One glyph per slot.
+    std::vector<Slot> mSlots;
+    int mHead{-1};
+    int mTail{-1};
+    // Key to slot.
+    struct Entry {
+        uint32_t key;
+        int slot;   // -1 if empty.
+    };
+    std::vector<Entry> mIndex;
+    int mShift{32};
+};
@@ -0,0 +1,688 @@
+#include "journal.h"
+#include "compress.h"
+#include "model.h"
+
+#include <cassert>
+#include <cstring>
+#include <filesystem>
+
+// Anything bigger than this is assumed to be garbage.
+static constexpr uint32_t MAX_RECORD = 1u << 30;
+
+static uint32_t checksum(uint8_t const* p, size_t n)
+{
+    // FNV-1a
+    uint32_t h = 2166136261u;
+    for (size_t i = 0; i < n; ++i) {
+        h = (h ^ p[i]) * 16777619u;
+    }
+    return h;
+}
+
+static uint64_t HashFile(std::string const& path)
+{
+    std::ifstream in(path, std::ios::binary);
+    if (!in) {
+        return 0;
+    }
+    // FNV-1a
+    uint64_t h = 14695981039346656037ull;
+    char buf[65536];
+    while (in) {
+        in.read(buf, sizeof(buf));
+        std::streamsize n = in.gcount();
+        for (std::streamsize i = 0; i < n; ++i) {
+            h = (h ^ (uint8_t)buf[i]) * 1099511628211ull;
+        }
+    }
+    return h;
+}
+
+uint64_t JournalBase(ProjLayout const& layout, std::string const& path)
+{
+    uint64_t id = layout.FileId();
+    return id ? id : HashFile(path);
+}
+
+static uint32_t getU32(uint8_t const* p)
+{
+    return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+// Read the record at the current position into rec (op + payload).
+// Returns false if it's missing, torn or corrupt.
+static bool readRecord(std::istream& in, std::vector<uint8_t>& rec)
+{
+    uint8_t hdr[8];
+    if (!in.read((char*)hdr, sizeof(hdr))) {
+        return false;
+    }
+    uint32_t len = getU32(hdr);
+    if (len < 1 || len > MAX_RECORD) {
+        return false;
+    }
+    rec.resize(len);
+    if (!in.read((char*)rec.data(), len)) {
+        return false;
+    }
+    return checksum(rec.data(), rec.size()) == getU32(hdr + 4);
+}
+
+
+//
+// Journal
+//
+
+Journal::~Journal()
+{
+    Stop();
+}
+
+void Journal::Stop()
+{
+    if (mThread.joinable()) {
+        {
+            std::lock_guard<std::mutex> lock(mLock);
+            mQuit = true;
+        }
+        mWake.notify_all();
+        mThread.join();
+    }
+    mQuit = false;
+    mOut.close();
+    mIn.close();
+}
+
+bool Journal::OpenForAppend()
+{
+    mOut.open(mPath, std::ios::binary | std::ios::app);
+    if (!mOut) {
+        mFailed = true;
+        return false;
+    }
+    mFailed = false;
+    mThread = std::thread([this]() {WriterThread();});
+    return true;
+}
+
+bool Journal::Start(std::string const& path, uint64_t baseHash)
+{
+    Stop();
+    mPath = path;
+    {
+        std::ofstream out(mPath, std::ios::binary | std::ios::trunc);
+        out.write("RMJ1", 4);
+        if (!out) {
+            mFailed = true;
+            return false;
+        }
+    }
+    mEnd = 4;
+    if (!OpenForAppend()) {
+        return false;
+    }
+    Rebase(baseHash);
+    return true;
+}
+
+bool Journal::Resume(std::string const& path, uint64_t baseHash, Model& model)
+{
+    Stop();
+    mPath = path;
+
+    // First pass: find the good records, and the last base.
+    struct Rec {
+        int64_t pos;
+        uint8_t op;
+    };
+    std::vector<Rec> recs;
+    int lastBase = -1;
+    uint64_t lastHash = 0;
+    int64_t end = 4;
+    {
+        std::ifstream in(path, std::ios::binary);
+        char magic[4];
+        if (!in.read(magic, 4) || std::memcmp(magic, "RMJ1", 4) != 0) {
+            Start(path, baseHash);
+            return false;
+        }
+        std::vector<uint8_t> rec;
+        while (readRecord(in, rec)) {
+            recs.push_back(Rec{end, rec[0]});
+            if (rec[0] == OP_BASE) {
+                RecordIn r(rec.data() + 1, rec.data() + rec.size());
+                lastHash = r.U64();
+                lastBase = (int)recs.size() - 1;
+            }
+            end = in.tellg();
+        }
+    }
+    if (lastBase < 0 || lastHash != baseHash) {
+        // Not for this file.
+        Start(path, baseHash);
+        return false;
+    }
+    // Chop off anything torn at the end, so we can append cleanly.
+    std::error_code err;
+    if ((int64_t)std::filesystem::file_size(path, err) != end) {
+        std::filesystem::resize_file(path, end, err);
+    }
+    mEnd = end;
+
+    // History before the base is already in the file, so just needs
+    // placeholders.
+    model.ClearHistory();
+    std::vector<int64_t> undo;
+    std::vector<int64_t> redo;
+    for (int i = 0; i < lastBase; ++i) {
+        switch (recs[i].op) {
+        case OP_DO:
+        case OP_LOSSY_DO:
+            undo.push_back(recs[i].pos);
+            redo.clear();
+            break;
+        case OP_UNDO:
+            if (!undo.empty()) {
+                redo.push_back(undo.back());
+                undo.pop_back();
+            }
+            break;
+        case OP_REDO:
+            if (!redo.empty()) {
+                undo.push_back(redo.back());
+                redo.pop_back();
+            }
+            break;
+        }
+    }
+    for (int64_t pos : undo) {
+        model.undoStack.push_back(new JournaledCmd(model, *this, pos, Cmd::DONE));
+    }
+    for (int64_t pos : redo) {
+        model.redoStack.push_back(new JournaledCmd(model, *this, pos, Cmd::NOT_DONE));
+    }
+
+    // Replay everything since.
+    mReplaying = true;
+    model.journal = this;
+    for (int i = lastBase + 1; i < (int)recs.size(); ++i) {
+        if (recs[i].op == OP_DO || recs[i].op == OP_LOSSY_DO) {
+            Cmd* cmd = Load(model, recs[i].pos, Cmd::NOT_DONE, true);
+            if (!cmd) {
+                break;
+            }
+            model.AddCmd(cmd);
+        } else if (recs[i].op == OP_UNDO) {
+            if (!model.Undo()) {
+                break;
+            }
+        } else if (recs[i].op == OP_REDO) {
+            if (!model.Redo()) {
+                break;
+            }
+        }
+        model.modified = true;
+    }
+    mReplaying = false;
+    return OpenForAppend();
+}
+
+void Journal::Rebase(uint64_t baseHash)
+{
+    std::vector<uint8_t> payload;
+    RecordOut out(payload);
+    out.U64(baseHash);
+    Append(OP_BASE, payload);
+}
+
+bool Journal::MoveTo(std::string const& path)
+{
+    Flush();
+    Stop();
+    std::error_code err;
+    std::filesystem::copy_file(mPath, path, std::filesystem::copy_options::overwrite_existing, err);
+    if (err) {
+        mFailed = true;
+        return false;
+    }
+    mPath = path;
+    return OpenForAppend();
+}
+
+void Journal::Discard()
+{
+    Stop();
+    if (!mPath.empty()) {
+        std::error_code err;
+        std::filesystem::remove(mPath, err);
+        mPath.clear();
+    }
+}
+
+void Journal::RecordDo(Cmd& cmd)
+{
+    if (mReplaying || mPath.empty()) {
+        return;
+    }
+    std::vector<uint8_t> payload;
+    RecordOut out(payload);
+    cmd.Write(out);
+    int64_t pos = Append(out.lossy ? OP_LOSSY_DO : OP_DO, payload);
+    // Lossy ones can't be swapped out, as they can't be reloaded.
+    cmd.journalPos = out.lossy ? -1 : pos;
+}
+
+void Journal::RecordUndo()
+{
+    Append(OP_UNDO, {});
+}
+
+void Journal::RecordRedo()
+{
+    Append(OP_REDO, {});
+}
+
+int64_t Journal::Append(uint8_t op, std::vector<uint8_t> const& payload)
+{
+    if (mReplaying || mPath.empty()) {
+        return -1;
+    }
+    std::vector<uint8_t> rec;
+    rec.reserve(9 + payload.size());
+    RecordOut out(rec);
+    out.U32((uint32_t)(1 + payload.size()));
+    out.U32(0); // checksum, filled in below.
+    out.U8(op);
+    out.Bytes(payload.data(), payload.size());
+    uint32_t sum = checksum(rec.data() + 8, rec.size() - 8);
+    for (int i = 0; i < 4; ++i) {
+        rec[4 + i] = (sum >> (i * 8)) & 0xff;
+    }
+
+    int64_t pos = mEnd;
+    mEnd += rec.size();
+    {
+        std::lock_guard<std::mutex> lock(mLock);
+        mQueue.push_back(std::move(rec));
+    }
+    mWake.notify_one();
+    return pos;
+}
+
+void Journal::Flush()
+{
+    std::unique_lock<std::mutex> lock(mLock);
+    mWritten.wait(lock, [&]() {return (mQueue.empty() && !mBusy) || !mThread.joinable();});
+}
+
+void Journal::WriterThread()
+{
+    std::unique_lock<std::mutex> lock(mLock);
+    while (true) {
+        mWake.wait(lock, [&]() {return mQuit || !mQueue.empty();});
+        if (mQueue.empty()) {
+            break;  // Quitting, and nothing left to write.
+        }
+        std::deque<std::vector<uint8_t>> batch;
+        std::swap(batch, mQueue);
+        mBusy = true;
+        lock.unlock();
+
+        for (auto const& rec : batch) {
+            mOut.write((char const*)rec.data(), rec.size());
+        }
+        mOut.flush();
+        bool ok = mOut.good();
+
+        lock.lock();
+        mBusy = false;
+        if (!ok) {
+            mFailed = true;
+        }
+        mWritten.notify_all();
+    }
+}
+
+Cmd* Journal::Load(Model& model, int64_t pos, Cmd::CmdState state)
+{
+    return Load(model, pos, state, false);
+}
+
+Cmd* Journal::Load(Model& model, int64_t pos, Cmd::CmdState state, bool lossyOK)
+{
+    Flush();
+    if (!mIn.is_open()) {
+        mIn.open(mPath, std::ios::binary);
+    }
+    mIn.clear();
+    mIn.seekg(pos);
+    std::vector<uint8_t> rec;
+    if (!readRecord(mIn, rec)) {
+        return nullptr;
+    }
+    if (rec[0] != OP_DO && !(lossyOK && rec[0] == OP_LOSSY_DO)) {
+        return nullptr;
+    }
+    RecordIn in(rec.data() + 1, rec.data() + rec.size());
+    Cmd* cmd = ReadCmd(model, in, state);
+    if (cmd) {
+        cmd->journalPos = (rec[0] == OP_DO) ? pos : -1;
+    }
+    return cmd;
+}
+
+
+//
+// JournaledCmd
+//
+
+JournaledCmd::JournaledCmd(Model& ed, Journal& journal, int64_t pos, CmdState state) :
+    Cmd(ed, state), mJournal(journal)
+{
+    journalPos = pos;
+}
+
+JournaledCmd::~JournaledCmd()
+{
+    delete mLoaded;
+}
+
+Cmd* JournaledCmd::Get()
+{
+    if (!mLoaded) {
+        mLoaded = mJournal.Load(mEd, journalPos, mState);
+    }
+    return mLoaded;
+}
+
+// If the cmd can't be reloaded, the state is left as it was (see
+// Model::Undo()).
+void JournaledCmd::Do()
+{
+    Cmd* cmd = Get();
+    if (!cmd) {
+        return;
+    }
+    cmd->Do();
+    mState = DONE;
+}
+
+void JournaledCmd::Undo()
+{
+    Cmd* cmd = Get();
+    if (!cmd) {
+        return;
+    }
+    cmd->Undo();
+    mState = NOT_DONE;
+}
+
+size_t JournaledCmd::Cost() const
+{
+    return sizeof(*this) + (mLoaded ? mLoaded->Cost() : 0);
+}
+
+void JournaledCmd::Compress()
+{
+    delete mLoaded;
+    mLoaded = nullptr;
+}
+
+Cmd* JournaledCmd::Release()
+{
+    Cmd* cmd = Get();
+    mLoaded = nullptr;
+    return cmd;
+}
+
+void JournaledCmd::Write(RecordOut& out) const
+{
+    Cmd* cmd = const_cast<JournaledCmd*>(this)->Get();
+    if (cmd) {
+        cmd->Write(out);
+    }
+}
+
+
+//
+// RecordOut
+//
+
+void RecordOut::U32(uint32_t v)
+{
+    for (int i = 0; i < 4; ++i) {
+        mBuf.push_back((v >> (i * 8)) & 0xff);
+    }
+}
+
+void RecordOut::U64(uint64_t v)
+{
+    U32((uint32_t)v);
+    U32((uint32_t)(v >> 32));
+}
+
+void RecordOut::String(std::string const& s)
+{
+    U32((uint32_t)s.size());
+    Bytes((uint8_t const*)s.data(), s.size());
+}
+
+void RecordOut::Rect(MapRect const& r)
+{
+    Int(r.x);
+    Int(r.y);
+    Int(r.w);
+    Int(r.h);
+}
+
+void RecordOut::Entity(Ent const& ent)
+{
+    U32((uint32_t)ent.attrs.size());
+    for (auto const& attr : ent.attrs) {
+        String(attr.name.str());
+        String(attr.value);
+    }
+}
+
+void RecordOut::Ents(std::vector<Ent> const& ents)
+{
+    U32((uint32_t)ents.size());
+    for (auto const& ent : ents) {
+        Entity(ent);
+    }
+}
+
+void RecordOut::Chunk(CellChunk const& chunk)
+{
+    U8(chunk.uniform ? 1 : 0);
+    RLEEncode((uint8_t const*)chunk.tile, CHUNK_CELLS, sizeof(uint16_t), mBuf);
+    RLEEncode(chunk.ink, CHUNK_CELLS, 1, mBuf);
+    RLEEncode(chunk.paper, CHUNK_CELLS, 1, mBuf);
+}
+
+void RecordOut::Map(Tilemap const& map)
+{
+    // A bad map's cells read as blank. The real ones are only in the file
+    // it came from.
+    if (map.IsBad()) {
+        lossy = true;
+    }
+    U32((uint32_t)map.w);
+    U32((uint32_t)map.h);
+    for (int cy = 0; cy < map.ChunksH(); ++cy) {
+        for (int cx = 0; cx < map.ChunksW(); ++cx) {
+            Chunk(map.ChunkConst(cx, cy));
+        }
+    }
+    Ents(map.ents);
+}
+
+void RecordOut::Maps(std::vector<Tilemap> const& maps)
+{
+    U32((uint32_t)maps.size());
+    for (auto const& map : maps) {
+        Map(map);
+    }
+}
+
+void RecordOut::Tiles(Charset const& charset)
+{
+    U32((uint32_t)charset.tw);
+    U32((uint32_t)charset.th);
+    U32((uint32_t)charset.ntiles);
+    RLEEncode(charset.Images().data(), charset.Images().size(), 1, mBuf);
+}
+
+
+//
+// RecordIn
+//
+
+bool RecordIn::Need(size_t n)
+{
+    if (!ok || (size_t)(mEnd - mP) < n) {
+        ok = false;
+        return false;
+    }
+    return true;
+}
+
+uint8_t RecordIn::U8()
+{
+    if (!Need(1)) {
+        return 0;
+    }
+    return *mP++;
+}
+
+uint32_t RecordIn::U32()
+{
+    if (!Need(4)) {
+        return 0;
+    }
+    uint32_t v = getU32(mP);
+    mP += 4;
+    return v;
+}
+
+uint64_t RecordIn::U64()
+{
+    uint64_t lo = U32();
+    uint64_t hi = U32();
+    return lo | (hi << 32);
+}
+
+std::string RecordIn::String()
+{
+    uint32_t n = U32();
+    if (!Need(n)) {
+        return std::string();
+    }
+    std::string s((char const*)mP, n);
+    mP += n;
+    return s;
+}
+
+MapRect RecordIn::Rect()
+{
+    int x = Int();
+    int y = Int();
+    int w = Int();
+    int h = Int();
+    return MapRect(x, y, w, h);
+}
+
+Ent RecordIn::Entity()
+{
+    Ent ent;
+    uint32_t n = U32();
+    for (uint32_t i = 0; i < n && ok; ++i) {
+        EntAttr attr;
+        attr.name = String();
+        attr.value = String();
+        ent.attrs.push_back(attr);
+    }
+    return ent;
+}
+
+std::vector<Ent> RecordIn::Ents()
+{
+    std::vector<Ent> ents;
+    uint32_t n = U32();
+    for (uint32_t i = 0; i < n && ok; ++i) {
+        ents.push_back(Entity());
+    }
+    return ents;
+}
+
+std::shared_ptr<CellChunk> RecordIn::Chunk()
+{
+    auto chunk = std::make_shared<CellChunk>();
+    chunk->uniform = U8() != 0;
+    if (!ok) {
+        return chunk;
+    }
+    mP = RLEDecode(mP, mEnd, sizeof(uint16_t), (uint8_t*)chunk->tile, CHUNK_CELLS);
+    if (mP) {
+        mP = RLEDecode(mP, mEnd, 1, chunk->ink, CHUNK_CELLS);
+    }
+    if (mP) {
+        mP = RLEDecode(mP, mEnd, 1, chunk->paper, CHUNK_CELLS);
+    }
+    if (!mP) {
+        mP = mEnd;
+        ok = false;
+    }
+    return chunk;
+}
+
+Tilemap RecordIn::Map()
+{
+    uint32_t w = U32();
+    uint32_t h = U32();
+    if (!ok || w > 65535 || h > 65535) {
+        ok = false;
+        return Tilemap();
+    }
+    Tilemap map(w, h);
+    for (int cy = 0; cy < map.ChunksH() && ok; ++cy) {
+        for (int cx = 0; cx < map.ChunksW() && ok; ++cx) {
+            map.SetSharedChunk(cx, cy, Chunk());
+        }
+    }
+    map.ents = Ents();
+    map.Compact();
+    return map;
+}
+
+std::vector<Tilemap> RecordIn::Maps()
+{
+    std::vector<Tilemap> maps;
+    uint32_t n = U32();
+    for (uint32_t i = 0; i < n && ok; ++i) {
+        maps.push_back(Map());
+    }
+    return maps;
+}
+
+Charset RecordIn::Tiles()
+{
+    Charset charset;
+    charset.tw = (int)U32();
+    charset.th = (int)U32();
+    charset.ntiles = (int)U32();
+    size_t n = (size_t)charset.tw * charset.th * charset.ntiles;
+    if (!ok || charset.tw > 256 || charset.th > 256 || charset.ntiles > 65536) {
+        ok = false;
+        return charset;
+    }
+    std::vector<uint8_t> images(n);
+    mP = RLEDecode(mP, mEnd, 1, images.data(), n);
+    if (!mP) {
+        mP = mEnd;
+        ok = false;
+        return charset;
+    }
+    charset.SetImages(std::move(images));
+    return charset;
+}
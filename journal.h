@@ -0,0 +1,185 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <deque>
+#include <fstream>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <thread>
+
+#include "proj.h"
+#include "cmd.h"
+
+class Model;
+
+// The undo journal.
+// An append-only file recording every Cmd as it's committed (along with
+// undos and redos), so that:
+// - after a crash, the project can be reopened and the journal replayed to
+//   get back to where we were.
+// - old undo entries can be dropped from memory, and reloaded from the
+//   journal if they're needed again (see JournaledCmd).
+//
+// The journal is tied to a saved project file by its identity (see
+// Rebase() and JournalBase()), and only replayed onto that same file.
+// Records are written out by a background thread.
+//
+// File format:
+//   "RMJ1"
+//   records, each:
+//     u32 length (of op + payload)
+//     u32 checksum (of op + payload)
+//     u8 op
+//     payload
+// A torn record at the end (eg from a crash mid-write) is ignored.
+class Journal
+{
+public:
+    Journal() = default;
+    ~Journal();
+
+    // Start a new, empty journal at path (overwriting any existing one),
+    // for a project file with the given base (see JournalBase()).
+    bool Start(std::string const& path, uint64_t baseHash);
+    // Open an existing journal and replay it onto model, which should hold
+    // the project as loaded from the file with the given base. Carries on
+    // appending to it afterward.
+    // If there's nothing usable to replay, a new journal is started instead
+    // (and returns false).
+    bool Resume(std::string const& path, uint64_t baseHash, Model& model);
+    // The project has been saved, so that's the new starting point for
+    // any replay.
+    void Rebase(uint64_t baseHash);
+    // Carry on in a new file (eg after "save as"), keeping the history.
+    bool MoveTo(std::string const& path);
+    // Stop, and delete the journal file (eg if changes are being discarded).
+    void Discard();
+
+    // Called by Model.
+    // RecordDo() sets cmd.journalPos.
+    void RecordDo(Cmd& cmd);
+    void RecordUndo();
+    void RecordRedo();
+
+    // Reload a cmd recorded at pos, in the given state.
+    // Returns nullptr upon failure, or if the record is lossy (see
+    // RecordOut::lossy).
+    Cmd* Load(Model& model, int64_t pos, Cmd::CmdState state);
+
+    // Wait until everything has been written out.
+    void Flush();
+    // Has writing failed?
+    bool Failed() const {return mFailed;}
+    std::string const& Path() const {return mPath;}
+
+private:
+    // OP_LOSSY_DO is an OP_DO which is only good for replaying.
+    enum {OP_BASE = 1, OP_DO, OP_UNDO, OP_REDO, OP_LOSSY_DO};
+    Cmd* Load(Model& model, int64_t pos, Cmd::CmdState state, bool lossyOK);
+    int64_t Append(uint8_t op, std::vector<uint8_t> const& payload);
+    bool OpenForAppend();
+    void Stop();
+    void WriterThread();
+
+    std::string mPath;
+    std::ifstream mIn;
+    int64_t mEnd{0};    // Including records still queued.
+    bool mReplaying{false};
+
+    // Shared with writer thread.
+    std::mutex mLock;
+    std::condition_variable mWake;
+    std::condition_variable mWritten;
+    std::deque<std::vector<uint8_t>> mQueue;
+    std::ofstream mOut;
+    bool mBusy{false};
+    bool mQuit{false};
+    std::atomic<bool> mFailed{false};
+    std::thread mThread;
+};
+
+// What to tie a journal for the file at path to, given the layout it was
+// loaded or saved with: ProjLayout::FileId(), which is cheap. Files without
+// one (older formats, which are never saved as) fall back to a hash of the
+// whole file (0 if unreadable).
+uint64_t JournalBase(ProjLayout const& layout, std::string const& path);
+
+
+// Stands in for a Cmd which has been dropped from memory, and reloads it
+// from the journal as needed.
+class JournaledCmd : public Cmd
+{
+public:
+    JournaledCmd() = delete;
+    JournaledCmd(Model& ed, Journal& journal, int64_t pos, CmdState state);
+    virtual ~JournaledCmd();
+    virtual void Do();
+    virtual void Undo();
+    virtual size_t Cost() const;
+    // Drops the cmd from memory again.
+    virtual void Compress();
+    virtual void Write(RecordOut& out) const;
+    // Reload the cmd and hand it over (nullptr upon failure).
+    Cmd* Release();
+private:
+    Cmd* Get();
+    Journal& mJournal;
+    Cmd* mLoaded{nullptr};
+};
+
+
+// Helpers for writing journal record payloads.
+// Ints are little-endian.
+class RecordOut
+{
+public:
+    RecordOut(std::vector<uint8_t>& buf) : mBuf(buf) {}
+    // Set if something couldn't be written out faithfully (a bad map), so
+    // the record will do to replay the cmd, but not to undo it.
+    bool lossy{false};
+    void U8(uint8_t v) {mBuf.push_back(v);}
+    void U32(uint32_t v);
+    void U64(uint64_t v);
+    void Int(int v) {U32((uint32_t)v);}
+    void Bytes(uint8_t const* p, size_t n) {mBuf.insert(mBuf.end(), p, p + n);}
+    void String(std::string const& s);
+    void Rect(MapRect const& r);
+    void Entity(Ent const& ent);
+    void Ents(std::vector<Ent> const& ents);
+    void Chunk(CellChunk const& chunk);
+    void Map(Tilemap const& map);
+    void Maps(std::vector<Tilemap> const& maps);
+    void Tiles(Charset const& charset);
+private:
+    std::vector<uint8_t>& mBuf;
+};
+
+// Helpers for reading journal record payloads.
+// Upon bad or missing data, ok is cleared and the readers return
+// zeroed/empty values from then on.
+class RecordIn
+{
+public:
+    RecordIn(uint8_t const* p, uint8_t const* end) : mP(p), mEnd(end) {}
+    bool ok{true};
+    bool AtEnd() const {return mP >= mEnd;}
+    uint8_t U8();
+    uint32_t U32();
+    uint64_t U64();
+    int Int() {return (int)U32();}
+    std::string String();
+    MapRect Rect();
+    Ent Entity();
+    std::vector<Ent> Ents();
+    std::shared_ptr<CellChunk> Chunk();
+    Tilemap Map();
+    std::vector<Tilemap> Maps();
+    Charset Tiles();
+private:
+    bool Need(size_t n);
+    uint8_t const* mP;
+    uint8_t const* mEnd;
+};
@@ -1,9 +1,12 @@
 #include "cmd.h"
+#include "journal.h"
 #include "model.h"
 #include "proj.h"
 //#include "helpers.h"
 #include "tool.h"
 
+#include <algorithm>
+
 
 Model::Model()
 {
@@ -11,6 +14,7 @@ Model::Model()
     rightPen = {32,0,0};
     DefaultProj(&proj);
     tool = new DrawTool(*this);
+    listeners.insert(&mLayoutTracker);
 }
 
 
@@ -18,6 +22,12 @@ Model::~Model()
 {
     delete tool;
     tool = nullptr;
+    delete mTransaction;
+    ClearHistory();
+}
+
+void Model::ClearHistory()
+{
     while(!undoStack.empty()) {
         delete undoStack.back();
         undoStack.pop_back();
@@ -28,6 +38,32 @@ Model::~Model()
     }
 }
 
+bool Model::UnjournalHistory()
+{
+    // Nearest the current state first, so a failure loses as little as
+    // possible.
+    auto unjournal = [&](std::vector<Cmd*>& stack) {
+        for (size_t i = stack.size(); i-- > 0;) {
+            JournaledCmd* placeholder = dynamic_cast<JournaledCmd*>(stack[i]);
+            if (placeholder) {
+                Cmd* cmd = placeholder->Release();
+                if (!cmd) {
+                    DropHistory(stack, i + 1);
+                    return false;
+                }
+                delete placeholder;
+                stack[i] = cmd;
+            }
+            stack[i]->journalPos = -1;
+        }
+        return true;
+    };
+    bool ok = unjournal(undoStack);
+    ok = unjournal(redoStack) && ok;
+    TrimUndo();
+    return ok;
+}
+
 void Model::SetTool(int toolKind)
 {
     Tool* newTool = nullptr;
@@ -57,48 +93,461 @@ void Model::SetTool(int toolKind)
 // Adds a command to the undo stack, and calls its Do() fn
 void Model::AddCmd(Cmd* cmd)
 {
-    //const int maxundos = 128;
-
+    if (mTransaction) {
+        // Becomes part of the transaction instead.
+        if(cmd->State() == Cmd::NOT_DONE) {
+            cmd->Do();
+        }
+        mTransaction->Add(cmd);
+        if (journal) {
+            mTransaction->Record(*cmd);
+        }
+        return;
+    }
     undoStack.push_back(cmd);
     if(cmd->State() == Cmd::NOT_DONE) {
         cmd->Do();
     }
+    if (journal) {
+        journal->RecordDo(*cmd);
+    }
 
     // adding a new command renders the redo stack obsolete.
     while(!redoStack.empty()) {
         delete redoStack.back();
         redoStack.pop_back();
     }
-/*
-    // limit amount of undos to something reasonable.
-    int trimcount = undoStack.size() - maxundos;
-    while(trimcount > 0) {
-        delete undoStack.front();
-        undoStack.pop_front();
-        --trimcount;
-    }
-*/
+    TrimUndo();
 }
 
 
-void Model::Undo()
+bool Model::Undo()
 {
+    assert(!mTransaction);
     if(undoStack.empty()) {
-        return;
+        return true;
     }
     Cmd* cmd = undoStack.back();
     undoStack.pop_back();
     cmd->Undo();
+    if (cmd->State() != Cmd::NOT_DONE) {
+        // Couldn't be reloaded from the journal, so neither it nor anything
+        // before it can be undone.
+        delete cmd;
+        DropHistory(undoStack, undoStack.size());
+        return false;
+    }
     redoStack.push_back(cmd);
+    if (journal) {
+        journal->RecordUndo();
+    }
+    TrimUndo();
+    return true;
 }
 
-void Model::Redo()
+bool Model::Redo()
 {
+    assert(!mTransaction);
     if(redoStack.empty())
-        return;
+        return true;
     Cmd* cmd = redoStack.back();
     redoStack.pop_back();
     cmd->Do();
+    if (cmd->State() != Cmd::DONE) {
+        // As above, the rest of the redo stack is lost with it.
+        delete cmd;
+        DropHistory(redoStack, redoStack.size());
+        return false;
+    }
     undoStack.push_back(cmd);
+    if (journal) {
+        journal->RecordRedo();
+    }
+    TrimUndo();
+    return true;
 }
 
+// Delete the first n cmds of an undo/redo stack (ie the ones furthest
+// from the current state).
+void Model::DropHistory(std::vector<Cmd*>& stack, size_t n)
+{
+    for (size_t i = 0; i < n; ++i) {
+        delete stack[i];
+    }
+    stack.erase(stack.begin(), stack.begin() + n);
+}
+
+size_t Model::UndoCost() const
+{
+    size_t n = 0;
+    for (Cmd const* cmd : undoStack) {
+        n += cmd->Cost();
+    }
+    for (Cmd const* cmd : redoStack) {
+        n += cmd->Cost();
+    }
+    return n;
+}
+
+// Keep the undo/redo stacks within undoBudget.
+// Older entries are compressed. If that's not enough, they're swapped out
+// to the journal (if there is one) and failing that, the oldest thrown
+// away. The most recent entry is always kept.
+void Model::TrimUndo()
+{
+    int hot = std::max(undoUncompressed, 0);
+    for (int i = 0; i < (int)undoStack.size() - hot; ++i) {
+        undoStack[i]->Compress();
+    }
+    for (int i = 0; i < (int)redoStack.size() - hot; ++i) {
+        redoStack[i]->Compress();
+    }
+
+    size_t total = UndoCost();
+    if (journal && !journal->Failed()) {
+        auto evict = [&](Cmd*& cmd) {
+            if (cmd->journalPos < 0 || dynamic_cast<JournaledCmd*>(cmd)) {
+                return;
+            }
+            Cmd* placeholder = new JournaledCmd(*this, *journal, cmd->journalPos, cmd->State());
+            // (Approximate - chunks shared between cmds skew it.)
+            total -= std::min(total, cmd->Cost());
+            total += placeholder->Cost();
+            delete cmd;
+            cmd = placeholder;
+        };
+        for (int i = 0; i < (int)undoStack.size() - 1 && total > undoBudget; ++i) {
+            evict(undoStack[i]);
+        }
+        for (int i = 0; i < (int)redoStack.size() - 1 && total > undoBudget; ++i) {
+            evict(redoStack[i]);
+        }
+        total = UndoCost();
+    }
+    int trimcount = 0;
+    while (total > undoBudget && trimcount < (int)undoStack.size() - 1) {
+        total -= undoStack[trimcount]->Cost();
+        delete undoStack[trimcount];
+        ++trimcount;
+    }
+    undoStack.erase(undoStack.begin(), undoStack.begin() + trimcount);
+}
+
+
+
+void Model::BeginTransaction()
+{
+    if (mTransactionDepth++ == 0) {
+        mTransaction = new CompoundCmd(*this);
+    }
+    HoldNotifications();
+}
+
+void Model::EndTransaction()
+{
+    assert(mTransactionDepth > 0);
+    if (--mTransactionDepth == 0) {
+        CompoundCmd* cmd = mTransaction;
+        mTransaction = nullptr;
+        if (cmd->IsEmpty()) {
+            delete cmd;
+        } else {
+            AddCmd(cmd);    // Already done.
+        }
+    }
+    ReleaseNotifications();
+}
+
+
+void Model::NotifyMapModified(int mapNum, MapRect const& dirty)
+{
+    ProjChange c{ProjChange::MAP_MODIFIED, mapNum};
+    c.dirty = dirty;
+    Notify(std::move(c));
+}
+
+void Model::NotifyCharsetModified()
+{
+    Notify(ProjChange{ProjChange::CHARSET_MODIFIED});
+}
+
+void Model::NotifyNuke()
+{
+    Notify(ProjChange{ProjChange::NUKE});
+}
+
+void Model::NotifyMapsInserted(int mapNum, int count)
+{
+    Notify(ProjChange{ProjChange::MAPS_INSERTED, mapNum, 0, count});
+}
+
+void Model::NotifyMapsRemoved(int mapNum, int count)
+{
+    Notify(ProjChange{ProjChange::MAPS_REMOVED, mapNum, 0, count});
+}
+
+void Model::NotifyEntsInserted(int mapNum, int entNum, int count)
+{
+    Notify(ProjChange{ProjChange::ENTS_INSERTED, mapNum, entNum, count});
+}
+
+void Model::NotifyEntsRemoved(int mapNum, int entNum, int count)
+{
+    Notify(ProjChange{ProjChange::ENTS_REMOVED, mapNum, entNum, count});
+}
+
+void Model::NotifyEntChanged(int mapNum, int entNum, Ent const& oldData, Ent const& newData)
+{
+    ProjChange c{ProjChange::ENT_CHANGED, mapNum, entNum, 1};
+    c.oldData = oldData;
+    c.newData = newData;
+    Notify(std::move(c));
+}
+
+void Model::HoldNotifications()
+{
+    ++mHoldDepth;
+}
+
+void Model::ReleaseNotifications()
+{
+    assert(mHoldDepth > 0);
+    if (--mHoldDepth > 0) {
+        return;
+    }
+    // Listeners might cause more notifications.
+    std::vector<ProjChange> held;
+    std::swap(held, mHeld);
+    for (auto const& c : held) {
+        Dispatch(c);
+    }
+}
+
+void Model::Notify(ProjChange&& change)
+{
+    ++changeCount;
+    if (change.kind == ProjChange::MAP_MODIFIED) {
+        ++damageReceived;
+    }
+    if (mHoldDepth == 0) {
+        Dispatch(change);
+    } else if (change.kind == ProjChange::NUKE) {
+        // Covers everything else.
+        mHeld.clear();
+        mHeld.push_back(std::move(change));
+    } else if (!Merge(change)) {
+        mHeld.push_back(std::move(change));
+    }
+}
+
+// Try to merge a newly-inserted or removed run of items (maps or ents) into a
+// held one. Indices are as at the time of each notification.
+static bool mergeRun(int& first, int& count, int newFirst, int newCount, bool inserted)
+{
+    if (inserted) {
+        if (newFirst >= first && newFirst <= first + count) {
+            count += newCount;
+            return true;
+        }
+    } else {
+        if (newFirst == first) {
+            count += newCount;
+            return true;
+        }
+        if (newFirst + newCount == first) {
+            first = newFirst;
+            count += newCount;
+            return true;
+        }
+    }
+    return false;
+}
+
+// Try to fold change into the held notifications.
+// Returns false if it needs to be added separately.
+bool Model::Merge(ProjChange const& c)
+{
+    if (!mHeld.empty() && mHeld.front().kind == ProjChange::NUKE) {
+        return true;    // Already covered.
+    }
+    for (auto it = mHeld.rbegin(); it != mHeld.rend(); ++it) {
+        ProjChange& h = *it;
+        // Map numbers aren't comparable across inserted/removed maps.
+        bool mapsMoved = h.kind == ProjChange::MAPS_INSERTED || h.kind == ProjChange::MAPS_REMOVED;
+        bool entsChange = h.kind == ProjChange::ENTS_INSERTED || h.kind == ProjChange::ENTS_REMOVED ||
+            h.kind == ProjChange::ENT_CHANGED;
+        switch (c.kind) {
+        case ProjChange::CHARSET_MODIFIED:
+            if (h.kind == c.kind) {
+                return true;
+            }
+            break;
+        case ProjChange::MAPS_INSERTED:
+        case ProjChange::MAPS_REMOVED:
+            // Only if it continues the most recent change.
+            return h.kind == c.kind &&
+                mergeRun(h.mapNum, h.count, c.mapNum, c.count, c.kind == ProjChange::MAPS_INSERTED);
+        case ProjChange::MAP_MODIFIED:
+            if (mapsMoved) {
+                return false;
+            }
+            if (h.kind == c.kind && h.mapNum == c.mapNum) {
+                h.dirty.Merge(c.dirty);
+                return true;
+            }
+            break;
+        case ProjChange::ENTS_INSERTED:
+        case ProjChange::ENTS_REMOVED:
+        case ProjChange::ENT_CHANGED:
+            if (mapsMoved) {
+                return false;
+            }
+            if (!entsChange || h.mapNum != c.mapNum) {
+                break;
+            }
+            // Only if it continues the most recent ent change on this map.
+            if (h.kind != c.kind) {
+                return false;
+            }
+            if (c.kind == ProjChange::ENT_CHANGED) {
+                if (h.entNum != c.entNum) {
+                    return false;
+                }
+                h.newData = c.newData;
+                return true;
+            }
+            return mergeRun(h.entNum, h.count, c.entNum, c.count, c.kind == ProjChange::ENTS_INSERTED);
+        default:
+            return false;
+        }
+    }
+    return false;
+}
+
+void Model::Dispatch(ProjChange const& c)
+{
+    if (c.kind == ProjChange::MAP_MODIFIED && damageFlushRequest) {
+        bool first = !mDamagePending;
+        mDamage[c.mapNum].Add(c.dirty);
+        mDamagePending = true;
+        if (first) {
+            damageFlushRequest();
+        }
+        return;
+    }
+    // Keep things in order.
+    FlushDamage();
+    Send(c);
+}
+
+void Model::FlushDamage()
+{
+    if (!mDamagePending || mInFlush) {
+        return;
+    }
+    // Listeners might cause more damage, which goes back into mDamage
+    // (and gets flushed later).
+    std::swap(mDamage, mFlushing);
+    mDamagePending = false;
+    mInFlush = true;
+    for (auto& [mapNum, region] : mFlushing) {
+        for (auto const& r : region.Rects()) {
+            ProjChange c{ProjChange::MAP_MODIFIED, mapNum};
+            c.dirty = r;
+            Send(c);
+        }
+        region.Clear();
+    }
+    mInFlush = false;
+}
+
+void Model::Send(ProjChange const& c)
+{
+    if (c.kind == ProjChange::MAP_MODIFIED) {
+        ++damageSent;
+    }
+    for (auto l : listeners) {
+        switch (c.kind) {
+        case ProjChange::MAP_MODIFIED:
+            l->ProjMapModified(c.mapNum, c.dirty);
+            break;
+        case ProjChange::CHARSET_MODIFIED:
+            l->ProjCharsetModified();
+            break;
+        case ProjChange::NUKE:
+            l->ProjNuke();
+            break;
+        case ProjChange::MAPS_INSERTED:
+            l->ProjMapsInserted(c.mapNum, c.count);
+            break;
+        case ProjChange::MAPS_REMOVED:
+            l->ProjMapsRemoved(c.mapNum, c.count);
+            break;
+        case ProjChange::ENTS_INSERTED:
+            l->ProjEntsInserted(c.mapNum, c.entNum, c.count);
+            break;
+        case ProjChange::ENTS_REMOVED:
+            l->ProjEntsRemoved(c.mapNum, c.entNum, c.count);
+            break;
+        case ProjChange::ENT_CHANGED:
+            l->ProjEntChanged(c.mapNum, c.entNum, c.oldData, c.newData);
+            break;
+        }
+    }
+}
+
+
+//
+// LayoutTracker
+//
+void LayoutTracker::ProjCharsetModified()
+{
+    mLayout.charset.valid = false;
+}
+
+void LayoutTracker::ProjMapModified(int mapNum, MapRect const& dirty)
+{
+    if (mapNum < (int)mLayout.maps.size()) {
+        mLayout.maps[mapNum].cells.valid = false;
+    }
+}
+
+void LayoutTracker::ProjNuke()
+{
+    mLayout.InvalidateAll();
+}
+
+void LayoutTracker::ProjMapsInserted(int mapNum, int count)
+{
+    if (mapNum <= (int)mLayout.maps.size()) {
+        mLayout.maps.insert(mLayout.maps.begin() + mapNum, count, ProjLayout::Map());
+    }
+}
+
+void LayoutTracker::ProjMapsRemoved(int mapNum, int count)
+{
+    if (mapNum + count <= (int)mLayout.maps.size()) {
+        mLayout.maps.erase(mLayout.maps.begin() + mapNum, mLayout.maps.begin() + mapNum + count);
+    }
+}
+
+void LayoutTracker::ProjEntsInserted(int mapNum, int entNum, int count)
+{
+    if (mapNum < (int)mLayout.maps.size()) {
+        mLayout.maps[mapNum].ents.valid = false;
+    }
+}
+
+void LayoutTracker::ProjEntsRemoved(int mapNum, int entNum, int count)
+{
+    if (mapNum < (int)mLayout.maps.size()) {
+        mLayout.maps[mapNum].ents.valid = false;
+    }
+}
+
+void LayoutTracker::ProjEntChanged(int mapNum, int entNum, Ent const& oldData, Ent const& newData)
+{
+    if (mapNum < (int)mLayout.maps.size()) {
+        mLayout.maps[mapNum].ents.valid = false;
+    }
+}
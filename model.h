@@ -3,10 +3,16 @@
 #include <cstdint>
 #include <string>
 #include <set>
+#include <map>
+#include <functional>
 #include "proj.h"
+#include "damage.h"
+#include "stats.h"
 #include "tool.h"
 
 class Cmd;
+class CompoundCmd;
+class Journal;
 
 // Callback interface for things that want to know about changes.
 class IModelListener
@@ -32,6 +38,50 @@ public:
 };
 
 
+// A change to the Proj, as passed on to IModelListener.
+// Held back and merged while notifications are held (see
+// Model::HoldNotifications()).
+struct ProjChange
+{
+    enum Kind {
+        MAP_MODIFIED,
+        CHARSET_MODIFIED,
+        NUKE,
+        MAPS_INSERTED,
+        MAPS_REMOVED,
+        ENTS_INSERTED,
+        ENTS_REMOVED,
+        ENT_CHANGED
+    };
+    Kind kind{MAP_MODIFIED};
+    int mapNum{0};
+    int entNum{0};
+    int count{0};
+    MapRect dirty{};    // MAP_MODIFIED
+    Ent oldData{};      // ENT_CHANGED
+    Ent newData{};      // ENT_CHANGED
+};
+
+
+// Marks the parts of a ProjLayout invalid as the Proj they describe is
+// modified (so the next save knows what to write).
+class LayoutTracker : public IModelListener
+{
+public:
+    explicit LayoutTracker(ProjLayout& layout) : mLayout(layout) {}
+    virtual void ProjCharsetModified();
+    virtual void ProjMapModified(int mapNum, MapRect const& dirty);
+    virtual void ProjNuke();
+    virtual void ProjMapsInserted(int mapNum, int count);
+    virtual void ProjMapsRemoved(int mapNum, int count);
+    virtual void ProjEntsInserted(int mapNum, int entNum, int count);
+    virtual void ProjEntsRemoved(int mapNum, int entNum, int count);
+    virtual void ProjEntChanged(int mapNum, int entNum, Ent const& oldData, Ent const& newData);
+private:
+    ProjLayout& mLayout;
+};
+
+
 // Bitflags for what to draw into cells
 #define DRAWFLAG_TILE 0x01
 #define DRAWFLAG_INK 0x02
@@ -48,12 +98,27 @@ public:
     Proj proj;
     bool modified{false};
     std::string mapFilename;
+    // Where everything is in mapFilename, for incremental saving (see
+    // AppendProj()). Kept up to date as the proj changes.
+    ProjLayout savedLayout;
     std::string tilesetFilename;
     std::set<IModelListener*> listeners;
 
 	std::vector<Cmd*> undoStack;
 	std::vector<Cmd*> redoStack;
 
+    // Memory budget for the undo/redo stacks, in bytes.
+    // The oldest undo entries are discarded to stay within it.
+    size_t undoBudget{256 * 1024 * 1024};
+    // How many of the most recent undo entries to leave uncompressed.
+    int undoUncompressed{8};
+
+    // Bumped upon every change to proj (eg so autosave can tell if anything
+    // has happened since last time).
+    uint64_t changeCount{0};
+    // How often the GUI autosaves, in seconds (0 = never).
+    int autosaveInterval{120};
+
     // Custom brush (0x0 = none)
     Tilemap brush;
 
@@ -66,8 +131,64 @@ public:
     Tool* tool{nullptr};
 
     void AddCmd(Cmd* cmd);
-    void Undo();
-    void Redo();
+    // Undo()/Redo() return false if the step couldn't be taken because
+    // it had been swapped out to the journal and couldn't be reloaded.
+    // The history from there on is lost.
+    bool Undo();
+    bool Redo();
+    // Throw away the undo/redo stacks.
+    void ClearHistory();
+    // Bring back any cmds swapped out to the journal, and forget where
+    // they were all recorded, before the journal is started afresh.
+    // Returns false if some couldn't be reloaded, in which case the
+    // history beyond them is dropped.
+    bool UnjournalHistory();
+
+    // If set, all Cmds, undos and redos are recorded to the journal, and
+    // old undo entries are dropped from memory (rather than lost) when
+    // over undoBudget.
+    Journal* journal{nullptr};
+
+    // Group all the Cmds added until the matching EndTransaction() into a
+    // single undo step. Notifications are held until the end, so listeners
+    // see one merged notification per affected map.
+    // Transactions can be nested (only the outermost one counts).
+    void BeginTransaction();
+    void EndTransaction();
+
+    // Tell listeners about changes to the Proj (for use by Cmds).
+    void NotifyMapModified(int mapNum, MapRect const& dirty);
+    void NotifyCharsetModified();
+    void NotifyNuke();
+    void NotifyMapsInserted(int mapNum, int count);
+    void NotifyMapsRemoved(int mapNum, int count);
+    void NotifyEntsInserted(int mapNum, int entNum, int count);
+    void NotifyEntsRemoved(int mapNum, int entNum, int count);
+    void NotifyEntChanged(int mapNum, int entNum, Ent const& oldData, Ent const& newData);
+
+    // Hold back notifications until the matching ReleaseNotifications(),
+    // merging them where possible. Can be nested.
+    void HoldNotifications();
+    void ReleaseNotifications();
+
+    // Map damage can be collected up and passed on to listeners in one go
+    // (eg once per GUI event loop turn), so drawing fast doesn't cause a
+    // redraw for every cell.
+    // If set, damageFlushRequest is called when damage is first collected,
+    // and should arrange for FlushDamage() to be called soon.
+    // Any other notification flushes the damage first, so listeners always
+    // see changes in order.
+    std::function<void()> damageFlushRequest;
+    void FlushDamage();
+    // Count of map damage notifications received, and sent on to listeners.
+    size_t damageReceived{0};
+    size_t damageSent{0};
+    size_t DamageCoalesced() const {return damageReceived - damageSent;}
+
+    // Stats for the most recent drawing stroke (see DrawTool).
+    StrokeStats strokeStats;
+    // Total memory used by undo/redo stacks (approx, in bytes).
+    size_t UndoCost() const;
 
     void SetTool(int toolKind);
 
@@ -81,6 +202,25 @@ public:
         assert(entNum >=0 && entNum < (int)map.ents.size());
         return map.ents[entNum];
     }
+private:
+    void TrimUndo();
+    void DropHistory(std::vector<Cmd*>& stack, size_t n);
+    void Notify(ProjChange&& change);
+    bool Merge(ProjChange const& change);
+    void Dispatch(ProjChange const& change);
+    void Send(ProjChange const& change);
+
+    CompoundCmd* mTransaction{nullptr};
+    int mTransactionDepth{0};
+    int mHoldDepth{0};
+    std::vector<ProjChange> mHeld;
+    // Damage by map. Regions are cleared after flushing rather than
+    // removed, so they can be reused without allocating.
+    std::map<int, DamageRegion> mDamage;
+    std::map<int, DamageRegion> mFlushing;  // while being sent
+    bool mDamagePending{false};
+    bool mInFlush{false};
+    LayoutTracker mLayoutTracker{savedLayout};
 };
 
 
@@ -1,7 +1,18 @@
 #include "proj.h"
+#include "compress.h"
+#include "workers.h"
 
 #include <format>
 #include <algorithm>
+#include <utility>
+#include <bit>
+#include <charconv>
+#include <climits>
+#include <cstddef>
+#include <cstring>
+#include <mutex>
+#include <unordered_map>
+#include <unordered_set>
 
 void MapRect::Merge(MapRect const& other) {
     if (IsEmpty()) {
@@ -34,263 +45,1752 @@ MapRect MapRect::Clip(MapRect const& r) const
     return MapRect(TilePoint(left,top), right - left, bottom - top);
 }
 
+MapRect MapRect::Intersect(MapRect const& r) const
+{
+    int left = std::max(x, r.x);
+    int right = std::min(x + w, r.x + r.w);
+    int top = std::max(y, r.y);
+    int bottom = std::min(y + h, r.y + r.h);
+    if (right <= left || bottom <= top) {
+        return MapRect();
+    }
+    return MapRect(TilePoint(left,top), right - left, bottom - top);
+}
+
+
+// Tilemap implementation
+
+std::shared_ptr<CellChunk> CellChunk::Uniform(Cell const& c)
+{
+    auto chunk = std::make_shared<CellChunk>();
+    std::fill(std::begin(chunk->tile), std::end(chunk->tile), c.tile);
+    std::fill(std::begin(chunk->ink), std::end(chunk->ink), c.ink);
+    std::fill(std::begin(chunk->paper), std::end(chunk->paper), c.paper);
+    chunk->uniform = true;
+    return chunk;
+}
+
+Tilemap::Tilemap(int width, int height, Cell const& fill) : w(width), h(height)
+{
+    Fill(fill);
+}
+
+Tilemap::ChunkTable& Tilemap::Chunks()
+{
+    if (!mChunks) {
+        Materialize();
+    }
+    if (mChunks.use_count() > 1) {
+        mChunks = std::make_shared<ChunkTable>(*mChunks);
+    }
+    return *mChunks;
+}
+
+CellChunk& Tilemap::Chunk(int cx, int cy)
+{
+    auto& chunk = Chunks()[(cy * ChunksW()) + cx];
+    if (chunk.use_count() > 1) {
+        // Shared, so make our own copy before anyone modifies it.
+        chunk = std::make_shared<CellChunk>(*chunk);
+    }
+    // Assume it's about to be modified.
+    chunk->uniform = false;
+    return *chunk;
+}
+
+void Tilemap::FillChunk(int cx, int cy, Cell const& c)
+{
+    Chunks()[(cy * ChunksW()) + cx] = CellChunk::Uniform(c);
+}
+
+void Tilemap::Fill(Cell const& c)
+{
+    // All chunks share the one uniform chunk.
+    mChunks = std::make_shared<ChunkTable>(ChunksW() * ChunksH(), CellChunk::Uniform(c));
+    mLazy.reset();
+}
+
+void Tilemap::Compact(MapRect const& area)
+{
+    MapRect r = Bounds().Clip(area);
+    if (r.IsEmpty()) {
+        return;
+    }
+    // Uniform chunks we've seen so far, for sharing.
+    std::vector<std::shared_ptr<CellChunk>> uniforms;
+    ChunkTable& chunks = Chunks();
+
+    for (int cy = r.y / CHUNK_SIZE; cy <= (r.y + r.h - 1) / CHUNK_SIZE; ++cy) {
+        for (int cx = r.x / CHUNK_SIZE; cx <= (r.x + r.w - 1) / CHUNK_SIZE; ++cx) {
+            auto& chunk = chunks[(cy * ChunksW()) + cx];
+            if (!chunk->uniform) {
+                // Is it uniform (within the map)?
+                MapRect r = ChunkBounds(cx, cy);
+                Cell const first = chunk->At(0, 0).Get(0);
+                bool same = true;
+                for (int y = 0; y < r.h && same; ++y) {
+                    ConstPlanesView src = std::as_const(*chunk).At(0, y);
+                    same = std::all_of(src.tile, src.tile + r.w, [&](uint16_t t) {return t == first.tile;}) &&
+                        std::all_of(src.ink, src.ink + r.w, [&](uint8_t i) {return i == first.ink;}) &&
+                        std::all_of(src.paper, src.paper + r.w, [&](uint8_t p) {return p == first.paper;});
+                }
+                if (!same) {
+                    continue;
+                }
+                // Set the unused cells too, so it can be shared by any chunk.
+                chunk = CellChunk::Uniform(first);
+            }
+
+            // Share with an existing uniform chunk?
+            Cell const c = chunk->At(0, 0).Get(0);
+            auto it = std::find_if(uniforms.begin(), uniforms.end(),
+                [&](auto const& u) {return u->At(0, 0).Get(0) == c;});
+            if (it == uniforms.end()) {
+                uniforms.push_back(chunk);
+            } else {
+                chunk = *it;
+            }
+        }
+    }
+}
+
+void Tilemap::Pack(std::vector<uint8_t>& packed)
+{
+    if (mLazy || !mChunks || IsShared()) {
+        return;
+    }
+    PackChunks(*mChunks, packed);
+}
+
+void Tilemap::Unpack(std::vector<uint8_t>& packed)
+{
+    if (packed.empty()) {
+        return;
+    }
+    UnpackChunks(*mChunks, packed);
+}
+
+size_t Tilemap::CellMemUsage() const
+{
+    if (!mChunks) {
+        return 0;
+    }
+    size_t n = (mChunks->capacity() * sizeof(ChunkTable::value_type)) / mChunks.use_count();
+    for (auto const& chunk : *mChunks) {
+        if (chunk) {
+            // Shared chunks are split between their users.
+            n += sizeof(CellChunk) / chunk.use_count();
+        }
+    }
+    return n;
+}
 
 Tilemap Tilemap::Copy(MapRect const& r) const
 {
-    Tilemap out;
-    out.w = r.w;
-    out.h = r.h;
-    out.cells.resize(r.w * r.h);
-    for (int y = 0; y < r.h; ++y) {
-        Cell* dest = out.CellPtr(TilePoint(0,y));
-        for (int x = 0; x < r.w; ++x) {
-            // Slow and naive per-tile clipping, but nice and simple :-)
-            TilePoint srcPos(r.x + x, r.y + y);
-            if (Bounds().Contains(srcPos)) {
-                *dest = CellAt(srcPos);
+    if (r == Bounds()) {
+        // Easy - share everything.
+        Tilemap out;
+        out.w = w;
+        out.h = h;
+        out.mChunks = mChunks;
+        out.mLazy = mLazy;
+        return out;
+    }
+    Tilemap out(r.w, r.h);
+    // If the chunks line up, we can share any which are entirely
+    // within this map.
+    bool aligned = (r.x % CHUNK_SIZE) == 0 && (r.y % CHUNK_SIZE) == 0;
+    for (int cy = 0; cy < out.ChunksH(); ++cy) {
+        for (int cx = 0; cx < out.ChunksW(); ++cx) {
+            MapRect destArea = out.ChunkBounds(cx, cy);
+            MapRect srcArea = destArea;
+            srcArea.Translate(r.Pos());
+            MapRect clipped = Bounds().Clip(srcArea);
+            if (clipped.IsEmpty()) {
+                continue;   // Leave it zeroed.
+            }
+            if (aligned && clipped == srcArea) {
+                out.SetSharedChunk(cx, cy, SharedChunk(srcArea.x / CHUNK_SIZE, srcArea.y / CHUNK_SIZE));
+                continue;
             }
-            ++dest;
+            // Do it the hard way.
+            CellChunk& destChunk = out.Chunk(cx, cy);
+            ForEachSpanConst(clipped, [&](TilePoint const& pos, ConstPlanesView src, int n) {
+                TilePoint destPos(pos.x - r.x, pos.y - r.y);
+                PlanesView dest = destChunk.At(destPos.x % CHUNK_SIZE, destPos.y % CHUNK_SIZE);
+                std::copy(src.tile, src.tile + n, dest.tile);
+                std::copy(src.ink, src.ink + n, dest.ink);
+                std::copy(src.paper, src.paper + n, dest.paper);
+            });
         }
     }
     return out;
 }
 
 
-static void PushU16LE(std::vector<uint8_t>& out, uint16_t v) {
-    out.push_back(v & 0xFF);
-    out.push_back(v >> 8);
+static uint32_t GetU32LE(uint8_t const* p) {
+    return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
 }
 
-static void PushU8(std::vector<uint8_t>& out, uint8_t v) {
-    out.push_back(v);
+static void WriteString(Sink& out, std::string const& s) {
+    assert(s.size() <= 255);
+    out.U8((uint8_t)s.size());
+    out.Write((uint8_t const*)s.data(), s.size());
 }
 
-static void PushString(std::vector<uint8_t>& out, std::string const& s) {
-    assert(s.size() <= 255);
-    PushU8(out, (uint8_t)s.size());
-    for (char c : s) {
-        PushU8(out, (uint8_t)c);
+// Encode n u16s as little-endian.
+static void EncodeU16LE(uint8_t* dest, uint16_t const* src, int n)
+{
+    if constexpr (std::endian::native == std::endian::little) {
+        std::memcpy(dest, src, n * sizeof(uint16_t));
+    } else {
+        for (int i = 0; i < n; ++i) {
+            dest[0] = src[i] & 0xFF;
+            dest[1] = src[i] >> 8;
+            dest += 2;
+        }
+    }
+}
+
+// Write n (no more than CHUNK_CELLS) u16s, little-endian.
+static void WriteU16sLE(Sink& out, uint16_t const* src, int n)
+{
+    EncodeU16LE(out.Space(n * 2), src, n);
+    out.Wrote(n * 2);
+}
+
+
+// Ents, as in R2 and R3:
+//   u8 number of ents
+//   per ent:
+//     u8 number of attrs
+//     per attr: u8 len, name, u8 len, value
+static void WriteEnts(std::vector<Ent> const& ents, Sink& out)
+{
+    assert(ents.size() <= 255);
+    out.U8(ents.size());
+    for( auto const& ent: ents) {
+        // Num of attrs.
+        assert(ent.attrs.size() <= 255);
+        out.U8(ent.attrs.size());
+        // Attrs.
+        for (auto const& attr : ent.attrs) {
+            WriteString(out, attr.name.str());
+            WriteString(out, attr.value);
+        }
+    }
+}
+
+// Returns pointer to the following data, or nullptr if it's bad.
+static uint8_t const* ReadEnts(std::vector<Ent>& ents, uint8_t const* p, uint8_t const* end)
+{
+    if (end - p < 1) {return nullptr;}
+    int numEnts = *p++;
+    ents.resize(numEnts);
+    for (Ent& ent : ents) {
+        if (end - p < 1) {return nullptr;}
+        int numAttrs = (int)*p++;
+        ent.attrs.resize(numAttrs);
+        for (EntAttr& attr : ent.attrs) {
+            // read name
+            {
+                if (end - p < 1) {return nullptr;}
+                int n = (int)*p++;
+                if (end - p < n) {return nullptr;}
+                attr.name = Atom(std::string_view((char const*)p, n));
+                p += n;
+            }
+            // read value
+            {
+                if (end - p < 1) {return nullptr;}
+                int n = (int)*p++;
+                if (end - p < n) {return nullptr;}
+                attr.value.assign((char const*)p, n);
+                p += n;
+            }
+        }
+    }
+    return p;
+}
+
+
+// Unsigned LEB128: 7 bits at a time, low bits first, top bit set on all but
+// the last byte.
+static void WriteVarint(Sink& out, uint64_t v)
+{
+    uint8_t* p = out.Space(10);
+    int n = 0;
+    while (v >= 0x80) {
+        p[n++] = (uint8_t)(v | 0x80);
+        v >>= 7;
+    }
+    p[n++] = (uint8_t)v;
+    out.Wrote(n);
+}
+
+// Returns pointer to the following data, or nullptr if it's bad.
+static uint8_t const* ReadVarint(uint8_t const* p, uint8_t const* end, uint64_t& v)
+{
+    v = 0;
+    for (int shift = 0; shift < 64; shift += 7) {
+        if (p >= end) {return nullptr;}
+        uint8_t b = *p++;
+        v |= (uint64_t)(b & 0x7F) << shift;
+        if (!(b & 0x80)) {
+            return p;
+        }
+    }
+    return nullptr;
+}
+
+// Is s an int, written the way we'd write it (so it'll come back the same)?
+static bool IsCanonicalInt(std::string const& s, int32_t& v)
+{
+    auto res = std::from_chars(s.data(), s.data() + s.size(), v);
+    if (res.ec != std::errc() || res.ptr != s.data() + s.size()) {
+        return false;
+    }
+    char buf[16];
+    auto back = std::to_chars(buf, buf + sizeof(buf), v);
+    return std::string_view(buf, back.ptr - buf) == s;
+}
+
+// The R6 string table, which the ents refer to by index.
+// It lives in the layout, and is only ever added to, so ents sections
+// already in the file stay valid.
+class StringTableWriter
+{
+public:
+    explicit StringTableWriter(std::vector<std::string>& strings) : mStrings(strings), mOldSize(strings.size()) {
+        for (size_t i = 0; i < strings.size(); ++i) {
+            mIndex.emplace(strings[i], (uint32_t)i);
+        }
+    }
+    uint32_t Index(std::string_view s) {
+        auto it = mIndex.find(s);
+        if (it != mIndex.end()) {
+            return it->second;
+        }
+        uint32_t i = (uint32_t)mStrings.size();
+        mStrings.emplace_back(s);
+        mIndex.emplace(s, i);
+        return i;
+    }
+    // Any strings added?
+    bool Grown() const {return mStrings.size() > mOldSize;}
+
+private:
+    struct Hash {
+        using is_transparent = void;
+        size_t operator()(std::string_view s) const {return std::hash<std::string_view>()(s);}
+    };
+    std::vector<std::string>& mStrings;
+    size_t mOldSize;
+    std::unordered_map<std::string, uint32_t, Hash, std::equal_to<>> mIndex;
+};
+
+// R6 string table:
+//   varint number of strings
+//   per string: varint len, then the bytes
+static void WriteStringsR6(std::vector<std::string> const& strings, Sink& out)
+{
+    WriteVarint(out, strings.size());
+    for (std::string const& s : strings) {
+        WriteVarint(out, s.size());
+        out.Write((uint8_t const*)s.data(), s.size());
     }
 }
 
+static bool ReadStringsR6(std::vector<std::string>& strings, uint8_t const* p, uint8_t const* end)
+{
+    uint64_t n;
+    if (!(p = ReadVarint(p, end, n)) || n > (uint64_t)(end - p)) {return false;}
+    strings.clear();
+    strings.reserve(n);
+    for (uint64_t i = 0; i < n; ++i) {
+        uint64_t len;
+        if (!(p = ReadVarint(p, end, len)) || len > (uint64_t)(end - p)) {return false;}
+        strings.emplace_back((char const*)p, len);
+        p += len;
+    }
+    return p == end;
+}
+
+// R6 ents. No limits on numbers or lengths, and the strings are in the
+// string table:
+//   varint number of ents
+//   per ent:
+//     varint number of attrs
+//     per attr: varint name index, varint value
+// The bottom bit of the value says what it is:
+//   0: the rest is a string index
+//   1: the rest is an int, zigzag-encoded (for ints written just as
+//      SetAttrInt() would write them - anything else is a string)
+static void WriteEntsR6(std::vector<Ent> const& ents, Sink& out, StringTableWriter& strings)
+{
+    WriteVarint(out, ents.size());
+    for (auto const& ent : ents) {
+        WriteVarint(out, ent.attrs.size());
+        for (auto const& attr : ent.attrs) {
+            WriteVarint(out, strings.Index(attr.name.str()));
+            int32_t v;
+            if (IsCanonicalInt(attr.value, v)) {
+                uint32_t zigzag = ((uint32_t)v << 1) ^ (uint32_t)(v >> 31);
+                WriteVarint(out, ((uint64_t)zigzag << 1) | 1);
+            } else {
+                WriteVarint(out, (uint64_t)strings.Index(attr.value) << 1);
+            }
+        }
+    }
+}
+
+// The data must be used up exactly.
+// names caches the Atoms made for the attr names (indexed as strings), so
+// each is only interned once per file.
+static bool ReadEntsR6(std::vector<Ent>& ents, uint8_t const* p, uint8_t const* end, std::vector<std::string> const& strings, std::vector<Atom>& names)
+{
+    names.resize(strings.size());
+    auto name = [&](uint64_t i, Atom& s) -> bool {
+        if (i >= strings.size()) {return false;}
+        if (names[i].empty()) {
+            names[i] = Atom(strings[i]);
+        }
+        s = names[i];
+        return true;
+    };
+    auto string = [&](uint64_t i, std::string& s) -> bool {
+        if (i >= strings.size()) {return false;}
+        s = strings[i];
+        return true;
+    };
+    uint64_t numEnts;
+    // (Every ent and attr takes a byte at least, so bad counts can't make
+    // us allocate much.)
+    if (!(p = ReadVarint(p, end, numEnts)) || numEnts > (uint64_t)(end - p)) {return false;}
+    ents.resize(numEnts);
+    for (Ent& ent : ents) {
+        uint64_t numAttrs;
+        if (!(p = ReadVarint(p, end, numAttrs)) || numAttrs > (uint64_t)(end - p)) {return false;}
+        ent.attrs.resize(numAttrs);
+        for (EntAttr& attr : ent.attrs) {
+            uint64_t nameIndex, value;
+            if (!(p = ReadVarint(p, end, nameIndex)) || !name(nameIndex, attr.name)) {return false;}
+            if (!(p = ReadVarint(p, end, value))) {return false;}
+            if (value & 1) {
+                uint64_t zigzag = value >> 1;
+                if (zigzag > UINT32_MAX) {return false;}
+                int32_t v = (int32_t)((uint32_t)zigzag >> 1) ^ -(int32_t)(zigzag & 1);
+                char buf[16];
+                auto res = std::to_chars(buf, buf + sizeof(buf), v);
+                attr.value.assign(buf, res.ptr - buf);
+            } else if (!string(value >> 1, attr.value)) {
+                return false;
+            }
+        }
+    }
+    return p == end;
+}
+
+
+// Cells as in R1 and R2, row-major: u16 tile, u8 ink, u8 paper.
+static void WriteCellsR1(Tilemap const& map, Sink& out)
+{
+    map.ForEachSpanConst(map.Bounds(), [&](TilePoint const& pos, ConstPlanesView cells, int n) {
+        uint8_t* p = out.Space(n * 4);
+        for (int i = 0; i < n; ++i) {
+            p[0] = cells.tile[i] & 0xFF;
+            p[1] = cells.tile[i] >> 8;
+            p[2] = cells.ink[i];
+            p[3] = cells.paper[i];
+            p += 4;
+        }
+        out.Wrote(n * 4);
+    });
+}
 
 // We'll just keep adding new write functions as the data changes, then
 // ditch a bunch at some point and call it v1 :-)
-void WriteProjR1(Proj const& proj, std::vector<uint8_t>& out)
+void WriteProjR1(Proj const& proj, Sink& out)
 {
     // Magic cookie/version
-    out.push_back('r');
-    out.push_back('1');
+    out.U8('r');
+    out.U8('1');
 
     // Write out maps.
-    PushU16LE(out, (uint16_t)proj.maps.size());
+    out.U16LE((uint16_t)proj.maps.size());
     for (auto& map : proj.maps) {
-        PushU16LE(out, (uint16_t)map.w);
-        PushU16LE(out, (uint16_t)map.h);
-        for(auto& cell : map.cells) {
-            PushU16LE(out, cell.tile);
-            out.push_back(cell.ink);
-            out.push_back(cell.paper);
-        }
+        out.U16LE((uint16_t)map.w);
+        out.U16LE((uint16_t)map.h);
+        WriteCellsR1(map, out);
     }
 
     // Write charset
     Charset const& tiles = proj.charset;
     {
-        out.push_back((uint8_t)tiles.tw);
-        out.push_back((uint8_t)tiles.th);
-        PushU16LE(out, (uint16_t)tiles.ntiles);
-        out.insert(out.end(), tiles.images.begin(), tiles.images.end());
+        out.U8((uint8_t)tiles.tw);
+        out.U8((uint8_t)tiles.th);
+        out.U16LE((uint16_t)tiles.ntiles);
+        out.Write(tiles.Images().data(), tiles.Images().size());
     }
 
     // Write palette
     Palette const& palette = proj.palette;
     {
-        PushU16LE(out, (uint16_t)palette.ncolours);
-        out.insert(out.end(), palette.colours.begin(), palette.colours.end());
+        out.U16LE((uint16_t)palette.ncolours);
+        out.Write(palette.colours.data(), palette.colours.size());
     }
 }
 
 
 // Same as R1 but with ents.
-void WriteProjR2(Proj const& proj, std::vector<uint8_t>& out)
+void WriteProjR2(Proj const& proj, Sink& out)
 {
     // Magic cookie/version
-    out.push_back('r');
-    out.push_back('2');
+    out.U8('r');
+    out.U8('2');
 
     // Reserve a count for (optional) ent templates.
-    PushU16LE(out, 0);
+    out.U16LE(0);
 
     // Write out maps.
-    PushU16LE(out, (uint16_t)proj.maps.size());
+    out.U16LE((uint16_t)proj.maps.size());
     for (auto& map : proj.maps) {
-        PushU16LE(out, (uint16_t)map.w);
-        PushU16LE(out, (uint16_t)map.h);
-        for(auto& cell : map.cells) {
-            PushU16LE(out, cell.tile);
-            out.push_back(cell.ink);
-            out.push_back(cell.paper);
-        }
-
-        // Write number of ents.
-        assert(map.ents.size() <= 255);
-        PushU8(out, map.ents.size());
-        for( auto const& ent: map.ents) {
-            // Num of attrs.
-            assert(ent.attrs.size() <= 255);
-            PushU8(out, ent.attrs.size());
-            // Attrs.
-            for (auto const& attr : ent.attrs) {
-                PushString(out, attr.name);
-                PushString(out, attr.value);
-            }
-        }
+        out.U16LE((uint16_t)map.w);
+        out.U16LE((uint16_t)map.h);
+        WriteCellsR1(map, out);
+        WriteEnts(map.ents, out);
     }
 
     // Write charset
     Charset const& tiles = proj.charset;
     {
-        out.push_back((uint8_t)tiles.tw);
-        out.push_back((uint8_t)tiles.th);
-        PushU16LE(out, (uint16_t)tiles.ntiles);
-        out.insert(out.end(), tiles.images.begin(), tiles.images.end());
+        out.U8((uint8_t)tiles.tw);
+        out.U8((uint8_t)tiles.th);
+        out.U16LE((uint16_t)tiles.ntiles);
+        out.Write(tiles.Images().data(), tiles.Images().size());
     }
 
     // Write palette
     Palette const& palette = proj.palette;
     {
-        PushU16LE(out, (uint16_t)palette.ncolours);
-        out.insert(out.end(), palette.colours.begin(), palette.colours.end());
+        out.U16LE((uint16_t)palette.ncolours);
+        out.Write(palette.colours.data(), palette.colours.size());
+    }
+}
+
+// R3 cells, for each chunk in turn (row-major):
+//   u8 kind
+//   R3_CHUNK_UNIFORM: u16 tile, u8 ink, u8 paper
+//   R3_CHUNK_PLANES: the chunk's cells within the map (row-major), as
+//     planes: u16 tile[n], u8 ink[n], u8 paper[n]
+//   R3_CHUNK_RLE: as R3_CHUNK_PLANES, but each plane RLEEncode()ed
+//     (R4 onward).
+//   R7_CHUNK_REF: varint index into the file's chunk store (R7 onward).
+enum {R3_CHUNK_PLANES = 0, R3_CHUNK_UNIFORM = 1, R3_CHUNK_RLE = 2, R7_CHUNK_REF = 3};
+
+// If rle is set, chunks are written as R3_CHUNK_RLE.
+// If refs is set, it holds a chunk store index (or -1) for each chunk of the
+// map (row-major), and those chunks are written as R7_CHUNK_REF.
+static void WriteCellsR3(Tilemap const& map, Sink& out, bool rle, std::vector<int> const* refs = nullptr)
+{
+    std::vector<uint8_t> packed;    // For RLE.
+    for (int cy = 0; cy < map.ChunksH(); ++cy) {
+        for (int cx = 0; cx < map.ChunksW(); ++cx) {
+            CellChunk const& chunk = map.ChunkConst(cx, cy);
+            MapRect r = map.ChunkBounds(cx, cy);
+            if (chunk.uniform) {
+                out.U8(R3_CHUNK_UNIFORM);
+                out.U16LE(chunk.tile[0]);
+                out.U8(chunk.ink[0]);
+                out.U8(chunk.paper[0]);
+                continue;
+            }
+            int ref = refs ? (*refs)[(cy * map.ChunksW()) + cx] : -1;
+            if (ref >= 0) {
+                out.U8(R7_CHUNK_REF);
+                WriteVarint(out, (uint64_t)ref);
+                continue;
+            }
+            // If the chunk is full width, its rows are contiguous and each
+            // plane can be copied in one go.
+            int rows = (r.w == CHUNK_SIZE) ? 1 : r.h;
+            int len = (r.w * r.h) / rows;
+            if (rle) {
+                // Gather up the planes (little-endian tiles) first.
+                uint8_t tile[CHUNK_CELLS * 2];
+                uint8_t ink[CHUNK_CELLS];
+                uint8_t paper[CHUNK_CELLS];
+                for (int y = 0; y < rows; ++y) {
+                    ConstPlanesView src = chunk.At(0, y);
+                    EncodeU16LE(tile + (y * len * 2), src.tile, len);
+                    std::memcpy(ink + (y * len), src.ink, len);
+                    std::memcpy(paper + (y * len), src.paper, len);
+                }
+                int n = r.w * r.h;
+                packed.clear();
+                RLEEncode(tile, n, 2, packed);
+                RLEEncode(ink, n, 1, packed);
+                RLEEncode(paper, n, 1, packed);
+                out.U8(R3_CHUNK_RLE);
+                out.Write(packed.data(), packed.size());
+                continue;
+            }
+            out.U8(R3_CHUNK_PLANES);
+            for (int y = 0; y < rows; ++y) {
+                WriteU16sLE(out, chunk.At(0, y).tile, len);
+            }
+            for (int y = 0; y < rows; ++y) {
+                out.Write(chunk.At(0, y).ink, len);
+            }
+            for (int y = 0; y < rows; ++y) {
+                out.Write(chunk.At(0, y).paper, len);
+            }
+        }
+    }
+}
+
+// Decode n little-endian u16s.
+static void DecodeU16LE(uint16_t* dest, uint8_t const* src, int n)
+{
+    if constexpr (std::endian::native == std::endian::little) {
+        std::memcpy(dest, src, n * sizeof(uint16_t));
+    } else {
+        for (int i = 0; i < n; ++i) {
+            dest[i] = (src[1] << 8) + src[0];
+            src += 2;
+        }
     }
 }
 
-void WriteProj(Proj const& proj, std::vector<uint8_t>& out)
+// Fill in the cells of map (which should be freshly created).
+// Chunks referred to in store are shared, rather than copied.
+// The data must be used up exactly.
+static bool ReadCellsR3(Tilemap& map, uint8_t const* p, uint8_t const* end, ChunkStore const* store)
 {
-    WriteProjR2(proj, out);
+    // Uniform chunks seen so far, for sharing.
+    std::vector<std::shared_ptr<CellChunk>> uniforms;
+    for (int cy = 0; cy < map.ChunksH(); ++cy) {
+        for (int cx = 0; cx < map.ChunksW(); ++cx) {
+            if (end - p < 1) {return false;}
+            uint8_t kind = *p++;
+            if (kind == R7_CHUNK_REF) {
+                uint64_t i;
+                if (!store || !(p = ReadVarint(p, end, i)) || i >= store->size()) {return false;}
+                map.SetSharedChunk(cx, cy, (*store)[i]);
+                continue;
+            }
+            if (kind == R3_CHUNK_UNIFORM) {
+                if (end - p < 4) {return false;}
+                Cell c{(uint16_t)((p[1] << 8) + p[0]), p[2], p[3]};
+                p += 4;
+                auto it = std::find_if(uniforms.begin(), uniforms.end(),
+                    [&](auto const& u) {return u->At(0, 0).Get(0) == c;});
+                if (it == uniforms.end()) {
+                    uniforms.push_back(CellChunk::Uniform(c));
+                    it = uniforms.end() - 1;
+                }
+                map.SetSharedChunk(cx, cy, *it);
+                continue;
+            }
+            MapRect r = map.ChunkBounds(cx, cy);
+            int n = r.w * r.h;
+            if (kind == R3_CHUNK_RLE) {
+                uint8_t tile[CHUNK_CELLS * 2];
+                uint8_t ink[CHUNK_CELLS];
+                uint8_t paper[CHUNK_CELLS];
+                p = RLEDecode(p, end, 2, tile, n);
+                if (p) {p = RLEDecode(p, end, 1, ink, n);}
+                if (p) {p = RLEDecode(p, end, 1, paper, n);}
+                if (!p) {return false;}
+                auto chunk = std::make_shared<CellChunk>();
+                for (int y = 0; y < r.h; ++y) {
+                    PlanesView dest = chunk->At(0, y);
+                    DecodeU16LE(dest.tile, tile + (y * r.w * 2), r.w);
+                    std::memcpy(dest.ink, ink + (y * r.w), r.w);
+                    std::memcpy(dest.paper, paper + (y * r.w), r.w);
+                }
+                map.SetSharedChunk(cx, cy, chunk);
+                continue;
+            }
+            if (kind != R3_CHUNK_PLANES) {return false;}
+            if (end - p < n * 4) {return false;}
+            auto chunk = std::make_shared<CellChunk>();
+            if (r.w == CHUNK_SIZE) {
+                // Full-width chunk - the planes are laid out just as in
+                // memory, so each is a single block copy.
+                DecodeU16LE(chunk->tile, p, n);
+                p += n * 2;
+                std::memcpy(chunk->ink, p, n);
+                p += n;
+                std::memcpy(chunk->paper, p, n);
+                p += n;
+            } else {
+                for (int y = 0; y < r.h; ++y) {
+                    DecodeU16LE(chunk->At(0, y).tile, p, r.w);
+                    p += r.w * 2;
+                }
+                for (int y = 0; y < r.h; ++y) {
+                    std::memcpy(chunk->At(0, y).ink, p, r.w);
+                    p += r.w;
+                }
+                for (int y = 0; y < r.h; ++y) {
+                    std::memcpy(chunk->At(0, y).paper, p, r.w);
+                    p += r.w;
+                }
+            }
+            map.SetSharedChunk(cx, cy, chunk);
+        }
+    }
+    return p == end;
 }
 
+// From R4 on, map cells and charset images are wrapped up in blocks, which
+// can be compressed:
+//   u8 R4_BLOCK_RAW, then the data.
+//   u8 R4_BLOCK_LZ, u32 unpacked size, then the data LZEncode()ed.
+enum {R4_BLOCK_RAW = 0, R4_BLOCK_LZ = 1};
 
+static void WriteBlock(uint8_t const* src, size_t n, bool compress, std::vector<uint8_t>& out)
+{
+    if (compress) {
+        assert(n <= UINT32_MAX);
+        size_t begin = out.size();
+        out.push_back(R4_BLOCK_LZ);
+        for (int i = 0; i < 4; ++i) {
+            out.push_back(((uint32_t)n >> (i * 8)) & 0xFF);
+        }
+        LZEncode(src, n, out);
+        if (out.size() - begin <= n) {
+            return;
+        }
+        out.resize(begin);  // Didn't help.
+    }
+    out.push_back(R4_BLOCK_RAW);
+    out.insert(out.end(), src, src + n);
+}
 
-bool ReadProj(Proj& proj, uint8_t const* p, uint8_t const* end)
+// Unwrap the block in p..end. On return, p..end holds the contents - either
+// still in place, or decoded into buf.
+static bool ReadBlock(uint8_t const*& p, uint8_t const*& end, std::vector<uint8_t>& buf)
 {
-    // Check magic cookie.
-    if((end - p) < 2) { return false; }
-    if (p[0] != 'r') {
+    if (end - p < 1) {return false;}
+    uint8_t kind = *p++;
+    if (kind == R4_BLOCK_RAW) {
+        return true;
+    }
+    if (kind != R4_BLOCK_LZ || end - p < 4) {return false;}
+    uint32_t n = GetU32LE(p);
+    p += 4;
+    // An LZ sequence can't expand by more than 255x or so, so a bigger
+    // size must be garbage (and we don't want to allocate it).
+    if (n / 256 > (size_t)(end - p)) {return false;}
+    buf.resize(n);
+    if (!LZDecode(p, end, buf.data(), n)) {return false;}
+    p = buf.data();
+    end = p + n;
+    return true;
+}
+
+// Cells in the file: a block (R4) or bare (R3).
+static bool ReadCells(Tilemap& map, uint8_t const* p, uint8_t const* end, bool block, ChunkStore const* store)
+{
+    std::vector<uint8_t> buf;
+    if (block && !ReadBlock(p, end, buf)) {
         return false;
     }
-    char version;
-    switch (p[1]) {
-        case '1': version = 1; break;
-        case '2': version = 2; break;
-        default: return false;
+    return ReadCellsR3(map, p, end, store);
+}
+
+Tilemap Tilemap::FromFile(int width, int height, std::shared_ptr<LazyCells const> cells)
+{
+    Tilemap map;
+    map.w = width;
+    map.h = height;
+    map.mLazy = cells;
+    return map;
+}
+
+bool Tilemap::Materialize(ReadError* err) const
+{
+    if (mLazy && !mChunks) {
+        Tilemap tmp(w, h);
+        uint8_t const* p = mLazy->data->Data() + mLazy->offset;
+        if (ReadCells(tmp, p, p + mLazy->size, mLazy->block, mLazy->store.get())) {
+            mChunks = tmp.mChunks;
+            mLazy.reset();
+            return true;
+        }
+        // Keep hold of mLazy, so the cells can still be saved as they were.
+        tmp.Fill(Cell());
+        mChunks = tmp.mChunks;
     }
-    p += 2;
+    if (IsBad()) {
+        if (err) {
+            err->offset = mLazy->offset;
+            err->reason = "bad map cells";
+        }
+        return false;
+    }
+    return true;
+}
+
+
+// R3 starts with a table of contents, so maps can be loaded only when
+// they're needed.
+// Offsets are from the start of the file.
+//   "r3"
+//   u32 number of maps
+//   u32 charset offset, u32 charset size
+//   u32 palette offset, u32 palette size
+//   per map:
+//     u16 w, u16 h
+//     u32 cells offset, u32 cells size
+//     u32 ents offset, u32 ents size
+// Then the sections:
+//   maps: cells (see WriteCellsR3()), ents (see WriteEnts())
+//   charset: u8 tw, u8 th, u16 ntiles, images
+//   palette: u16 ncolours, colours
+//
+// R4 is the same ("r4"), except that the cells and the charset images are
+// blocks (see WriteBlock()).
+//
+// R5 is R4 with the table of contents moved to the end, so saving can just
+// append whatever has changed, followed by a new TOC (see AppendProj()):
+//   "r5"
+//   u32 toc offset, u32 toc size
+//   (the sections, in any order, possibly with dead ones between)
+//   toc: as R3 from the number of maps onward.
+//
+// R6 is R5 ("r6") with the ents written more compactly (see WriteEntsR6()),
+// using a string table shared by the whole project. The TOC has the string
+// table's u32 offset, u32 size after the palette's.
+//
+// R7 is R6 ("r7") plus a chunk store: chunks which turn up more than once
+// in the project, which the cells can refer to (R7_CHUNK_REF) instead of
+// holding their own copy. The TOC has the store's u32 offset, u32 size
+// after the string table's. The store is a block holding:
+//   u32 number of chunks
+//   the chunks, as the cells of a CHUNK_SIZE x (number * CHUNK_SIZE) map
+static constexpr size_t R3_TOC_SIZE = 4 + 16;
+static constexpr size_t R6_TOC_SIZE = 4 + 24;
+static constexpr size_t R7_TOC_SIZE = 4 + 32;
+static constexpr size_t R3_MAP_ENTRY_SIZE = 2 + 2 + 16;
+
+// The planes of a CellChunk, which are hashed and compared as one block.
+static constexpr size_t CHUNK_PLANES_SIZE = sizeof(CellChunk::tile) + sizeof(CellChunk::ink) + sizeof(CellChunk::paper);
+static_assert(offsetof(CellChunk, paper) + sizeof(CellChunk::paper) == CHUNK_PLANES_SIZE);
+
+// Finds chunks by their content, to build and use the R7 chunk store.
+// Chunks are compared by their cells within the map, with the cells outside
+// it (on the right and bottom edges) taken as zero. So an edge chunk can
+// share any stored chunk with the same cells, and stored chunks never hold
+// junk from outside a map.
+class ChunkIndex
+{
+public:
+    // Start with the chunks in store (which keep their indices).
+    explicit ChunkIndex(ChunkStore const& store) : mStore(store) {
+        for (size_t i = 0; i < store.size(); ++i) {
+            CellChunk const* c = store[i].get();
+            mIds.emplace(Key{c, Hash(*c)}, Entry{(int)i, store[i]});
+        }
+    }
+
+    // Count a chunk of map. The second time the same cells turn up,
+    // they're added to the store.
+    // Returns where the chunk's store index (or -1) is kept. It stays valid
+    // (and picks up the chunk being stored later on) for the life of the
+    // index.
+    int const* Count(Tilemap const& map, int cx, int cy) {
+        CellChunk scratch;
+        CellChunk const& c = Normalized(map, cx, cy, scratch);
+        auto it = mIds.find(Key{&c, Hash(c)});
+        if (it == mIds.end()) {
+            // Keep our own copy of edge chunks, as they've been changed.
+            auto chunk = (&c == &scratch) ? std::make_shared<CellChunk>(scratch) : map.SharedChunk(cx, cy);
+            it = mIds.emplace(Key{chunk.get(), Hash(*chunk)}, Entry{-1, chunk}).first;
+        } else if (it->second.id < 0) {
+            it->second.id = (int)mStore.size();
+            mStore.push_back(it->second.chunk);
+        }
+        return &it->second.id;
+    }
+
+    // The store index of a chunk of map, or -1 if it's not stored.
+    // Safe to call from several threads at once (as long as nothing is
+    // being Count()ed).
+    int Find(Tilemap const& map, int cx, int cy) const {
+        CellChunk scratch;
+        CellChunk const& c = Normalized(map, cx, cy, scratch);
+        auto it = mIds.find(Key{&c, Hash(c)});
+        return (it == mIds.end()) ? -1 : it->second.id;
+    }
+
+    ChunkStore const& Store() const {return mStore;}
+
+private:
+    struct Key {
+        CellChunk const* chunk;
+        size_t hash;
+    };
+    struct KeyHash {
+        size_t operator()(Key const& k) const {return k.hash;}
+    };
+    struct KeyEqual {
+        bool operator()(Key const& a, Key const& b) const {
+            return a.hash == b.hash && std::memcmp(a.chunk->tile, b.chunk->tile, CHUNK_PLANES_SIZE) == 0;
+        }
+    };
+    struct Entry {
+        int id;     // -1 if only seen once so far.
+        std::shared_ptr<CellChunk> chunk;
+    };
+
+    static size_t Hash(CellChunk const& c) {
+        return std::hash<std::string_view>()(std::string_view((char const*)c.tile, CHUNK_PLANES_SIZE));
+    }
+
+    // The chunk at cx,cy with anything outside the map zeroed. Returns the
+    // chunk itself if it's all within the map, otherwise fills in scratch.
+    static CellChunk const& Normalized(Tilemap const& map, int cx, int cy, CellChunk& scratch) {
+        CellChunk const& chunk = map.ChunkConst(cx, cy);
+        MapRect r = map.ChunkBounds(cx, cy);
+        if (r.w == CHUNK_SIZE && r.h == CHUNK_SIZE) {
+            return chunk;
+        }
+        scratch = CellChunk();
+        for (int y = 0; y < r.h; ++y) {
+            ConstPlanesView src = chunk.At(0, y);
+            PlanesView dest = scratch.At(0, y);
+            std::copy(src.tile, src.tile + r.w, dest.tile);
+            std::memcpy(dest.ink, src.ink, r.w);
+            std::memcpy(dest.paper, src.paper, r.w);
+        }
+        return scratch;
+    }
+
+    std::unordered_map<Key, Entry, KeyHash, KeyEqual> mIds;
+    ChunkStore mStore;
+};
+
+// Can cells which refer to sub be written out as they are, alongside store?
+// (ie is sub the start of store?)
+static bool StoreExtends(ChunkStore const& store, ChunkStore const& sub)
+{
+    return sub.size() <= store.size() && std::equal(sub.begin(), sub.end(), store.begin());
+}
+
+static void WriteChunkStore(ChunkStore const& store, bool compress, Sink& out)
+{
+    Tilemap chunks(CHUNK_SIZE, (int)store.size() * CHUNK_SIZE);
+    for (size_t i = 0; i < store.size(); ++i) {
+        chunks.SetSharedChunk(0, (int)i, store[i]);
+    }
+    std::vector<uint8_t> tmp;
+    {
+        MemSink sink(tmp);
+        sink.U32LE((uint32_t)store.size());
+        WriteCellsR3(chunks, sink, compress);
+    }
+    std::vector<uint8_t> block;
+    WriteBlock(tmp.data(), tmp.size(), compress, block);
+    out.Write(block.data(), block.size());
+}
+
+static bool ReadChunkStore(ChunkStore& store, uint8_t const* p, uint8_t const* end)
+{
+    std::vector<uint8_t> buf;
+    if (!ReadBlock(p, end, buf) || end - p < 4) {return false;}
+    uint32_t n = GetU32LE(p);
+    p += 4;
+    // Every chunk takes at least 4 bytes (the kind, then one per plane).
+    if (n > (size_t)(end - p) / 4 || n > INT_MAX / CHUNK_SIZE) {return false;}
+    Tilemap chunks(CHUNK_SIZE, (int)n * CHUNK_SIZE);
+    if (!ReadCellsR3(chunks, p, end, nullptr)) {return false;}
+    store.clear();
+    store.reserve(n);
+    for (uint32_t i = 0; i < n; ++i) {
+        store.push_back(chunks.SharedChunk(0, (int)i));
+    }
+    return true;
+}
+
+// Write the sections of proj which aren't valid in layout, updating layout
+// as we go. The data goes at file offset base.
+// The compressed blocks are encoded in parallel, a batch at a time, so only
+// a few maps' worth are held in memory at once. Uncompressed ones go
+// straight out.
+// A full save (layout is fresh) builds a new chunk store from every loaded
+// map first. An append just uses the one already in the file.
+static bool WriteSectionsR7(Proj const& proj, ProjLayout& layout, bool compress, Sink& out, size_t base)
+{
+    size_t start = out.Pos();
+    auto section = [&](FileSection& sect, size_t begin) {
+        assert(base + (out.Pos() - start) <= UINT32_MAX);
+        sect.offset = (uint32_t)(base + (begin - start));
+        sect.size = (uint32_t)(out.Pos() - begin);
+        sect.valid = true;
+    };
+
+    size_t nmaps = proj.maps.size();
+    layout.maps.resize(nmaps);
+    bool full = !layout.toc.valid;
+
+    // Unloaded maps can be copied straight from their file if their chunk
+    // store ends up at the start of ours. A full save starts its store
+    // off with the first one it finds, so they usually can.
+    std::shared_ptr<ChunkStore const> seed = layout.chunkStore;
+    if (full) {
+        seed = nullptr;
+        for (auto const& map : proj.maps) {
+            if (!map.IsLoaded() && map.Unloaded()->store) {
+                seed = map.Unloaded()->store;
+                break;
+            }
+        }
+    }
+    ChunkIndex index(seed ? *seed : ChunkStore());
+    std::unordered_map<ChunkStore const*, bool> copyable;
+    auto canCopy = [&](Tilemap const& map) -> bool {
+        ChunkStore const* store = map.Unloaded()->store.get();
+        if (!store) {
+            return true;
+        }
+        auto it = copyable.find(store);
+        if (it == copyable.end()) {
+            it = copyable.emplace(store, StoreExtends(index.Store(), *store)).first;
+        }
+        return it->second;
+    };
+    // Maps which need decoding to write out (only the ones from another
+    // file's chunk store - eg imported).
+    std::vector<Tilemap> decoded(nmaps);
+    std::vector<char> isDecoded(nmaps);
+    auto source = [&](size_t i) -> Tilemap const& {
+        return isDecoded[i] ? decoded[i] : proj.maps[i];
+    };
+    for (size_t i = 0; i < nmaps; ++i) {
+        Tilemap const& map = proj.maps[i];
+        if (!map.IsLoaded() && !layout.maps[i].cells.valid && !canCopy(map)) {
+            decoded[i] = map;
+            if (!decoded[i].Materialize()) {
+                // Can't write its cells as they were, and blank cells
+                // would lose them.
+                return false;
+            }
+            isDecoded[i] = 1;
+        }
+    }
+    // Count up the chunks, and note where to find each one's store index.
+    std::vector<std::vector<int const*>> ids(nmaps);
+    if (full) {
+        for (size_t i = 0; i < nmaps; ++i) {
+            Tilemap const& map = source(i);
+            if (!map.IsLoaded()) {
+                continue;
+            }
+            ids[i].resize((size_t)map.ChunksW() * map.ChunksH());
+            for (int cy = 0; cy < map.ChunksH(); ++cy) {
+                for (int cx = 0; cx < map.ChunksW(); ++cx) {
+                    if (!map.ChunkConst(cx, cy).uniform) {
+                        ids[i][(cy * map.ChunksW()) + cx] = index.Count(map, cx, cy);
+                    }
+                }
+            }
+        }
+        layout.chunkStore = std::make_shared<ChunkStore const>(index.Store());
+        layout.chunks.valid = false;
+    }
+    // The store index for each chunk of a map.
+    auto refs = [&](size_t i, Tilemap const& map) {
+        std::vector<int> out((size_t)map.ChunksW() * map.ChunksH(), -1);
+        for (int cy = 0; cy < map.ChunksH(); ++cy) {
+            for (int cx = 0; cx < map.ChunksW(); ++cx) {
+                size_t k = (cy * map.ChunksW()) + cx;
+                if (full) {
+                    out[k] = ids[i][k] ? *ids[i][k] : -1;
+                } else if (!map.ChunkConst(cx, cy).uniform) {
+                    out[k] = index.Find(map, cx, cy);
+                }
+            }
+        }
+        return out;
+    };
+
+    StringTableWriter strings(layout.stringTable);
+    size_t batch = (size_t)NumWorkers() * 2;
+    std::vector<std::vector<uint8_t>> blocks(batch);
+    std::vector<uint8_t> images;
+    for (size_t first = 0; first == 0 || first < nmaps; first += batch) {
+        size_t count = std::min(batch, nmaps - first);
+        if (compress) {
+            // The charset goes in with the first batch.
+            int extra = (first == 0) ? 1 : 0;
+            ParallelFor((int)count + extra, [&](int j) {
+                if (j == (int)count) {
+                    if (!layout.charset.valid) {
+                        SharedBytes const& src = proj.charset.Images();
+                        WriteBlock(src.data(), src.size(), true, images);
+                    }
+                    return;
+                }
+                Tilemap const& map = source(first + j);
+                blocks[j].clear();
+                if (map.IsLoaded() && !layout.maps[first + j].cells.valid) {
+                    std::vector<int> mapRefs = refs(first + j, map);
+                    std::vector<uint8_t> tmp;
+                    {
+                        MemSink sink(tmp);
+                        WriteCellsR3(map, sink, true, &mapRefs);
+                    }
+                    WriteBlock(tmp.data(), tmp.size(), true, blocks[j]);
+                }
+            });
+        }
+
+        for (size_t j = 0; j < count; ++j) {
+            Tilemap const& map = source(first + j);
+            ProjLayout::Map& entry = layout.maps[first + j];
+            if (!entry.cells.valid) {
+                size_t begin = out.Pos();
+                if (!map.IsLoaded()) {
+                    // Still just as it was in the file.
+                    LazyCells const& lazy = *map.Unloaded();
+                    if (!lazy.block) {
+                        out.U8(R4_BLOCK_RAW);
+                    }
+                    out.Write(lazy.data->Data() + lazy.offset, lazy.size);
+                } else if (compress) {
+                    out.Write(blocks[j].data(), blocks[j].size());
+                } else {
+                    std::vector<int> mapRefs = refs(first + j, map);
+                    out.U8(R4_BLOCK_RAW);
+                    WriteCellsR3(map, out, false, &mapRefs);
+                }
+                section(entry.cells, begin);
+            }
+            if (!entry.ents.valid) {
+                size_t begin = out.Pos();
+                WriteEntsR6(map.ents, out, strings);
+                section(entry.ents, begin);
+            }
+        }
+        // Done with them.
+        for (size_t j = 0; j < count; ++j) {
+            decoded[first + j] = Tilemap();
+            isDecoded[first + j] = 0;
+        }
+    }
+
+    if (!layout.chunks.valid) {
+        size_t begin = out.Pos();
+        WriteChunkStore(layout.chunkStore ? *layout.chunkStore : ChunkStore(), compress, out);
+        section(layout.chunks, begin);
+    }
+
+    if (!layout.charset.valid) {
+        size_t begin = out.Pos();
+        Charset const& tiles = proj.charset;
+        out.U8((uint8_t)tiles.tw);
+        out.U8((uint8_t)tiles.th);
+        out.U16LE((uint16_t)tiles.ntiles);
+        if (compress) {
+            out.Write(images.data(), images.size());
+        } else {
+            out.U8(R4_BLOCK_RAW);
+            out.Write(tiles.Images().data(), tiles.Images().size());
+        }
+        section(layout.charset, begin);
+    }
+
+    if (!layout.palette.valid) {
+        size_t begin = out.Pos();
+        Palette const& palette = proj.palette;
+        out.U16LE((uint16_t)palette.ncolours);
+        out.Write(palette.colours.data(), palette.colours.size());
+        section(layout.palette, begin);
+    }
+
+    // Last, as the ents add to it.
+    if (!layout.strings.valid || strings.Grown()) {
+        size_t begin = out.Pos();
+        WriteStringsR6(layout.stringTable, out);
+        section(layout.strings, begin);
+    }
+    return true;
+}
+
+// FNV-1a, for ProjLayout::tocChecksum.
+static uint32_t Checksum(uint8_t const* p, size_t n, uint32_t h = 2166136261u)
+{
+    for (size_t i = 0; i < n; ++i) {
+        h = (h ^ p[i]) * 16777619u;
+    }
+    return h;
+}
+
+// Write the TOC for layout (which must be all valid) at file offset base,
+// and fill in the header to point at it.
+static void WriteTOCR7(Proj const& proj, ProjLayout& layout, Sink& out, size_t base, uint8_t* header)
+{
+    size_t begin = out.Pos();
+    uint32_t sum = Checksum(nullptr, 0);
+    auto u16 = [&](uint16_t v) {
+        uint8_t b[2] = {(uint8_t)(v & 0xFF), (uint8_t)(v >> 8)};
+        out.Write(b, 2);
+        sum = Checksum(b, 2, sum);
+    };
+    auto u32 = [&](uint32_t v) {
+        uint8_t b[4];
+        for (int i = 0; i < 4; ++i) {
+            b[i] = (v >> (i * 8)) & 0xFF;
+        }
+        out.Write(b, 4);
+        sum = Checksum(b, 4, sum);
+    };
+    auto write = [&](FileSection const& sect) {
+        assert(sect.valid);
+        u32(sect.offset);
+        u32(sect.size);
+    };
+    u32((uint32_t)proj.maps.size());
+    write(layout.charset);
+    write(layout.palette);
+    write(layout.strings);
+    write(layout.chunks);
+    for (size_t i = 0; i < proj.maps.size(); ++i) {
+        Tilemap const& map = proj.maps[i];
+        u16((uint16_t)map.w);
+        u16((uint16_t)map.h);
+        write(layout.maps[i].cells);
+        write(layout.maps[i].ents);
+    }
+    size_t size = out.Pos() - begin;
+    assert(base + size <= UINT32_MAX);
+    layout.toc.offset = (uint32_t)base;
+    layout.toc.size = (uint32_t)size;
+    layout.toc.valid = true;
+    layout.fileSize = (uint32_t)(base + size);
+    layout.tocChecksum = sum;
+    ProjHeader(layout, header);
+}
+
+void ProjHeader(ProjLayout const& layout, uint8_t* header)
+{
+    header[0] = 'r';
+    header[1] = '7';
+    for (int i = 0; i < 4; ++i) {
+        header[2 + i] = (layout.toc.offset >> (i * 8)) & 0xFF;
+        header[6 + i] = (layout.toc.size >> (i * 8)) & 0xFF;
+    }
+}
+
+static bool WriteProjR7(Proj const& proj, Sink& out, bool compress, ProjLayout* layout)
+{
+    ProjLayout tmp;
+    ProjLayout& l = layout ? *layout : tmp;
+    l = ProjLayout();
+    size_t start = out.Pos();
+    // The header is filled in once we know where the TOC is.
+    uint8_t header[R5_HEADER_SIZE] = {0};
+    out.Write(header, R5_HEADER_SIZE);
+    if (!WriteSectionsR7(proj, l, compress, out, R5_HEADER_SIZE)) {
+        return false;
+    }
+    WriteTOCR7(proj, l, out, out.Pos() - start, header);
+    out.Patch(start, header, R5_HEADER_SIZE);
+    return true;
+}
+
+bool WriteProj(Proj const& proj, Sink& out, bool compress, ProjLayout* layout)
+{
+    bool ok = WriteProjR7(proj, out, compress, layout);
+    return out.Flush() && ok;
+}
+
+void WriteProj(Proj const& proj, std::vector<uint8_t>& out, bool compress, ProjLayout* layout)
+{
+    MemSink sink(out);
+    WriteProj(proj, sink, compress, layout);
+}
+
+bool AppendProj(Proj const& proj, ProjLayout& layout, Sink& tail, uint8_t* header, bool compress)
+{
+    if (!layout.toc.valid || layout.maps.size() != proj.maps.size()) {
+        return false;
+    }
+    // Don't let the file fill up with dead sections.
+    if (layout.fileSize - layout.LiveSize() > layout.fileSize / 2) {
+        return false;
+    }
+    size_t start = tail.Pos();
+    if (!WriteSectionsR7(proj, layout, compress, tail, layout.fileSize)) {
+        return false;
+    }
+    WriteTOCR7(proj, layout, tail, layout.fileSize + (tail.Pos() - start), header);
+    return tail.Flush();
+}
+
+bool AppendProj(Proj const& proj, ProjLayout& layout, std::vector<uint8_t>& tail, uint8_t* header, bool compress)
+{
+    MemSink sink(tail);
+    return AppendProj(proj, layout, sink, header, compress);
+}
+
+size_t ProjLayout::LiveSize() const
+{
+    auto live = [](FileSection const& sect) -> size_t {
+        return sect.valid ? sect.size : 0;
+    };
+    size_t n = R5_HEADER_SIZE + live(toc) + live(charset) + live(palette) + live(strings) + live(chunks);
+    for (auto const& m : maps) {
+        n += live(m.cells) + live(m.ents);
+    }
+    return n;
+}
+
+uint64_t ProjLayout::FileId() const
+{
+    if (!toc.valid) {
+        return 0;
+    }
+    uint8_t id[R5_HEADER_SIZE + 4 + 4];
+    ProjHeader(*this, id);
+    for (int i = 0; i < 4; ++i) {
+        id[R5_HEADER_SIZE + i] = (fileSize >> (i * 8)) & 0xFF;
+        id[R5_HEADER_SIZE + 4 + i] = (tocChecksum >> (i * 8)) & 0xFF;
+    }
+    // FNV-1a (64 bit).
+    uint64_t h = 14695981039346656037ull;
+    for (uint8_t b : id) {
+        h = (h ^ b) * 1099511628211ull;
+    }
+    return h;
+}
+
+void ProjLayout::InvalidateAll()
+{
+    for (auto& m : maps) {
+        m.cells.valid = false;
+        m.ents.valid = false;
+    }
+    charset.valid = false;
+    palette.valid = false;
+    strings.valid = false;
+    chunks.valid = false;
+}
+
+
+// n bytes at p, referring to data if set (otherwise copied).
+static SharedBytes FileBytes(std::shared_ptr<FileData const> const& data, uint8_t const* p, size_t n)
+{
+    if (data) {
+        return SharedBytes(data, p - data->Data(), n);
+    }
+    return SharedBytes(std::vector<uint8_t>(p, p + n));
+}
+
+// Record why reading failed (if err is set). Always returns false.
+static bool ReadFailed(ReadError* err, uint8_t const* start, uint8_t const* at, std::string const& reason)
+{
+    if (err) {
+        err->offset = (size_t)(at - start);
+        err->reason = reason;
+    }
+    return false;
+}
+
+// Would a w x h map need more than size bytes of R3 cells? (Every chunk
+// takes at least 5 bytes, or 2 if it can refer to the chunk store). Checked
+// before creating the map, so a bad size can't make us allocate a huge
+// chunk table.
+static bool TooBigForCells(int w, int h, uint64_t size, bool block, bool refs)
+{
+    uint64_t chunks = (uint64_t)((w + CHUNK_SIZE - 1) / CHUNK_SIZE) * (uint64_t)((h + CHUNK_SIZE - 1) / CHUNK_SIZE);
+    // A compressed block can unpack to 256x its size at most (see ReadBlock()).
+    uint64_t most = block ? size * 256 : size;
+    return chunks * (refs ? 2 : 5) > most;
+}
+
+// Reads R3 to R7.
+// If data is set, it holds start..end, and maps are left in it to be
+// loaded later. The charset and palette just refer to it (if they're not
+// compressed). Otherwise the maps are all decoded now, in parallel.
+// If layout is set, it's filled in (R7 only - otherwise it's left
+// invalid, as we can't append to older files).
+static bool ReadProjR3(Proj& proj, uint8_t const* start, uint8_t const* end, std::shared_ptr<FileData const> const& data, ProjLayout* layout, ReadError* err)
+{
+    auto fail = [&](uint8_t const* at, std::string const& reason) -> bool {
+        return ReadFailed(err, start, at, reason);
+    };
+    char version = start[1];
+    bool blocks = (version >= '4');
+    bool r6 = (version >= '6');
+    bool r7 = (version >= '7');
+    size_t size = end - start;
+    // Is a section within the file?
+    auto valid = [&](uint32_t offset, uint32_t len) -> bool {
+        return offset <= size && len <= size - offset;
+    };
+
+    // Find the TOC.
+    uint8_t const* p;
+    size_t tocSize;
+    if (version >= '5') {
+        if (size < R5_HEADER_SIZE) {return fail(end, "truncated header");}
+        uint32_t tocOffset = GetU32LE(start + 2);
+        uint32_t n = GetU32LE(start + 6);
+        if (!valid(tocOffset, n)) {return fail(start + 2, "table of contents outside file");}
+        p = start + tocOffset;
+        tocSize = n;
+    } else {
+        p = start + 2;
+        tocSize = size - 2;
+    }
+
+    size_t headSize = r7 ? R7_TOC_SIZE : r6 ? R6_TOC_SIZE : R3_TOC_SIZE;
+    if (tocSize < headSize) {return fail(p, "truncated table of contents");}
+    uint8_t const* toc = p;
+    uint32_t nmaps = GetU32LE(p);
+    uint32_t charsetOffset = GetU32LE(p + 4);
+    uint32_t charsetSize = GetU32LE(p + 8);
+    uint32_t paletteOffset = GetU32LE(p + 12);
+    uint32_t paletteSize = GetU32LE(p + 16);
+    p += headSize;
+    if ((tocSize - headSize) / R3_MAP_ENTRY_SIZE < nmaps) {return fail(toc, "too many maps for table of contents");}
+    if (!valid(charsetOffset, charsetSize)) {return fail(toc + 4, "charset outside file");}
+    if (!valid(paletteOffset, paletteSize)) {return fail(toc + 12, "palette outside file");}
+
+    ProjLayout l;
+    if (r6) {
+        uint32_t stringsOffset = GetU32LE(toc + 20);
+        uint32_t stringsSize = GetU32LE(toc + 24);
+        if (!valid(stringsOffset, stringsSize)) {return fail(toc + 20, "string table outside file");}
+        uint8_t const* q = start + stringsOffset;
+        if (!ReadStringsR6(l.stringTable, q, q + stringsSize)) {return fail(q, "bad string table");}
+        l.toc = FileSection{(uint32_t)(toc - start), (uint32_t)tocSize, true};
+        l.fileSize = (uint32_t)size;
+        l.tocChecksum = Checksum(toc, tocSize);
+        l.charset = FileSection{charsetOffset, charsetSize, true};
+        l.palette = FileSection{paletteOffset, paletteSize, true};
+        l.strings = FileSection{stringsOffset, stringsSize, true};
+    }
+    // Chunks the maps can share.
+    std::shared_ptr<ChunkStore const> store;
+    if (r7) {
+        uint32_t chunksOffset = GetU32LE(toc + 28);
+        uint32_t chunksSize = GetU32LE(toc + 32);
+        if (!valid(chunksOffset, chunksSize)) {return fail(toc + 28, "chunk store outside file");}
+        uint8_t const* q = start + chunksOffset;
+        auto chunks = std::make_shared<ChunkStore>();
+        if (!ReadChunkStore(*chunks, q, q + chunksSize)) {return fail(q, "bad chunk store");}
+        l.chunks = FileSection{chunksOffset, chunksSize, true};
+        l.chunkStore = chunks;
+        if (!chunks->empty()) {
+            store = chunks;
+        }
+    }
+
+    proj.maps.clear();
+    proj.maps.reserve(nmaps);
+    // Cells to decode, if not lazy.
+    struct Job {
+        uint8_t const* p;
+        uint8_t const* end;
+    };
+    std::vector<Job> jobs;
+    // The attr names in the string table, interned as they turn up.
+    std::vector<Atom> names;
+    for (uint32_t i = 0; i < nmaps; ++i) {
+        int w = (p[1]<<8) + p[0];
+        int h = (p[3]<<8) + p[2];
+        uint32_t cellsOffset = GetU32LE(p + 4);
+        uint32_t cellsSize = GetU32LE(p + 8);
+        uint32_t entsOffset = GetU32LE(p + 12);
+        uint32_t entsSize = GetU32LE(p + 16);
+        if (!valid(cellsOffset, cellsSize)) {return fail(p + 4, std::format("map {}: cells outside file", i));}
+        if (!valid(entsOffset, entsSize)) {return fail(p + 12, std::format("map {}: ents outside file", i));}
+        if (TooBigForCells(w, h, cellsSize, blocks, store != nullptr)) {return fail(p, std::format("map {}: {}x{} is too big for its cells", i, w, h));}
+        p += R3_MAP_ENTRY_SIZE;
+        if (r6) {
+            l.maps.push_back(ProjLayout::Map{
+                FileSection{cellsOffset, cellsSize, true},
+                FileSection{entsOffset, entsSize, true}});
+        }
+
+        Tilemap map;
+        if (data) {
+            map = Tilemap::FromFile(w, h, std::make_shared<LazyCells const>(LazyCells{data, cellsOffset, cellsSize, blocks, store}));
+        } else {
+            map = Tilemap(w, h);
+            jobs.push_back(Job{start + cellsOffset, start + cellsOffset + cellsSize});
+        }
+        uint8_t const* ents = start + entsOffset;
+        bool entsOk = r6 ?
+            ReadEntsR6(map.ents, ents, ents + entsSize, l.stringTable, names) :
+            ReadEnts(map.ents, ents, ents + entsSize) == ents + entsSize;
+        if (!entsOk) {return fail(ents, std::format("map {}: bad ents", i));}
+        proj.maps.push_back(std::move(map));
+    }
+
+    if (!jobs.empty()) {
+        std::vector<char> ok(jobs.size());
+        ParallelFor((int)jobs.size(), [&](int i) {
+            ok[i] = ReadCells(proj.maps[i], jobs[i].p, jobs[i].end, blocks, store.get());
+        });
+        auto bad = std::find(ok.begin(), ok.end(), 0);
+        if (bad != ok.end()) {
+            size_t i = bad - ok.begin();
+            return fail(jobs[i].p, std::format("map {}: bad cells", i));
+        }
+    }
+
+    // Read charset.
+    {
+        Charset& charset = proj.charset;
+        uint8_t const* q = start + charsetOffset;
+        uint8_t const* qend = q + charsetSize;
+        if (charsetSize < 4) {return fail(q, "truncated charset");}
+        charset.tw = (int)q[0];
+        charset.th = (int)q[1];
+        charset.ntiles = (int)((q[3]<<8) + q[2]);
+        q += 4;
+        size_t n = (size_t)charset.tw * charset.th * charset.ntiles;
+        bool packed = blocks && qend > q && *q != R4_BLOCK_RAW;
+        std::vector<uint8_t> buf;
+        if (blocks && !ReadBlock(q, qend, buf)) {return fail(q, "bad charset block");}
+        if ((size_t)(qend - q) != n) {return fail(start + charsetOffset, "charset images are the wrong size");}
+        if (packed) {
+            charset.SetImages(std::move(buf));
+        } else {
+            charset.SetImages(FileBytes(data, q, n));
+        }
+    }
+
+    // Read palette
+    {
+        Palette& palette = proj.palette;
+        uint8_t const* q = start + paletteOffset;
+        if (paletteSize < 2) {return fail(q, "truncated palette");}
+        palette.ncolours = (int)((q[1]<<8) + q[0]);
+        size_t n = 4 * (size_t)palette.ncolours;
+        if (paletteSize - 2 != n) {return fail(q, "palette colours are the wrong size");}
+        palette.colours = FileBytes(data, q + 2, n);
+    }
+    if (layout && r7) {
+        *layout = l;
+    }
+    return true;
+}
+
+// Reads R1 and R2.
+static bool ReadProjR1(Proj& proj, uint8_t const* start, uint8_t const* end, std::shared_ptr<FileData const> const& data, ReadError* err)
+{
+    auto fail = [&](uint8_t const* at, std::string const& reason) -> bool {
+        return ReadFailed(err, start, at, reason);
+    };
+    // Bytes left.
+    auto left = [&](uint8_t const* p) -> size_t {
+        return (size_t)(end - p);
+    };
+    int version = start[1] - '0';
+    uint8_t const* p = start + 2;
 
     // number of ent templates (not yet used)
     if (version == 2) {
-        if((end - p) < 2) { return false; }
+        if (left(p) < 2) {return fail(p, "truncated header");}
         //int numEntTemplates = (p[1]<<8) + p[0];
         p += 2;
     }
 
     // Read maps.
-    if((end - p) < 2) { return false; }
+    if (left(p) < 2) {return fail(p, "truncated header");}
     int nmaps = (p[1]<<8) + p[0];
     p += 2;
     proj.maps.clear();
     for (int i = 0; i < nmaps; ++i) {
-        Tilemap map;
-        if((end - p) < 4) { return false; }
-        map.w = (p[1]<<8) + p[0];
+        if (left(p) < 4) {return fail(p, std::format("map {}: truncated", i));}
+        int w = (p[1]<<8) + p[0];
         p += 2;
-        map.h = (p[1]<<8) + p[0];
+        int h = (p[1]<<8) + p[0];
         p += 2;
         // enough data for cells?
-        if ((end-p) < map.w * map.h * (2 + 1 + 1)) { return false; }
-        map.cells.resize(map.w * map.h);
-        for (Cell& cell : map.cells) {
-            cell.tile = (p[1]<<8) + p[0];
-            p += 2;
-            cell.ink = *p++;
-            cell.paper = *p++;
+        if (left(p) / (2 + 1 + 1) < (size_t)w * (size_t)h) {return fail(p - 4, std::format("map {}: {}x{} cells run past end of file", i, w, h));}
+        Tilemap map(w, h);
+        // Compact as we go, a row of chunks at a time, so big empty maps
+        // never take up much memory.
+        for (int y = 0; y < h; y += CHUNK_SIZE) {
+            MapRect band = map.Bounds().Clip(MapRect(0, y, w, CHUNK_SIZE));
+            map.ForEachSpan(band, [&](TilePoint const& pos, PlanesView cells, int n) {
+                for (int j = 0; j < n; ++j) {
+                    cells.tile[j] = (p[1]<<8) + p[0];
+                    p += 2;
+                    cells.ink[j] = *p++;
+                    cells.paper[j] = *p++;
+                }
+            });
+            map.Compact(band);
         }
+        map.Compact();  // share uniform chunks across the whole map.
 
         // R2 has ents
         if (version == 2) {
-            if (end - p < 1) {return false;}
-            int numEnts = *p++;
-            map.ents.resize(numEnts);
-            for (Ent& ent : map.ents) {
-                if (end - p < 1) {return false;}
-                int numAttrs = (int)*p++;
-                ent.attrs.resize(numAttrs);
-                for (EntAttr& attr : ent.attrs) {
-                    // read name
-                    {
-                        if (end - p < 1) {return false;}
-                        int n = (int)*p++;
-                        if (end - p < n) {return false;}
-                        attr.name = std::string(p, p + n);
-                        p += n;
-                    }
-                    // read value
-                    {
-                        if (end - p < 1) {return false;}
-                        int n = (int)*p++;
-                        if (end - p < n) {return false;}
-                        attr.value = std::string(p, p + n);
-                        p += n;
-                    }
-                }
-            }
+            uint8_t const* ents = p;
+            p = ReadEnts(map.ents, p, end);
+            if (!p) {return fail(ents, std::format("map {}: bad ents", i));}
         }
 
-        proj.maps.push_back(map);
+        proj.maps.push_back(std::move(map));
     }
     // Read charset.
     Charset& charset = proj.charset;
     {
-        if ((end - p) < (1+1+2)) {return false;}
+        if (left(p) < (1+1+2)) {return fail(p, "truncated charset");}
         charset.tw = (int)*p++;
         charset.th = (int)*p++;
         charset.ntiles = (int)((p[1]<<8) + p[0]);
         p += 2;
-        
+
         // enough tile image data?
-        int n = charset.tw * charset.th * charset.ntiles;
-        if ((end - p) < n) { return false; }
-        charset.images = std::vector<uint8_t>(p, p + n);
+        size_t n = (size_t)charset.tw * charset.th * charset.ntiles;
+        if (left(p) < n) {return fail(p - 4, "charset images run past end of file");}
+        charset.SetImages(FileBytes(data, p, n));
         p += n;
     }
 
     // Read palette
     Palette& palette = proj.palette;
     {
-        if ((end - p) < 2) {return false;}
+        if (left(p) < 2) {return fail(p, "truncated palette");}
         palette.ncolours = (int)((p[1]<<8) + p[0]);
         p += 2;
 
         // enough colour data?
-        int n = 4 * palette.ncolours;
-        if ((end - p) < n) { return false; }
-        palette.colours = std::vector<uint8_t>(p, p + n);
+        size_t n = 4 * (size_t)palette.ncolours;
+        if (left(p) < n) {return fail(p - 2, "palette colours run past end of file");}
+        palette.colours = FileBytes(data, p, n);
         p += n;
     }
 
     if (p != end) {
-        printf("warning: leftover data...\n");
+        return fail(p, "leftover data at end of file");
     }
     return true;
 }
 
+// Reads any version. proj is only touched if it all works out.
+static bool ReadProjAny(Proj& proj, uint8_t const* p, uint8_t const* end, std::shared_ptr<FileData const> const& data, ProjLayout* layout, ReadError* err)
+{
+    if (layout) {
+        *layout = ProjLayout();
+    }
+    // Check magic cookie.
+    if (end - p < 2 || p[0] != 'r') {
+        return ReadFailed(err, p, p, "not a project file");
+    }
+    Proj tmp;
+    bool ok;
+    switch (p[1]) {
+        case '1':
+        case '2':
+            ok = ReadProjR1(tmp, p, end, data, err);
+            break;
+        case '3':
+        case '4':
+        case '5':
+        case '6':
+        case '7':
+            ok = ReadProjR3(tmp, p, end, data, layout, err);
+            break;
+        default:
+            return ReadFailed(err, p, p + 1, "unknown version");
+    }
+    if (ok) {
+        proj = std::move(tmp);
+    }
+    return ok;
+}
+
+
+bool ReadProj(Proj& proj, uint8_t const* p, uint8_t const* end, ReadError* err)
+{
+    return ReadProjAny(proj, p, end, nullptr, nullptr, err);
+}
+
+bool ReadProj(Proj& proj, std::shared_ptr<FileData const> const& data, ProjLayout* layout, ReadError* err)
+{
+    return ReadProjAny(proj, data->Data(), data->Data() + data->Size(), data, layout, err);
+}
+
+bool LoadProj(Proj& proj, std::string const& filename, ProjLayout* layout, ReadError* err)
+{
+    auto data = FileData::Open(filename);
+    if (!data) {
+        if (err) {
+            *err = ReadError{0, "can't open file"};
+        }
+        return false;
+    }
+    return ReadProj(proj, data, layout, err);
+}
+
+std::string ReadError::ToString() const
+{
+    return std::format("{} (at offset {})", reason, offset);
+}
+
+// Atom implementation
+
+namespace {
+
+// The interned strings. A node-based set, so the strings never move.
+struct AtomHash
+{
+    using is_transparent = void;
+    size_t operator()(std::string_view s) const {return std::hash<std::string_view>()(s);}
+};
+struct AtomTable
+{
+    std::mutex lock;
+    std::unordered_set<std::string, AtomHash, std::equal_to<>> strings;
+};
+
+AtomTable& Atoms()
+{
+    static AtomTable table;
+    return table;
+}
+
+}   // namespace
+
+Atom::Atom(std::string_view s)
+{
+    if (s.empty()) {
+        return;
+    }
+    AtomTable& table = Atoms();
+    std::lock_guard<std::mutex> hold(table.lock);
+    auto it = table.strings.find(s);
+    if (it == table.strings.end()) {
+        it = table.strings.emplace(s).first;
+    }
+    mStr = &*it;
+}
+
+std::string const& Atom::str() const
+{
+    static std::string const empty;
+    return mStr ? *mStr : empty;
+}
+
+
 // Ent implementation
 std::string Ent::ToString() const
 {
     std::string out;
     for (auto const& a : attrs) {
         // TODO: percent-encode things!
-        out += std::format("{}={} ", a.name, a.value);
+        out += std::format("{}={} ", a.name.str(), a.value);
     }
     return out;
 }
@@ -317,8 +1817,8 @@ void Ent::FromString(std::string const& s)
         // blank values are OK.
 
         EntAttr attr;
-        attr.name = std::string(name, equals);
-        attr.value = std::string(val, it);
+        attr.name = Atom(std::string_view(name, equals));
+        attr.value.assign(val, it);
 
         attrs.push_back(attr);
     }
@@ -327,7 +1827,7 @@ void Ent::FromString(std::string const& s)
 std::string Ent::GetAttr(std::string const& name) const
 {
     for (auto const& attr : attrs) {
-        if (attr.name == name) {
+        if (attr.name.str() == name) {
             return attr.value;
         }
     }
@@ -337,7 +1837,17 @@ std::string Ent::GetAttr(std::string const& name) const
 
 int Ent::GetAttrInt(std::string const& name) const
 {
-    auto s = GetAttr(name);
+    std::string const* v = nullptr;
+    for (auto const& attr : attrs) {
+        if (attr.name.str() == name) {
+            v = &attr.value;
+            break;
+        }
+    }
+    if (!v) {
+        return 0;
+    }
+    std::string const& s = *v;
     int i = 0;
     std::from_chars(s.data(), s.data() + s.size(), i);
     return i;
@@ -348,7 +1858,7 @@ void Ent::SetAttr(std::string const& name, std::string const& value)
 {
     // Update existing?
     for (auto& attr : attrs) {
-        if (attr.name == name) {
+        if (attr.name.str() == name) {
             attr.value = value;
             return;
         }
@@ -420,11 +1930,7 @@ void DefaultProj(Proj* proj)
         159,  159,  159, // Light Grey
     };
 
-    Tilemap map;
-    map.w = 40;
-    map.h = 25;
-    map.cells.resize(map.w * map.h);
-    proj->maps.push_back(map);
+    proj->maps.push_back(Tilemap(40, 25));
 
     // default charset
     {
@@ -432,7 +1938,7 @@ void DefaultProj(Proj* proj)
         t.tw = 8;
         t.th = 8;
         t.ntiles = 2;
-        t.images.resize(t.tw * t.th * t.ntiles);
+        t.AllocImages();
         uint8_t* dest = t.Raw(0);
         for (int i = 0; i < 8 * 8; ++i) {
             *dest++ = 0;
@@ -443,12 +1949,13 @@ void DefaultProj(Proj* proj)
     }
     Palette& pal = proj->palette;
     pal.ncolours = 16;
-    pal.colours.resize(pal.ncolours * 4);
+    std::vector<uint8_t> colours(pal.ncolours * 4);
     for (int i = 0; i < pal.ncolours; ++i) {
-        pal.colours[i * 4 + 0] = c64palette[i * 3 + 0];
-        pal.colours[i * 4 + 1] = c64palette[i * 3 + 1];
-        pal.colours[i * 4 + 2] = c64palette[i * 3 + 2];
-        pal.colours[i * 4 + 3] = 255;
+        colours[i * 4 + 0] = c64palette[i * 3 + 0];
+        colours[i * 4 + 1] = c64palette[i * 3 + 1];
+        colours[i * 4 + 2] = c64palette[i * 3 + 2];
+        colours[i * 4 + 3] = 255;
     }
+    pal.colours = SharedBytes(std::move(colours));
 }
 
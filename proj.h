@@ -2,9 +2,14 @@
 
 #include <cstdint>
 #include <string>
+#include <string_view>
 #include <vector>
+#include <memory>
+#include <algorithm>
 #include <cassert>
 
+#include "filedata.h"
+
 // Our core data structures.
 
 // Maps hold cells, and each cell has a tile index and some extra metadata.
@@ -16,6 +21,9 @@ struct Cell {
     uint8_t paper{0};
 };
 
+inline bool operator==(Cell const& a, Cell const& b)
+    {return a.tile == b.tile && a.ink == b.ink && a.paper == b.paper;}
+
 
 // Base point struct. Derived structs for specific uses to help catch common
 // mixups at compile time.
@@ -93,15 +101,49 @@ struct MapRect : public Rect
             point.y >= y && point.y < y + h;
     }
     MapRect Clip(MapRect const& r) const;
+    // Return the overlap of this and r (possibly empty).
+    MapRect Intersect(MapRect const& r) const;
 };
 
 inline bool operator==(MapRect const& a, MapRect const& b)
     {return a.x == b.x && a.y == b.y && a.w == b.w && a.h == b.h;}
 
 
+// An interned string: all Atoms with the same text share a single copy of
+// it (which lives forever), so they're cheap to copy and compare. Good for
+// a small set of strings which repeat a lot, like ent attr names - not for
+// arbitrary data (eg attr values), which would pile up for good.
+// Thread-safe.
+class Atom
+{
+public:
+    Atom() = default;
+    Atom(std::string_view s);
+    Atom(std::string const& s) : Atom(std::string_view(s)) {}
+    Atom(char const* s) : Atom(std::string_view(s)) {}
+
+    std::string const& str() const;
+    char const* c_str() const {return str().c_str();}
+    bool empty() const {return mStr == nullptr;}
+
+    bool operator==(Atom const& other) const {return mStr == other.mStr;}
+    bool operator!=(Atom const& other) const {return mStr != other.mStr;}
+    // For hashing.
+    std::string const* Key() const {return mStr;}
+
+private:
+    std::string const* mStr{nullptr};   // null for "".
+};
+
+template<> struct std::hash<Atom>
+{
+    size_t operator()(Atom const& a) const {return std::hash<void const*>()(a.Key());}
+};
+
+
 struct EntAttr
 {
-    std::string name;
+    Atom name;
     std::string value;
 };
 
@@ -132,37 +174,135 @@ struct Ent
 
 
 
+// Maps store their cells in fixed-size square chunks.
+constexpr int CHUNK_SIZE = 16;
+constexpr int CHUNK_CELLS = CHUNK_SIZE * CHUNK_SIZE;
+
+// Cells are stored as separate planes - one array each for tile, ink and
+// paper - so anything which only needs one field only touches the memory it
+// needs (and the loops vectorise nicely).
+// These views point into the planes for a run of cells.
+struct PlanesView
+{
+    uint16_t* tile;
+    uint8_t* ink;
+    uint8_t* paper;
+
+    Cell Get(int i) const {return Cell{tile[i], ink[i], paper[i]};}
+    void Set(int i, Cell const& c) {
+        tile[i] = c.tile;
+        ink[i] = c.ink;
+        paper[i] = c.paper;
+    }
+};
+
+struct ConstPlanesView
+{
+    uint16_t const* tile;
+    uint8_t const* ink;
+    uint8_t const* paper;
+
+    Cell Get(int i) const {return Cell{tile[i], ink[i], paper[i]};}
+};
+
+struct CellChunk
+{
+    // Row-major planes. Cells which fall outside the map (in chunks on the
+    // right and bottom edges) are unused.
+    uint16_t tile[CHUNK_CELLS];
+    uint8_t ink[CHUNK_CELLS];
+    uint8_t paper[CHUNK_CELLS];
+    // Set if every cell (within the map) is the same.
+    bool uniform{false};
+
+    // Create a new chunk with all cells set to c.
+    static std::shared_ptr<CellChunk> Uniform(Cell const& c);
+
+    // View of cells from x,y onward.
+    PlanesView At(int x, int y) {
+        int i = (y * CHUNK_SIZE) + x;
+        return PlanesView{tile + i, ink + i, paper + i};
+    }
+    ConstPlanesView At(int x, int y) const {
+        int i = (y * CHUNK_SIZE) + x;
+        return ConstPlanesView{tile + i, ink + i, paper + i};
+    }
+};
+
+
+// Chunks stored once for a whole project file, which the maps' cells can
+// refer to by index (R7 onward - see WriteProj()).
+typedef std::vector<std::shared_ptr<CellChunk>> ChunkStore;
+
+// Where to find the cells of a map which haven't been loaded yet.
+// (see ReadProj()).
+struct LazyCells
+{
+    std::shared_ptr<FileData const> data;   // The whole file.
+    size_t offset{0};
+    size_t size{0};
+    bool block{false};  // Wrapped in a block (R4 onward)?
+    std::shared_ptr<ChunkStore const> store;    // The file's chunk store, if it has one.
+};
+
+struct ReadError;
+
 // A Map.
-// Just an rectangular array of cells, with some members to make access
-// easier.
+// A rectangular array of cells, with some members to make access easier.
+//
+// The cells are held in chunks, which are shared where possible:
+// - Compact() makes uniform chunks (eg big empty areas) share a single
+//   chunk, so memory follows content rather than area.
+// - Copies of a map share the whole chunk table (so copying is cheap) and
+//   the chunks themselves, until one side modifies them.
+// Non-const access to cells unshares the chunk holding them, so use const
+// access for reading wherever possible.
+//
+// A map read from a file can leave its cells in the file until they're
+// first accessed (see FromFile()).
 struct Tilemap
 {
-    int w;
-    int h;
-    std::vector<Cell> cells;
+    Tilemap() = default;
+    Tilemap(int width, int height, Cell const& fill = Cell());
+    // A map whose cells are loaded from cells when first needed.
+    static Tilemap FromFile(int width, int height, std::shared_ptr<LazyCells const> cells);
+
+    int w{0};
+    int h{0};
 
     std::vector<Ent> ents;
 
     bool IsValid(TilePoint const& tp) const {
         return Bounds().Contains(tp);
     }
-    Cell& CellAt(TilePoint const& tp) {
-        assert(Bounds().Contains(tp));
-        return cells[(tp.y * w) + tp.x];
+    Cell CellAt(TilePoint const& tp) const {
+        return PlanesConst(tp).Get(0);
     };
-    const Cell& CellAt(TilePoint const& tp) const {
-        assert(Bounds().Contains(tp));
-        return cells[(tp.y * w) + tp.x];
+    void SetCell(TilePoint const& tp, Cell const& c) {
+        Planes(tp).Set(0, c);
     };
 
-    Cell* CellPtr(TilePoint const& tp) {
+    // Views of the cells starting at tp.
+    // NOTE: cells are only contiguous along a row up to the edge of the
+    // chunk - use SpanLen() to find out how many. Or use ForEachSpan().
+    PlanesView Planes(TilePoint const& tp) {
         assert(Bounds().Contains(tp));
-        return &cells[(tp.y * w) + tp.x];
+        return Chunk(tp.x / CHUNK_SIZE, tp.y / CHUNK_SIZE).At(tp.x % CHUNK_SIZE, tp.y % CHUNK_SIZE);
     };
-    Cell const* CellPtrConst(TilePoint const& tp) const {
+    ConstPlanesView PlanesConst(TilePoint const& tp) const {
         assert(Bounds().Contains(tp));
-        return &cells[(tp.y * w) + tp.x];
+        return ChunkConst(tp.x / CHUNK_SIZE, tp.y / CHUNK_SIZE).At(tp.x % CHUNK_SIZE, tp.y % CHUNK_SIZE);
     };
+    // Number of contiguous cells in the row, starting at tp.
+    int SpanLen(TilePoint const& tp) const {
+        return std::min(CHUNK_SIZE - (tp.x % CHUNK_SIZE), w - tp.x);
+    }
+
+    // Call fn(TilePoint const& pos, PlanesView cells, int n) for each
+    // contiguous run of cells in area (which must be within the map).
+    template<typename F> void ForEachSpan(MapRect const& area, F fn);
+    // As ForEachSpan(), but with ConstPlanesView.
+    template<typename F> void ForEachSpanConst(MapRect const& area, F fn) const;
 
     // Return a bounding rect for the map.
     MapRect Bounds() const {
@@ -173,27 +313,146 @@ struct Tilemap
     // Any cells outside bounds of map will be zero.
     // (So r can go outside the map area).
     Tilemap Copy(MapRect const& r) const;
+
+    // Set every cell in the map.
+    void Fill(Cell const& c);
+
+    // Share uniform chunks.
+    void Compact() {Compact(Bounds());}
+    // Just the chunks touching area.
+    void Compact(MapRect const& area);
+
+    // Approximate memory used by the cells, in bytes. Shared chunks are
+    // split between their users.
+    size_t CellMemUsage() const;
+
+    // Chunk-level access.
+    int ChunksW() const {return (w + CHUNK_SIZE - 1) / CHUNK_SIZE;}
+    int ChunksH() const {return (h + CHUNK_SIZE - 1) / CHUNK_SIZE;}
+    // Area of map covered by a chunk (clipped to the map).
+    MapRect ChunkBounds(int cx, int cy) const {
+        return Bounds().Clip(MapRect(cx * CHUNK_SIZE, cy * CHUNK_SIZE, CHUNK_SIZE, CHUNK_SIZE));
+    }
+    CellChunk const& ChunkConst(int cx, int cy) const {
+        return *Table()[(cy * ChunksW()) + cx];
+    }
+    // Returns an unshared chunk, ready to be modified.
+    CellChunk& Chunk(int cx, int cy);
+    // Share chunks directly (eg to keep an old version of a chunk for undo).
+    std::shared_ptr<CellChunk> SharedChunk(int cx, int cy) const {
+        return Table()[(cy * ChunksW()) + cx];
+    }
+    void SetSharedChunk(int cx, int cy, std::shared_ptr<CellChunk> chunk) {
+        Chunks()[(cy * ChunksW()) + cx] = chunk;
+    }
+    // True if the cells are shared with other copies of the map.
+    bool IsShared() const {return mChunks.use_count() > 1;}
+    // Make sure the chunk table isn't shared, so different chunks can then
+    // be modified from different threads.
+    void OwnChunkTable() {Chunks();}
+    // Replace a chunk with a uniform one.
+    void FillChunk(int cx, int cy, Cell const& c);
+
+    // Compress unshared chunks into packed (eg for old undo data).
+    // The map mustn't be used again until Unpack()ed.
+    // Does nothing if the map IsShared() (the data is live elsewhere).
+    void Pack(std::vector<uint8_t>& packed);
+    // Restore a map packed by Pack(). Does nothing if it isn't packed.
+    void Unpack(std::vector<uint8_t>& packed);
+
+    // Are the cells still in the file? (Bad maps' are, too.)
+    bool IsLoaded() const {return !mLazy;}
+    // The file data, if not loaded (or bad).
+    std::shared_ptr<LazyCells const> const& Unloaded() const {return mLazy;}
+    // Load the cells now, if they're still in the file.
+    // Any access to the cells does this anyway, but it isn't thread-safe,
+    // so do it before handing a map over to other threads.
+    // Returns false (with err saying why, if set) if the map is bad.
+    bool Materialize(ReadError* err = nullptr) const;
+    // The cells in the file couldn't be decoded (only the TOC is checked
+    // when a file is opened), so the map reads as blank. It still refers to
+    // the file data, and saving copies that out unchanged rather than the
+    // blank cells, so treat the cells as read-only: Cmds and tools leave
+    // bad maps' cells alone.
+    bool IsBad() const {return mLazy && mChunks;}
+
+private:
+    typedef std::vector<std::shared_ptr<CellChunk>> ChunkTable;
+    // Returns an unshared table, ready to be modified.
+    ChunkTable& Chunks();
+    ChunkTable const& Table() const {
+        if (!mChunks) {
+            Materialize();
+        }
+        return *mChunks;
+    }
+    // Loading is invisible from outside, hence mutable.
+    // Not loaded yet: just mLazy. Loaded: just mChunks. Bad: both.
+    mutable std::shared_ptr<ChunkTable> mChunks;
+    mutable std::shared_ptr<LazyCells const> mLazy;
 };
 
+
+template<typename F> void Tilemap::ForEachSpan(MapRect const& area, F fn)
+{
+    assert(area.IsEmpty() || Bounds().Clip(area) == area);
+    for (int y = area.y; y < area.y + area.h; ++y) {
+        int x = area.x;
+        while (x < area.x + area.w) {
+            TilePoint pos(x, y);
+            int n = std::min(SpanLen(pos), (area.x + area.w) - x);
+            fn(pos, Planes(pos), n);
+            x += n;
+        }
+    }
+}
+
+template<typename F> void Tilemap::ForEachSpanConst(MapRect const& area, F fn) const
+{
+    assert(area.IsEmpty() || Bounds().Clip(area) == area);
+    for (int y = area.y; y < area.y + area.h; ++y) {
+        int x = area.x;
+        while (x < area.x + area.w) {
+            TilePoint pos(x, y);
+            int n = std::min(SpanLen(pos), (area.x + area.w) - x);
+            fn(pos, PlanesConst(pos), n);
+            x += n;
+        }
+    }
+}
+
 struct Charset
 {
     int tw;
     int th;
     int ntiles;
-    std::vector<uint8_t> images; // 1byte/pixel
+
+    // The images (1byte/pixel) are shared between copies of the charset,
+    // until one of them modifies them. They may still be in the project
+    // file (see ReadProj()).
+    SharedBytes const& Images() const {return mImages;}
+    void SetImages(std::vector<uint8_t>&& images) {mImages = SharedBytes(std::move(images));}
+    void SetImages(SharedBytes const& images) {mImages = images;}
+    // Set up zeroed images for tw, th and ntiles.
+    void AllocImages() {SetImages(std::vector<uint8_t>(tw * th * ntiles));}
+    bool ImagesShared() const {return mImages.IsShared();}
 
     uint8_t const* RawConst(int tile) const {
-        return images.data() + (tw*th*tile);
+        return mImages.data() + (tw*th*tile);
     };
+    // Unshares the images.
     uint8_t* Raw(int tile) {
-        return images.data() + (tw*th*tile);
+        return mImages.MutableData() + (tw*th*tile);
     };
+
+private:
+    SharedBytes mImages;
 };
 
 struct Palette
 {
     int ncolours;
-    std::vector<uint8_t> colours;   // R,G,B,x
+    SharedBytes colours;   // R,G,B,x
 };
 
 
@@ -213,9 +472,113 @@ struct Proj
     }
 };
 
+// A section of a saved project file.
+struct FileSection
+{
+    uint32_t offset{0};
+    uint32_t size{0};
+    bool valid{false};  // Still holds the current data?
+};
+
+// Where the parts of a Proj are in the file it was last loaded from or
+// saved to, so a save only has to write the parts which have changed (see
+// AppendProj()). Model marks sections invalid as they're modified.
+struct ProjLayout
+{
+    struct Map {
+        FileSection cells;
+        FileSection ents;
+    };
+    std::vector<Map> maps;
+    FileSection charset;
+    FileSection palette;
+    FileSection strings;
+    FileSection chunks;
+    FileSection toc;    // Invalid if there's no usable file.
+    // The strings in the file's string table, in order. Only ever added to
+    // (until the next full save), so the ents already written stay valid.
+    std::vector<std::string> stringTable;
+    // The file's chunk store. Fixed until the next full save (cells written
+    // in between can only refer to chunks already in it).
+    std::shared_ptr<ChunkStore const> chunkStore;
+    uint32_t fileSize{0};
+    uint32_t tocChecksum{0};    // Of the TOC's bytes.
+
+    // Bytes of the file still in use.
+    size_t LiveSize() const;
+    // Identifies the file cheaply, without reading it again: a hash of the
+    // header, size and TOC checksum, which every save changes. 0 if there's
+    // no usable file (eg older formats).
+    uint64_t FileId() const;
+    // Everything needs writing again (the file itself is still usable).
+    void InvalidateAll();
+};
+
+// Size of the header of an R5 (onward) file, which is all that's
+// overwritten by AppendProj().
+constexpr size_t R5_HEADER_SIZE = 2 + 4 + 4;
+// The header pointing at layout's TOC.
+void ProjHeader(ProjLayout const& layout, uint8_t* header);
+
 void DefaultProj(Proj* proj);
-void WriteProj(Proj const& proj, std::vector<uint8_t>& out);
-bool ReadProj(Proj& proj, uint8_t const* p, uint8_t const* end);
+// If compress is set, the cells and charset are compressed (RLE on the
+// planes, then LZ). Loading them is a little slower.
+// Chunks which turn up more than once (eg the same room border on many
+// maps) are written just once, and shared again when the file is loaded.
+// If layout is set, it's filled in to describe out.
+// The file is streamed out through the sink (which must support Patch()
+// back to where it started), so it's never all in memory at once.
+// Returns false if the sink failed, or if a bad map (see Tilemap::IsBad())
+// can't be copied out as it was.
+bool WriteProj(Proj const& proj, Sink& out, bool compress = true, ProjLayout* layout = nullptr);
+// Append the file to out.
+void WriteProj(Proj const& proj, std::vector<uint8_t>& out, bool compress = true, ProjLayout* layout = nullptr);
+// Older formats, which we don't save as any more (but they're handy for
+// testing the readers). R1 doesn't have ents.
+void WriteProjR1(Proj const& proj, Sink& out);
+void WriteProjR2(Proj const& proj, Sink& out);
+// Incremental save.
+// Produce the data to append to the file described by layout (at
+// layout.fileSize), holding just the sections which aren't valid plus a
+// new table of contents, and a new header (R5_HEADER_SIZE bytes) to
+// overwrite the start of the file with. Layout is updated to match.
+// The old sections are never overwritten - the file is only appended to,
+// plus the header rewrite - so until the header is written the file still
+// holds the previous save intact, and a FileData mapping the file (see
+// LoadProj()) stays valid throughout.
+// Changed maps only share chunks already in the file's chunk store - new
+// repeats aren't picked up until the next full save.
+// Returns false (without touching layout) if a full WriteProj() is needed
+// instead - no usable file, or too much of it is dead. Also returns false if
+// the sink fails or a bad map can't be written, as WriteProj() (in which
+// case layout is left half-updated, so pass in a copy).
+bool AppendProj(Proj const& proj, ProjLayout& layout, Sink& tail, uint8_t* header, bool compress = true);
+bool AppendProj(Proj const& proj, ProjLayout& layout, std::vector<uint8_t>& tail, uint8_t* header, bool compress = true);
+
+// Why a project file couldn't be read.
+struct ReadError
+{
+    size_t offset{0};   // Where in the file the problem is.
+    std::string reason;
+
+    std::string ToString() const;
+};
+
+// Reading checks everything as it goes, so any old junk can be thrown at
+// it. On failure proj is left alone, and err (if set) says what was wrong.
+bool ReadProj(Proj& proj, uint8_t const* p, uint8_t const* end, ReadError* err = nullptr);
+// As above, but maps in R3 (onward) files aren't decoded until they're
+// first used (so opening a big project is quick). They keep a reference to
+// data until then.
+// The charset and palette are left in data too, until they're modified.
+// If layout is set, it's filled in from the file (if it's R6 or later -
+// otherwise it's left invalid).
+// (The cells of maps left in data are only checked when they're loaded -
+// see Tilemap::IsBad().)
+bool ReadProj(Proj& proj, std::shared_ptr<FileData const> const& data, ProjLayout* layout = nullptr, ReadError* err = nullptr);
+// Open a project file, mapping it into memory (see FileData) and reading
+// it as above, so we only hold one copy of the data.
+bool LoadProj(Proj& proj, std::string const& filename, ProjLayout* layout = nullptr, ReadError* err = nullptr);
 
 
 // Return ent index at pos, or -1 if none.
@@ -11,6 +11,10 @@
 #include "proj.h"
 #include "cmd.h"
 
+#include <algorithm>
+#include <functional>
+#include <vector>
+
 EntWidget::EntWidget(QWidget* parent, Model& ed) :
     QWidget(parent),
     mEd(ed)
@@ -41,12 +45,18 @@ EntWidget::EntWidget(QWidget* parent, Model& ed) :
     });
 
     connect(removeButton, &QPushButton::clicked, this, [&] {
-        auto sel = mListWidget->selectedItems();
-        for (auto item : sel) {
-            int row = mListWidget->row(item);
+        // Delete from the end backward, so the rows stay valid.
+        std::vector<int> rows;
+        for (auto item : mListWidget->selectedItems()) {
+            rows.push_back(mListWidget->row(item));
+        }
+        std::sort(rows.begin(), rows.end(), std::greater<int>());
+        mEd.BeginTransaction();
+        for (int row : rows) {
             DeleteEntsCmd* cmd = new DeleteEntsCmd(mEd, mMapNum, row, 1);
             mEd.AddCmd(cmd);
         }
+        mEd.EndTransaction();
     });
 
     connect(mListWidget, &QListWidget::itemChanged, this, [&](QListWidgetItem *item){
@@ -12,7 +12,10 @@
 
 #include <QAction>
 #include <QActionGroup>
+#include <QCoreApplication>
+#include <QDateTime>
 #include <QDir>
+#include <QFile>
 #include <QFileDialog>
 #include <QLabel>
 #include <QMenu>
@@ -20,6 +23,7 @@
 #include <QMessageBox>
 #include <QScrollArea>
 #include <QStatusBar>
+#include <QTimer>
 #include <QToolBar>
 #include <QToolButton>
 #include <QVBoxLayout>
@@ -31,9 +35,38 @@
 MainWindow::MainWindow(QWidget *parent, Model& ed)
     : QMainWindow(parent), mEd(ed)
 {
+    static int windowCount = 0;
+    mWindowNum = ++windowCount;
     mEd.modified = false;
 
+    // Pick up where we left off if there's an undo journal (eg after a
+    // crash). Before any listeners, as the widgets don't exist yet.
+    if (!mEd.mapFilename.empty()) {
+        mJournal.Resume(mEd.mapFilename + ".journal", JournalBase(mEd.savedLayout, mEd.mapFilename), mEd);
+        mEd.journal = &mJournal;
+    }
+
     mEd.listeners.insert(this);
+    // Pass on map damage once per event loop turn.
+    // (A reusable timer, so drawing doesn't allocate.)
+    mDamageTimer = new QTimer(this);
+    mDamageTimer->setSingleShot(true);
+    mDamageTimer->setInterval(0);
+    connect(mDamageTimer, &QTimer::timeout, this, [this]() {mEd.FlushDamage();});
+    mEd.damageFlushRequest = [this]() {
+        mDamageTimer->start();
+    };
+
+    // Autosave. We just take a snapshot, the saving happens on another
+    // thread, which reports back here when it's done.
+    mAutosaver.onDone = [this](Autosaver::Status const& status) {
+        QMetaObject::invokeMethod(this, [this, status]() {autosaveDone(status);}, Qt::QueuedConnection);
+    };
+    if (mEd.autosaveInterval > 0) {
+        mAutosaveTimer = new QTimer(this);
+        connect(mAutosaveTimer, &QTimer::timeout, this, &MainWindow::autosave);
+        mAutosaveTimer->start(mEd.autosaveInterval * 1000);
+    }
     createActions();
 
     switch (mEd.drawFlags) {
@@ -51,15 +84,32 @@ MainWindow::MainWindow(QWidget *parent, Model& ed)
 }
 
 MainWindow::~MainWindow() {
+    mEd.journal = nullptr;
+    mEd.damageFlushRequest = nullptr;
+    mEd.FlushDamage();
     mEd.listeners.erase(this);
 }
 
 void MainWindow::closeEvent(QCloseEvent *event)
 {
-    if (maybeSave())
+    if (maybeSave()) {
+        if (mEd.modified) {
+            // Changes were discarded, so don't replay them next time.
+            // The history goes too, as it may refer to the journal.
+            mEd.journal = nullptr;
+            mEd.ClearHistory();
+            mJournal.Discard();
+        }
+        // Either saved or discarded, so the autosave isn't needed.
+        if (mAutosaveTimer) {
+            mAutosaveTimer->stop();
+        }
+        mAutosaver.Wait();
+        QFile::remove(QString::fromStdString(autosavePath()));
         event->accept();
-    else
+    } else {
         event->ignore();
+    }
 }
 
 void MainWindow::RethinkTitle()
@@ -78,6 +128,11 @@ void MainWindow::MapNumChanged()
     mEntWidget->SetMapNum(mMapWidget->CurrentMap());
     mWorldWidget->setCurMap(mMapWidget->CurrentMap());
     RethinkTitle();
+    ReadError err;
+    if (!mEd.proj.maps[mMapWidget->CurrentMap()].Materialize(&err)) {
+        statusBar()->showMessage(tr("Map is damaged, so it's read-only (%1)")
+            .arg(QString::fromStdString(err.ToString())));
+    }
 }
 
 bool MainWindow::maybeSave()
@@ -106,12 +161,24 @@ void MainWindow::createActions()
         QAction* a;
         a = new QAction(tr("&Undo"), this);
         a->setShortcuts(QKeySequence::Undo);
-        connect(a, &QAction::triggered, [&]() {mEd.Undo(); RethinkTitle();});
+        connect(a, &QAction::triggered, [&]() {
+            if (!mEd.Undo()) {
+                QMessageBox::critical(this, tr("Undo failed"),
+                    tr("Couldn't reload the step from the undo journal, so the history before it has been lost."));
+            }
+            RethinkTitle();
+        });
         mActions.undo = a;
 
         a = new QAction(tr("&Redo"), this);
         a->setShortcuts(QKeySequence::Redo);
-        connect(a, &QAction::triggered, [&]() {mEd.Redo(); RethinkTitle();});
+        connect(a, &QAction::triggered, [&]() {
+            if (!mEd.Redo()) {
+                QMessageBox::critical(this, tr("Redo failed"),
+                    tr("Couldn't reload the step from the undo journal, so the history after it has been lost."));
+            }
+            RethinkTitle();
+        });
         mActions.redo = a;
     }
 
@@ -447,6 +514,8 @@ void MainWindow::createWidgets()
     // Add a label for displaying the cursor status.
     mCursorMsg = new QLabel();
     statusBar()->addWidget(mCursorMsg);
+    mAutosaveMsg = new QLabel();
+    statusBar()->addPermanentWidget(mAutosaveMsg);
 
     // The main map editing area
     mMapWidget = new MapWidget(nullptr, mEd);
@@ -579,14 +648,21 @@ bool MainWindow::save()
         return saveAs();
     }
 
-    bool ok = SaveProject(mEd.proj, QString::fromStdString(mEd.mapFilename));
+    // Only the parts which have changed are written (see AppendProj()), so
+    // make sure we've heard about all the changes.
+    mEd.FlushDamage();
+    bool ok = SaveProject(mEd.proj, QString::fromStdString(mEd.mapFilename), &mEd.savedLayout);
     if (!ok) {
         // TODO: proper error message
         QMessageBox::critical(this, tr("Save failed"), tr("Poop. It's all gone pear-shaped."));
         return false;
     }
 
+    if (mEd.journal) {
+        mJournal.Rebase(JournalBase(mEd.savedLayout, mEd.mapFilename));
+    }
     mEd.modified = false;
+    mAutosavedChange = mEd.changeCount;
     return true;
 }
 
@@ -608,17 +684,81 @@ bool MainWindow::saveAs()
     if (fileName.isEmpty())
         return false;
 
-    bool ok = SaveProject(mEd.proj, fileName);
+    ProjLayout layout;
+    bool ok = SaveProject(mEd.proj, fileName, &layout);
     if (!ok) {
         // TODO: proper error message
         QMessageBox::critical(this, tr("Save map as failed"), tr("Poop. It's all gone pear-shaped."));
         return false;
     }
+    if (mEd.mapFilename.empty()) {
+        // Autosaves go next to the file from now on.
+        mAutosaver.Wait();
+        QFile::remove(QString::fromStdString(autosavePath()));
+    }
     mEd.mapFilename = fileName.toStdString();
+    mEd.savedLayout = layout;
+    // The journal follows the file.
+    std::string journalFile = mEd.mapFilename + ".journal";
+    uint64_t base = JournalBase(mEd.savedLayout, mEd.mapFilename);
+    if (mEd.journal && mJournal.MoveTo(journalFile)) {
+        mJournal.Rebase(base);
+    } else {
+        // Positions in the old journal mean nothing in a new one.
+        if (!mEd.UnjournalHistory()) {
+            statusBar()->showMessage(tr("Some undo history couldn't be reloaded from the journal, so has been lost."));
+        }
+        mJournal.Start(journalFile, base);
+    }
+    mEd.journal = &mJournal;
     mEd.modified = false;
+    mAutosavedChange = mEd.changeCount;
     return true;
 }
 
+std::string MainWindow::autosavePath() const
+{
+    if (mEd.mapFilename.empty()) {
+        // Unique to this window, so other windows (and other instances)
+        // don't overwrite or delete it.
+        QString name = QString("untitled-%1-%2.retromap.autosave")
+            .arg(QCoreApplication::applicationPid())
+            .arg(mWindowNum);
+        return QDir::temp().filePath(name).toStdString();
+    }
+    return mEd.mapFilename + ".autosave";
+}
+
+void MainWindow::autosave()
+{
+    if (mEd.changeCount == mAutosavedChange) {
+        return;
+    }
+    // Copying the proj is cheap (the maps and charset are shared until
+    // modified).
+    Proj snapshot = mEd.proj;
+    if (!mAutosaver.Save(std::move(snapshot), autosavePath())) {
+        return; // Still busy with the last one - try again next time.
+    }
+    mAutosavedChange = mEd.changeCount;
+    mAutosaveMsg->setText(tr("Autosaving..."));
+}
+
+void MainWindow::autosaveDone(Autosaver::Status const& status)
+{
+    QString when = QDateTime::fromSecsSinceEpoch(status.when).toString("hh:mm:ss");
+    if (status.state == Autosaver::Status::SAVED) {
+        mAutosaveMsg->setText(tr("Autosaved %1 (%2 KB, %3 ms)")
+            .arg(when)
+            .arg((qulonglong)(status.bytes / 1024))
+            .arg((int)status.ms));
+    } else {
+        mAutosaveMsg->setText(tr("Autosave FAILED %1").arg(when));
+        // Make sure it's tried again.
+        mAutosavedChange = 0;
+    }
+}
+
 void MainWindow::open()
 {
 #if 0
@@ -682,10 +822,7 @@ void MainWindow::addMap()
         return;
     }
 
-    Tilemap map;
-    map.w = dlg.ResultW();
-    map.h = dlg.ResultH();
-    map.cells.resize(map.w * map.h);
+    Tilemap map(dlg.ResultW(), dlg.ResultH());
 
     // insert it after current one.
     int n = mMapWidget->CurrentMap() + 1;
@@ -697,6 +834,13 @@ void MainWindow::resizeMap()
 {
     int mapNum = mMapWidget->CurrentMap();
     Tilemap& cur = mEd.proj.maps[mapNum];
+    ReadError err;
+    if (!cur.Materialize(&err)) {
+        // Resizing would replace the cells with blank ones.
+        QMessageBox::critical(this, tr("Resize map failed"),
+            tr("The map is damaged, so it's read-only (%1)").arg(QString::fromStdString(err.ToString())));
+        return;
+    }
     MapSizeDialog dlg(this, cur.w, cur.h);
     if (dlg.exec() != QDialog::Accepted) {
         return;
@@ -729,15 +873,15 @@ void MainWindow::importMaps()
         return;
 
     Proj donor;
-    if (!LoadProject(donor, fileName)) {
-        // TODO: proper error message
-        QMessageBox::critical(this, tr("Import failed"), tr("Poop. It's all gone pear-shaped."));
+    ReadError err;
+    if (!LoadProject(donor, fileName, nullptr, &err)) {
+        QMessageBox::critical(this, tr("Import failed"), QString::fromStdString(err.ToString()));
         return;
     }
 
     // Insert them after current one (disregard palette, charset etc...)
     int n = mMapWidget->CurrentMap() + 1;
-    InsertMapsCmd* cmd = new InsertMapsCmd(mEd, donor.maps, n);
+    InsertMapsCmd* cmd = new InsertMapsCmd(mEd, std::move(donor.maps), n);
     mEd.AddCmd(cmd);
 }
 
@@ -3,6 +3,8 @@
 #include <QMainWindow>
 #include <QCloseEvent>
 
+#include "autosave.h"
+#include "journal.h"
 #include "model.h"
 
 class Model;
@@ -14,6 +16,7 @@ class PenWidget;
 class WorldWidget;
 class QAction;
 class QLabel;
+class QTimer;
 
 
 // Our main app window.
@@ -53,9 +56,19 @@ private:
 
     void RethinkTitle();
     void MapNumChanged();
+    // Start an autosave, if anything has changed.
+    void autosave();
+    void autosaveDone(Autosaver::Status const& status);
+    std::string autosavePath() const;
 
     // The editor state
     Model& mEd;
+    Journal mJournal;
+    QTimer* mDamageTimer;
+    Autosaver mAutosaver;
+    QTimer* mAutosaveTimer{nullptr};
+    uint64_t mAutosavedChange{0};   // Model::changeCount as last saved.
+    int mWindowNum;     // Tells untitled windows' autosaves apart.
 
     MapWidget* mMapWidget;
     CharsetWidget* mCharsetWidget;
@@ -64,6 +77,7 @@ private:
     WorldWidget* mWorldWidget;
     EntWidget* mEntWidget;
     QLabel* mCursorMsg;
+    QLabel* mAutosaveMsg;
     struct {
        QAction* importCharset{nullptr};
        QAction* open{nullptr};
@@ -2,6 +2,7 @@
 #include "helpers.h"
 
 #include "tool.h"
+#include "workers.h"
 
 //#include <cassert>
 #include <QPainter>
@@ -10,11 +11,17 @@
 
 constexpr int CURSORPENW = 3;
 
-MapWidget::MapWidget(QWidget* parent, Model& model) : QWidget(parent), MapEditor(model), mModel(model), mBacking()
+static uint32_t BackingKey(int tx, int ty)
+{
+    return ((uint32_t)ty << 16) | (uint32_t)tx;
+}
+
+MapWidget::MapWidget(QWidget* parent, Model& model) : QWidget(parent), MapEditor(model), mModel(model), mBacking(BACKING_MAX_BYTES)
 {
     setSizePolicy(QSizePolicy::Preferred, QSizePolicy::Preferred);
     //setSizePolicy(QSizePolicy::Preferred);
     setMouseTracking(true);
+    mDirtyJobs.reserve(DIRTY_JOBS_RESERVE);
     CurMapChanged();
 }
 
@@ -24,7 +31,8 @@ MapWidget::~MapWidget()
 
 void MapWidget::CurMapChanged()
 {
-    UpdateBacking(Map().Bounds());
+    // The new map's tiles get rendered as they're painted.
+    DropBacking();
     resize(sizeHint());
     update();
 }
@@ -90,6 +98,21 @@ void MapWidget::MapModified(MapRect const& dirty)
     update(FromMap(dirty));
 }
 
+void MapWidget::ProjCharsetModified()
+{
+    mGlyphs.Invalidate();
+    mBandGlyphs.clear();
+    DropBacking();
+    MapEditor::ProjCharsetModified();
+}
+
+void MapWidget::ProjNuke()
+{
+    mGlyphs.Invalidate();
+    mBandGlyphs.clear();
+    MapEditor::ProjNuke();
+}
+
 void MapWidget::EntsModified()
 {
     // redraw all
@@ -107,20 +130,129 @@ void MapWidget::UpdateBacking(MapRect const& dirty)
 {
     int tw = mModel.proj.charset.tw;
     int th = mModel.proj.charset.th;
-    int w = tw * Map().w;
-    int h = th * Map().h;
-    if (mBacking.width() != w || mBacking.height() != h) {
-        // resize the backing bitmap
-        mBacking = QImage(w, h, QImage::Format_RGBX8888);
+    if (mBackingBounds != Map().Bounds() || mBackingCellSize != QSize(tw, th)) {
+        // Map resized (or first time).
+        DropBacking();
+        return;
     }
 
-    // Draw affected area into backing image.
-    for (int y = dirty.y; y < dirty.y + dirty.h; ++y) {
-        for (int x = dirty.x; x < dirty.x + dirty.w; ++x) {
-            Cell const& cell = Map().CellAt(TilePoint(x, y));
-            RenderCell(mBacking, QPoint(x * tw, y * th), mModel.proj.charset, mModel.proj.palette, cell);
+    // Redraw the affected area of any tiles we have. The rest will be drawn
+    // when they're needed.
+    MapRect area = Map().Bounds().Intersect(dirty);
+    if (area.IsEmpty() || mBacking.isEmpty()) {
+        return;
+    }
+    mDirtyJobs.clear();
+    for (int ty = area.y / BACKING_TILE; ty <= (area.y + area.h - 1) / BACKING_TILE; ++ty) {
+        for (int tx = area.x / BACKING_TILE; tx <= (area.x + area.w - 1) / BACKING_TILE; ++tx) {
+            QImage* img = mBacking.object(BackingKey(tx, ty));
+            if (img) {
+                MapRect tile = BackingTileRect(tx, ty);
+                mDirtyJobs.push_back(BackingJob{img->bits(), (size_t)img->bytesPerLine(), tile, tile.Intersect(area)});
+            }
         }
     }
+    RenderJobs(mDirtyJobs);
+}
+
+void MapWidget::DropBacking()
+{
+    mBacking.clear();
+    mBackingBounds = Map().Bounds();
+    mBackingCellSize = QSize(mModel.proj.charset.tw, mModel.proj.charset.th);
+}
+
+MapRect MapWidget::BackingTileRect(int tx, int ty) const
+{
+    MapRect tile(tx * BACKING_TILE, ty * BACKING_TILE, BACKING_TILE, BACKING_TILE);
+    return Map().Bounds().Intersect(tile);
+}
+
+QImage const* MapWidget::BackingTile(int tx, int ty)
+{
+    uint32_t key = BackingKey(tx, ty);
+    if (!mBacking.contains(key)) {
+        PrepareBacking(tx, ty, tx, ty);
+    }
+    // NOTE: null if it was too big for the cache.
+    return mBacking.object(key);
+}
+
+void MapWidget::PrepareBacking(int tx0, int ty0, int tx1, int ty1)
+{
+    std::vector<std::pair<uint32_t, QImage*>> fresh;
+    std::vector<BackingJob> jobs;
+    for (int ty = ty0; ty <= ty1; ++ty) {
+        for (int tx = tx0; tx <= tx1; ++tx) {
+            uint32_t key = BackingKey(tx, ty);
+            if (mBacking.contains(key)) {
+                continue;
+            }
+            MapRect tile = BackingTileRect(tx, ty);
+            QImage* img = new QImage(tile.w * mModel.proj.charset.tw, tile.h * mModel.proj.charset.th, QImage::Format_RGBX8888);
+            jobs.push_back(BackingJob{img->bits(), (size_t)img->bytesPerLine(), tile, tile});
+            fresh.emplace_back(key, img);
+        }
+    }
+    RenderJobs(jobs);
+    for (auto const& [key, img] : fresh) {
+        // NOTE: deletes img if it's bigger than the whole cache.
+        mBacking.insert(key, img, img->sizeInBytes());
+    }
+}
+
+void MapWidget::RenderJobs(std::vector<BackingJob> const& jobs)
+{
+    int rows = 0;
+    int cells = 0;
+    for (BackingJob const& job : jobs) {
+        rows += job.area.h;
+        cells += job.area.w * job.area.h;
+    }
+    int nbands = std::min(NumWorkers(), rows);
+    if (cells < PARALLEL_MIN_CELLS || nbands < 2) {
+        for (BackingJob const& job : jobs) {
+            RenderRows(job, 0, job.area.h, mGlyphs);
+        }
+        return;
+    }
+
+    // The worker threads only read the map, so make sure it's loaded first.
+    Map().Materialize();
+    while ((int)mBandGlyphs.size() < nbands) {
+        mBandGlyphs.emplace_back(BAND_GLYPHS_MAX_BYTES / NumWorkers());
+    }
+    // Split the rows of all the jobs (end to end) into a band per worker.
+    // Each band writes to different scanlines.
+    ParallelFor(nbands, [&](int band) {
+        int first = (rows * band) / nbands;
+        int last = (rows * (band + 1)) / nbands;
+        int row = 0;
+        for (BackingJob const& job : jobs) {
+            int y0 = std::max(first - row, 0);
+            int y1 = std::min(last - row, job.area.h);
+            if (y0 < y1) {
+                RenderRows(job, y0, y1, mBandGlyphs[band]);
+            }
+            row += job.area.h;
+        }
+    });
+}
+
+void MapWidget::RenderRows(BackingJob const& job, int y0, int y1, GlyphCache& glyphs) const
+{
+    Charset const& charset = mModel.proj.charset;
+    Palette const& palette = mModel.proj.palette;
+    size_t cellBytes = (size_t)charset.tw * 4;
+    MapRect area(job.area.x, job.area.y + y0, job.area.w, y1 - y0);
+    Map().ForEachSpanConst(area, [&](TilePoint const& pos, ConstPlanesView cells, int n) {
+        uint8_t* dest = job.pixels + ((size_t)(pos.y - job.tile.y) * charset.th * job.stride) +
+            ((pos.x - job.tile.x) * cellBytes);
+        for (int i = 0; i < n; ++i) {
+            CopyGlyph(glyphs.Get(charset, palette, cells.Get(i)), charset.tw, charset.th, dest, job.stride);
+            dest += cellBytes;
+        }
+    });
 }
 
 
@@ -197,11 +329,35 @@ void MapWidget::wheelEvent(QWheelEvent *event)
 void MapWidget::paintEvent(QPaintEvent *event)
 {
     QPainter painter(this);
-    // Draw the map, scaling up to our zoom level.
+    // Draw the map, scaling up to our zoom level, a backing tile at a time.
     {
-        QRectF r = event->rect();
-        QRectF src( r.x()/mZoom, r.y()/mZoom, r.width()/mZoom, r.height()/mZoom);
-        painter.drawImage(r, mBacking, src);
+        QRect r = event->rect();
+        int tilew = BACKING_TILE * mModel.proj.charset.tw * mZoom;
+        int tileh = BACKING_TILE * mModel.proj.charset.th * mZoom;
+        int ntx = (Map().w + BACKING_TILE - 1) / BACKING_TILE;
+        int nty = (Map().h + BACKING_TILE - 1) / BACKING_TILE;
+        if (tilew > 0 && tileh > 0 && !r.isEmpty()) {
+            int tx0 = std::max(0, r.left() / tilew);
+            int tx1 = std::min(ntx - 1, r.right() / tilew);
+            int ty0 = std::max(0, r.top() / tileh);
+            int ty1 = std::min(nty - 1, r.bottom() / tileh);
+            // Render whatever's missing together first, so a new map
+            // coming into view is done in parallel.
+            PrepareBacking(tx0, ty0, tx1, ty1);
+            for (int ty = ty0; ty <= ty1; ++ty) {
+                for (int tx = tx0; tx <= tx1; ++tx) {
+                    QImage const* img = BackingTile(tx, ty);
+                    if (!img) {
+                        continue;
+                    }
+                    QRect dest = FromMap(BackingTileRect(tx, ty));
+                    QRect targ = dest.intersected(r);
+                    QRectF src((targ.x() - dest.x()) / (qreal)mZoom, (targ.y() - dest.y()) / (qreal)mZoom,
+                        targ.width() / (qreal)mZoom, targ.height() / (qreal)mZoom);
+                    painter.drawImage(QRectF(targ), *img, src);
+                }
+            }
+        }
     }
 
     // Draw overlays
@@ -229,15 +385,10 @@ void MapWidget::paintEvent(QPaintEvent *event)
                     TilePoint tp(x, y);
 
                     QRect bound = FromMap(MapRect(tp, 1, 1));
-                    Cell const& c = Map().CellAt(tp);
+                    Cell c = Map().CellAt(tp);
 
                     // text
-                    QString t;
-                    if (mZoom < 4) {
-                       t = QString("%1").arg(c.tile);
-                    } else {
-                       t = QString("%1\n%2").arg(c.tile).arg(c.ink);
-                    }
+                    QString const& t = GridLabel(c);
                     painter.setPen(QColor(0,0,0,128));
                     painter.drawText(bound.adjusted(2,2,0,0), Qt::AlignCenter, t);
                     painter.setPen(QColor(255,255,255,128));
@@ -272,8 +423,8 @@ void MapWidget::paintEvent(QPaintEvent *event)
             auto label = QString::fromStdString(ent.GetAttr("kind"));
             const std::vector<std::string> hidden = {"x", "y", "w", "h", "kind"};
             for (auto const& attr : ent.attrs) {
-                if (std::find(hidden.begin(), hidden.end(), attr.name) == hidden.end()) {
-                    label += QString::fromStdString(std::format("\n{}={}", attr.name, attr.value));
+                if (std::find(hidden.begin(), hidden.end(), attr.name.str()) == hidden.end()) {
+                    label += QString::fromStdString(std::format("\n{}={}", attr.name.str(), attr.value));
                 }
             }
             painter.setPen(QColor(0,0,255,128));
@@ -300,6 +451,24 @@ void MapWidget::paintEvent(QPaintEvent *event)
 
 }
 
+QString const& MapWidget::GridLabel(Cell const& c)
+{
+    // Ink is only shown when zoomed in.
+    bool showInk = mZoom >= 4;
+    uint32_t key = (uint32_t)c.tile | (showInk ? ((uint32_t)c.ink << 16) | 0x1000000 : 0);
+    auto it = mGridLabels.find(key);
+    if (it == mGridLabels.end()) {
+        QString t;
+        if (showInk) {
+           t = QString("%1\n%2").arg(c.tile).arg(c.ink);
+        } else {
+           t = QString("%1").arg(c.tile);
+        }
+        it = mGridLabels.insert(key, t);
+    }
+    return *it;
+}
+
 void MapWidget::ShowGrid(bool yesno)
 {
     mShowGrid = yesno;
@@ -5,9 +5,13 @@
 #include <vector>
 
 #include <QtWidgets/QWidget>
+#include <QCache>
+#include <QHash>
 #include <QImage>
+#include <QString>
 
 #include "proj.h"
+#include "glyphs.h"
 #include "mapeditor.h"
 
 class Tool;
@@ -30,6 +34,10 @@ public:
     virtual void HideCursor();
     virtual void EntSelectionChanged();
 
+    // IModelListener
+    virtual void ProjCharsetModified();
+    virtual void ProjNuke();
+
     void ShowGrid(bool yesno);
     bool IsGridShown() const {return mShowGrid;}
 
@@ -48,16 +56,61 @@ protected:
 
 private:
     Model& mModel;
-    QImage mBacking;
+    // The map at 1:1, in tiles of BACKING_TILE x BACKING_TILE cells (smaller
+    // at the right and bottom edges), keyed by tile position. Tiles are only
+    // rendered when they come into view, and the least recently used are
+    // dropped to keep under BACKING_MAX_BYTES.
+    static constexpr int BACKING_TILE = 32;
+    static constexpr qsizetype BACKING_MAX_BYTES = 64 * 1024 * 1024;
+    QCache<uint32_t, QImage> mBacking;
+    // What the backing tiles were rendered for (in cells, and pixels per
+    // cell). If it changes, they're all dropped.
+    MapRect mBackingBounds;
+    QSize mBackingCellSize;
+    GlyphCache mGlyphs;
+    // Redraws of at least this many cells are split into row bands and
+    // rendered in parallel, each band with its own glyph cache (GlyphCache
+    // isn't thread-safe). The band caches share BAND_GLYPHS_MAX_BYTES
+    // between them, and are freed on ProjCharsetModified() and ProjNuke().
+    static constexpr int PARALLEL_MIN_CELLS = 4096;
+    static constexpr size_t BAND_GLYPHS_MAX_BYTES = 4 * 1024 * 1024;
+    std::vector<GlyphCache> mBandGlyphs;
     int mZoom{3};
     bool mShowGrid{false};
     bool mCursorOn{false};
     MapRect mCursor;
 
-    Tilemap& Map() const {return mModel.proj.maps[CurrentMap()];}
+    Tilemap const& Map() const {return mModel.proj.maps[CurrentMap()];}
     QRect FromMap(MapRect const& r) const;
     MapRect ToMap(QRectF const& r) const;
 
     void UpdateBacking(MapRect const& dirty);
+    void DropBacking();
+    MapRect BackingTileRect(int tx, int ty) const;
+    // The backing tile at (tx, ty), rendered if it isn't cached. Only valid
+    // until the next call.
+    QImage const* BackingTile(int tx, int ty);
+    // Render any of the tiles from (tx0, ty0) to (tx1, ty1) inclusive which
+    // aren't cached, all in one go.
+    void PrepareBacking(int tx0, int ty0, int tx1, int ty1);
+    // Some cells to render: area of the map, into the pixels of the backing
+    // tile covering tile (rows stride bytes apart).
+    struct BackingJob {
+        uint8_t* pixels;
+        size_t stride;
+        MapRect tile;
+        MapRect area;
+    };
+    void RenderJobs(std::vector<BackingJob> const& jobs);
+    // Render rows [y0, y1) of job.area (relative to its top).
+    void RenderRows(BackingJob const& job, int y0, int y1, GlyphCache& glyphs) const;
+    // UpdateBacking()'s job list, kept between calls (it only ever grows),
+    // so redrawing as the map is drawn upon doesn't allocate.
+    static constexpr int DIRTY_JOBS_RESERVE = 16;
+    std::vector<BackingJob> mDirtyJobs;
+
+    // Grid overlay text, cached so redraws don't keep making new strings.
+    QString const& GridLabel(Cell const& c);
+    QHash<uint32_t, QString> mGridLabels;
 };
 
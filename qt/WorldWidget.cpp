@@ -2,6 +2,8 @@
 #include "helpers.h"
 
 //#include <cassert>
+#include <algorithm>
+#include <cstring>
 #include <QImage>
 #include <QPainter>
 #include <QMouseEvent>
@@ -14,12 +16,82 @@ WorldWidget::WorldWidget(QWidget* parent, Model& model) : QWidget(parent), mMode
     setSizePolicy(QSizePolicy::Preferred, QSizePolicy::Preferred);
     //setSizePolicy(QSizePolicy::Preferred);
     setMouseTracking(true);
+    Relayout();
 }
 
 WorldWidget::~WorldWidget()
 {
 }
 
+void WorldWidget::ProjCharsetModified()
+{
+    mGlyphs.Invalidate();
+    // The tile size might have changed, too.
+    mThumbs.clear();
+    Relayout();
+    update();
+}
+
+void WorldWidget::ProjMapModified(int mapNum, MapRect const& dirty)
+{
+    if (mapNum < 0 || mapNum >= (int)mThumbs.size() || mThumbs[mapNum].isNull()) {
+        return;     // Drawn when it's needed.
+    }
+    Tilemap const& map = mModel.proj.maps[mapNum];
+    int64_t mapw = (int64_t)map.w * mModel.proj.charset.tw;
+    int64_t maph = (int64_t)map.h * mModel.proj.charset.th;
+    if (mapw <= 0 || maph <= 0) {
+        return;
+    }
+    // The thumbnail pixels which sample the dirty cells (give or take a
+    // pixel for rounding). Cell x is at thumbnail x * sx / mapw.
+    QImage const& thumb = mThumbs[mapNum];
+    int64_t sx = mModel.proj.charset.tw * (int64_t)thumb.width();
+    int64_t sy = mModel.proj.charset.th * (int64_t)thumb.height();
+    int left = (int)((dirty.x * sx) / mapw) - 1;
+    int right = (int)(((dirty.x + dirty.w) * sx + mapw - 1) / mapw) + 1;
+    int top = (int)((dirty.y * sy) / maph) - 1;
+    int bottom = (int)(((dirty.y + dirty.h) * sy + maph - 1) / maph) + 1;
+    QRect area = QRect(left, top, right - left, bottom - top).intersected(thumb.rect());
+    if (area.isEmpty()) {
+        return;
+    }
+    RenderThumb(mapNum, area);
+    update(area.translated(mThumbRects[mapNum].topLeft()));
+}
+
+void WorldWidget::ProjNuke()
+{
+    mGlyphs.Invalidate();
+    mThumbs.clear();
+    Relayout();
+    update();
+}
+
+void WorldWidget::ProjMapsInserted(int mapNum, int count)
+{
+    // Keep the thumbnails we have (if the scale changes, they'll be redrawn
+    // anyway).
+    if (mapNum >= 0 && mapNum <= (int)mThumbs.size()) {
+        mThumbs.insert(mThumbs.begin() + mapNum, count, QImage());
+    } else {
+        mThumbs.clear();
+    }
+    Relayout();
+    update();
+}
+
+void WorldWidget::ProjMapsRemoved(int mapNum, int count)
+{
+    if (mapNum >= 0 && mapNum + count <= (int)mThumbs.size()) {
+        mThumbs.erase(mThumbs.begin() + mapNum, mThumbs.begin() + mapNum + count);
+    } else {
+        mThumbs.clear();
+    }
+    Relayout();
+    update();
+}
+
 
 void WorldWidget::setCurMap(int mapNum)
 {
@@ -59,6 +131,73 @@ void WorldWidget::CalcLayout(int mapsacross)
 }
 
 
+void WorldWidget::Relayout()
+{
+    CalcLayout(7);  // TODO: magic number
+    auto const& maps = mModel.proj.maps;
+    mOutlines.resize(maps.size());
+    mThumbRects.resize(maps.size());
+    mThumbs.resize(maps.size());
+    int tw = mModel.proj.charset.tw;
+    int th = mModel.proj.charset.th;
+    if (mExtent.w <= 0 || mExtent.h <= 0 || tw <= 0 || th <= 0) {
+        std::fill(mOutlines.begin(), mOutlines.end(), QRectF());
+        std::fill(mThumbRects.begin(), mThumbRects.end(), QRect());
+        return;
+    }
+    float sx = size().width() / float(mExtent.w * tw);
+    float sy = size().height() / float(mExtent.h * th);
+
+    for (size_t i = 0; i < maps.size(); ++i) {
+        MapRect const& r = mLayout[i];
+        mOutlines[i] = QRectF((float)r.x * tw * sx, (float)r.y * th * sy, (float)r.w * tw * sx, (float)r.h * th * sy);
+        int left = qRound(mOutlines[i].left());
+        int top = qRound(mOutlines[i].top());
+        int right = qRound(mOutlines[i].right());
+        int bottom = qRound(mOutlines[i].bottom());
+        mThumbRects[i] = QRect(left, top, right - left, bottom - top);
+    }
+}
+
+void WorldWidget::RenderThumb(int i, QRect area)
+{
+    Proj const& proj = mModel.proj;
+    Tilemap const& map = proj.maps[i];
+    int tw = proj.charset.tw;
+    int th = proj.charset.th;
+    QImage& thumb = mThumbs[i];
+    QSize size = mThumbRects[i].size();
+    if (thumb.size() != size) {
+        thumb = QImage(size, QImage::Format_RGBX8888);
+        area = thumb.rect();
+    }
+    area = area.intersected(thumb.rect());
+    if (area.isEmpty() || map.w <= 0 || map.h <= 0) {
+        return;
+    }
+
+    // Each thumbnail pixel is the map pixel nearest its centre (as when
+    // drawing the whole map scaled down).
+    int64_t mapw = (int64_t)map.w * tw;
+    int64_t maph = (int64_t)map.h * th;
+    std::vector<int> cols(area.width());
+    for (int x = 0; x < area.width(); ++x) {
+        cols[x] = (int)(((2 * (int64_t)(area.x() + x) + 1) * mapw) / (2 * (int64_t)size.width()));
+    }
+    for (int y = area.top(); y <= area.bottom(); ++y) {
+        int my = (int)(((2 * (int64_t)y + 1) * maph) / (2 * (int64_t)size.height()));
+        int cy = my / th;
+        size_t glyphRow = (size_t)(my % th) * tw;
+        uint8_t* dest = thumb.scanLine(y) + (area.x() * 4);
+        for (int mx : cols) {
+            Cell cell = map.CellAt(TilePoint(mx / tw, cy));
+            uint8_t const* glyph = mGlyphs.Get(proj.charset, proj.palette, cell);
+            std::memcpy(dest, glyph + ((glyphRow + (mx % tw)) * 4), 4);
+            dest += 4;
+        }
+    }
+}
+
 int WorldWidget::PickMap(TilePoint const& p) const
 {
     for (size_t i = 0; i < mLayout.size(); ++i) {
@@ -114,58 +253,36 @@ void WorldWidget::paintEvent(QPaintEvent *event)
     QPainter painter(this);
 
     Proj const& proj = mModel.proj;
+    if (mThumbRects.size() != proj.maps.size()) {
+        Relayout();
+    }
 
-    CalcLayout(7);
-
-    int tw = proj.charset.tw;
-    int th = proj.charset.th;
-    int zoom = 1;
-    QTransform xform;
-    float sx = size().width() / float(mExtent.w * tw);
-    float sy = size().height() / float(mExtent.h * th);
-    xform.scale(sx,sy);
-    painter.setTransform(xform);
-
-    // draw
+    // Just blit the thumbnails, drawing any which aren't ready yet.
     for (size_t i = 0; i < proj.maps.size(); ++i) {
-        MapRect const& r = mLayout[i];
-        QRect bound(r.x * tw * zoom, r.y * th * zoom,
-            r.w * tw * zoom, r.h * th * zoom);
-
-        /* BRUTE FORCE! */
-        Tilemap const& m = proj.maps[i];
-        int w = tw * m.w;
-        int h = th * m.h;
-        QImage img(w, h, QImage::Format_RGBX8888);
-
-        // Draw affected area into backing image.
-        for (int y = 0; y < m.h; ++y) {
-            for (int x = 0; x < m.w; ++x) {
-                Cell const& cell = m.CellAt(TilePoint(x, y));
-                RenderCell(img, QPoint(x * tw, y * th), proj.charset, proj.palette, cell);
-            }
+        QRect const& bound = mThumbRects[i];
+        // Skip maps which don't need redrawing (and so might not need
+        // loading).
+        if (!bound.intersects(event->rect())) {
+            continue;
         }
-
-        painter.drawImage(bound,img);
+        if (mThumbs[i].size() != bound.size()) {
+            RenderThumb((int)i, QRect());
+        }
+        painter.drawImage(bound.topLeft(), mThumbs[i]);
     }
 
     // overlays
-    painter.resetTransform();
     QPen unselPen(QColor(64, 64, 255), 1);
     QPen selPen(QColor(255, 255, 255), 1);
 
     painter.setPen(unselPen);
     painter.setBrush(Qt::NoBrush);
     for (size_t i = 0; i < proj.maps.size(); ++i) {
-        MapRect const& r = mLayout[i];
-        QRect bound(r.x * tw * zoom, r.y * th * zoom,
-            r.w * tw * zoom, r.h * th * zoom);
-
         if((int)i != mCurMap) {
             painter.drawRect(mOutlines[i]);
         }
     }
-    if (mCurMap >= 0) {
+    if (mCurMap >= 0 && mCurMap < (int)mOutlines.size()) {
         painter.setPen(selPen);
         painter.drawRect(mOutlines[mCurMap]);
     }
@@ -174,17 +291,5 @@ void WorldWidget::paintEvent(QPaintEvent *event)
 
 void WorldWidget::resizeEvent(QResizeEvent *event)
 {
-    CalcLayout(7);  // TODO: magic number
-    auto const& maps = mModel.proj.maps;
-    mOutlines.resize(maps.size());
-    int tw = mModel.proj.charset.tw;
-    int th = mModel.proj.charset.th;
-    float sx = size().width() / float(mExtent.w * tw);
-    float sy = size().height() / float(mExtent.h * th);
-
-    for (size_t i = 0; i < maps.size(); ++i) {
-        MapRect const& r = mLayout[i];
-        mOutlines[i] = QRectF((float)r.x * tw * sx, (float)r.y * th * sy, (float)r.w * tw * sx, (float)r.h * th * sy);
-    }
+    Relayout();
 }
-
@@ -3,8 +3,12 @@
 #include <cstdio>
 #include <cassert>
 
+#include <vector>
+
 #include <QtWidgets/QWidget>
+#include <QImage>
 
+#include "glyphs.h"
 #include "model.h"
 
 
@@ -21,14 +25,14 @@ public:
     virtual void EditorPenChanged() {};
     virtual void EditorToolChanged() {};
     virtual void EditorBrushChanged() {};
-    virtual void ProjCharsetModified() {};
-    virtual void ProjMapModified(int mapNum, MapRect const& dirty) {};
+    virtual void ProjCharsetModified();
+    virtual void ProjMapModified(int mapNum, MapRect const& dirty);
     // Assume everything changed.
-    virtual void ProjNuke() {};
+    virtual void ProjNuke();
     // Moves any following maps upward (assume all maps moved in memory!).
-    virtual void ProjMapsInserted(int mapNum, int count) {};
+    virtual void ProjMapsInserted(int mapNum, int count);
     // Moves any following maps back (assume all maps have shifted in memory!).
-    virtual void ProjMapsRemoved(int mapNum, int count) {};
+    virtual void ProjMapsRemoved(int mapNum, int count);
 
 
     virtual void ProjEntsInserted(int mapNum, int entNum, int count) {};
@@ -53,7 +57,12 @@ protected:
 
 private:
     void CalcLayout(int mapsacross);
+    // Lay out the maps and their outlines for the current widget size.
+    void Relayout();
     int PickMap(TilePoint const& p) const;
+    // Render the part of map i's thumbnail (in thumbnail pixels), or all of
+    // it if it's not the size it should be.
+    void RenderThumb(int i, QRect area);
 
     Model& mModel;
     int mCurMap;
@@ -62,5 +71,11 @@ private:
     MapRect mExtent;
     // Maps laid out in the widget (scaled to widget bounds)
     std::vector<QRectF> mOutlines;
+    // Thumbnails, drawn at display scale and size when first painted, and
+    // then kept up to date as the maps change. Null if not drawn yet.
+    std::vector<QImage> mThumbs;
+    // Where the thumbnails go (the outlines, rounded to whole pixels).
+    std::vector<QRect> mThumbRects;
+    GlyphCache mGlyphs;
 };
 
@@ -1,54 +1,27 @@
 #include "helpers.h"
 
+#include <QByteArray>
 #include <QFile>
 #include <QImage>
 #include <QIODevice>
 #include <QString>
 #include <QSaveFile>
 
-static const uint8_t placeholder8x8[8*8] = {
-    0,0,0,0, 0,0,0,0,
-    0,1,1,1, 1,1,1,0,
-    0,1,0,0, 0,0,1,0,
-    0,1,0,0, 0,0,1,0,
-
-    0,1,0,0, 0,0,1,0,
-    0,1,0,0, 0,0,1,0,
-    0,1,1,1, 1,1,1,0,
-    0,0,0,0, 0,0,0,0,
-};
+#ifdef Q_OS_WIN
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
 
 void RenderCell(QImage& targ, QPoint pos, Charset const& charset, Palette const& palette, Cell const& pen)
 {
-    // printf("renderCell(%d %d tile:%d ink:%d paper:%d)\n", pos.x(), pos.y(), pen.tile, pen.ink, pen.paper);
-    uint8_t const* ink = &(palette.colours[pen.ink*4]);
-    uint8_t const* paper = &(palette.colours[pen.paper*4]);
-    uint8_t const* src;
-   
-    if (pen.tile < charset.ntiles) {
-        src = charset.RawConst(pen.tile);
-    } else {
-        assert(charset.tw == 8 && charset.th == 8);
-        src = placeholder8x8;
-    }
-   
-    for (int cy = 0; cy < charset.th; ++cy) {
-        uchar* dest = targ.scanLine(pos.y() + cy) + (pos.x() * 4);
-        for (int cx = 0; cx < charset.th; ++cx) {
-            uint8_t pix = *src++;
-            if (pix == 0) {
-                *dest++ = paper[0];
-                *dest++ = paper[1];
-                *dest++ = paper[2];
-                *dest++ = 255;
-            } else {
-                *dest++ = ink[0];
-                *dest++ = ink[1];
-                *dest++ = ink[2];
-                *dest++ = 255;
-            }
-        }
-    }
+    ExpandGlyph(charset, palette, pen, targ.scanLine(pos.y()) + (pos.x() * 4), (size_t)targ.bytesPerLine());
+}
+
+void RenderCell(QImage& targ, QPoint pos, GlyphCache& glyphs, Charset const& charset, Palette const& palette, Cell const& pen)
+{
+    uint8_t const* glyph = glyphs.Get(charset, palette, pen);
+    CopyGlyph(glyph, charset.tw, charset.th, targ.scanLine(pos.y()) + (pos.x() * 4), (size_t)targ.bytesPerLine());
 }
 
 
@@ -73,7 +46,7 @@ bool ImportCharset(QString const& filename, Charset& charset, int tilew, int til
     charset.ntiles = gridw * gridh;
     charset.tw = tilew;
     charset.th = tileh;
-    charset.images.resize(charset.tw * charset.th * charset.ntiles); // 1byte/pixel
+    charset.AllocImages(); // 1byte/pixel
 
     int tile = 0;
     for (int ty = 0; ty < gridh; ++ty) {
@@ -128,7 +101,7 @@ void InitProj(Proj* proj)
         t.tw = 8;
         t.th = 8;
         t.ntiles = 2;
-        t.images.resize(t.tw * t.th * t.ntiles);
+        t.AllocImages();
         uint8_t* dest = t.Raw(0);
         for (int i = 0; i < 8 * 8; ++i) {
             *dest++ = 0;
@@ -140,47 +113,131 @@ void InitProj(Proj* proj)
 
     Palette& pal = proj->palette;
     pal.ncolours = 16;
-    pal.colours.resize(pal.ncolours * 4);
+    std::vector<uint8_t> colours(pal.ncolours * 4);
     for (int i = 0; i < pal.ncolours; ++i) {
-        pal.colours[i * 4 + 0] = c64palette[i * 3 + 0];
-        pal.colours[i * 4 + 1] = c64palette[i * 3 + 1];
-        pal.colours[i * 4 + 2] = c64palette[i * 3 + 2];
-        pal.colours[i * 4 + 3] = 255;
+        colours[i * 4 + 0] = c64palette[i * 3 + 0];
+        colours[i * 4 + 1] = c64palette[i * 3 + 1];
+        colours[i * 4 + 2] = c64palette[i * 3 + 2];
+        colours[i * 4 + 3] = 255;
     }
+    pal.colours = SharedBytes(std::move(colours));
 }
 #endif
 
-// Safely write map out to a file.
-// Tiles first, then colours. No metadata.
-bool SaveProject(Proj const& proj, QString const& filename)
+// Make sure everything written to file so far is on disk.
+static bool SyncFile(QFile& file)
 {
-
-    QSaveFile out(filename);
-    if (!out.open(QIODevice::WriteOnly)) {
+    if (!file.flush()) {
         return false;
     }
+#ifdef Q_OS_WIN
+    return _commit(file.handle()) == 0;
+#else
+    return fsync(file.handle()) == 0;
+#endif
+}
 
-    std::vector<uint8_t> buf;
-    WriteProj(proj, buf);
-    out.write((const char*)buf.data(), (qint64)buf.size());
+// Sink writing to a QIODevice, from its position when the sink is created.
+class DeviceSink : public Sink
+{
+public:
+    explicit DeviceSink(QIODevice& dev) : mDev(dev), mStart(dev.pos()) {}
 
-    return out.commit();
-}
+protected:
+    virtual bool Put(uint8_t const* p, size_t n) {
+        return mDev.write((const char*)p, (qint64)n) == (qint64)n;
+    }
+    virtual bool PutAt(size_t pos, uint8_t const* p, size_t n) {
+        qint64 here = mDev.pos();
+        return mDev.seek(mStart + (qint64)pos) &&
+            Put(p, n) &&
+            mDev.seek(here);
+    }
 
-bool LoadProject(Proj& proj, QString const& filename)
+private:
+    QIODevice& mDev;
+    qint64 mStart;
+};
+
+// Save just the changes, if layout says the file is up to date apart from
+// them (see AppendProj()).
+// The file is never in a half-written state: the new data is appended and
+// synced before the header is pointed at it, so if anything goes wrong
+// before then, the file still holds the previous save. The file is changed
+// in place, but no section of it is ever overwritten (only the header), so
+// the maps still decoding lazily from its mapping are unaffected.
+static bool AppendProject(Proj const& proj, QString const& filename, ProjLayout& layout)
 {
+    if (!layout.toc.valid) {
+        return false;
+    }
     QFile file(filename);
-    if (!file.open(QIODevice::ReadOnly)) {
+    if (!file.open(QIODevice::ReadWrite)) {
         return false;
     }
-    // slurp file into memory
-    std::vector<uint8_t> buf;
-    qint64 expectedSize = file.size();
-    buf.resize(expectedSize);
-    qint64 n = file.read((char*)buf.data(), (qint64)buf.size());
-    if (n != expectedSize) {
+    // Still the file we think it is?
+    uint8_t expected[R5_HEADER_SIZE];
+    ProjHeader(layout, expected);
+    QByteArray onDisk = file.read(R5_HEADER_SIZE);
+    if (file.size() != (qint64)layout.fileSize ||
+        onDisk != QByteArray((const char*)expected, R5_HEADER_SIZE)) {
+        return false;
+    }
+
+    // Stream the changes onto the end.
+    // If this fails, the junk is left on the end - it's harmless, and means
+    // the next save will rewrite the file from scratch.
+    if (!file.seek(layout.fileSize)) {
         return false;
     }
-    return ReadProj(proj, buf.data(), buf.data() + buf.size()); 
+    ProjLayout newLayout = layout;
+    uint8_t header[R5_HEADER_SIZE];
+    DeviceSink tail(file);
+    if (!AppendProj(proj, newLayout, tail, header) || !SyncFile(file)) {
+        return false;
+    }
+    // Commit.
+    if (!file.seek(0) ||
+        file.write((const char*)header, R5_HEADER_SIZE) != (qint64)R5_HEADER_SIZE ||
+        !SyncFile(file)) {
+        return false;
+    }
+    layout = newLayout;
+    return true;
 }
 
+// Safely write map out to a file.
+// If layout is set and describes the file as it is on disk, only the
+// changes are written. Either way, layout is updated for the next save.
+bool SaveProject(Proj const& proj, QString const& filename, ProjLayout* layout)
+{
+    if (layout && AppendProject(proj, filename, *layout)) {
+        return true;
+    }
+
+    QSaveFile out(filename);
+    if (!out.open(QIODevice::WriteOnly)) {
+        return false;
+    }
+
+    ProjLayout newLayout;
+    DeviceSink sink(out);
+    if (!WriteProj(proj, sink, true, &newLayout)) {
+        out.cancelWriting();
+        return false;
+    }
+
+    if (!out.commit()) {
+        return false;
+    }
+    if (layout) {
+        *layout = newLayout;
+    }
+    return true;
+}
+
+bool LoadProject(Proj& proj, QString const& filename, ProjLayout* layout, ReadError* err)
+{
+    // The file is mapped, and maps are decoded from it as they're used.
+    return LoadProj(proj, QFile::encodeName(filename).toStdString(), layout, err);
+}
@@ -1,18 +1,23 @@
 #pragma once
 
 #include "proj.h"
+#include "glyphs.h"
 #include <QPoint>
 
 class QImage;
 class QString;
 
+// Draw a cell into targ (which must be Format_RGBX8888).
 void RenderCell(QImage& targ, QPoint pos, Charset const& charset, Palette const& palette, Cell const& pen);
+// As above, using glyphs already expanded in glyphs where possible (much
+// faster when drawing lots of cells).
+void RenderCell(QImage& targ, QPoint pos, GlyphCache& glyphs, Charset const& charset, Palette const& palette, Cell const& pen);
 bool ImportCharset(QString const& filename, Charset& charset, int tilew, int tileh);
 //void InitProj(Proj* proj);
 
-bool SaveProject(Proj const& proj, QString const& filename);
-bool LoadProject(Proj& proj, QString const& filename);
-
-// TODO: move into non gui code!
-MapRect FloodFill(Tilemap& map, TilePoint const& start, Cell pen, int drawFlags);
+// If layout is set, it's used to save just the changes where possible
+// (see AppendProj()), and updated to match the file.
+bool SaveProject(Proj const& proj, QString const& filename, ProjLayout* layout = nullptr);
+// If it fails and err is set, it says why.
+bool LoadProject(Proj& proj, QString const& filename, ProjLayout* layout = nullptr, ReadError* err = nullptr);
 
@@ -9,6 +9,7 @@
 int main(int argc, char **argv)
 {
     // If -s or --script, run upon input files then exit. No GUI.
+    int autosaveInterval = Model().autosaveInterval;
     {
         std::string script;
         std::vector<std::string> infiles;
@@ -22,6 +23,14 @@ int main(int argc, char **argv)
                     return 1;
                 }
                 script = argv[i];
+            } else if (arg == "--autosave") {
+                // Seconds between autosaves, 0 to disable.
+                ++i;
+                if (i >= argc) {
+                    fprintf(stderr, "Missing param for --autosave\n");
+                    return 1;
+                }
+                autosaveInterval = atoi(argv[i]);
             } else {
                 infiles.push_back(arg);
             }
@@ -32,8 +41,9 @@ int main(int argc, char **argv)
             // Script file was specified. Run in CLI-only mode. No QT GUI stuff!
             for(auto infile : infiles) {
                 Model model;
-                if (!LoadProject(model.proj, infile.c_str())) {
-                    fprintf(stderr, "Error loading %s\n", infile.c_str());
+                ReadError err;
+                if (!LoadProject(model.proj, infile.c_str(), nullptr, &err)) {
+                    fprintf(stderr, "Error loading %s: %s\n", infile.c_str(), err.ToString().c_str());
                     return 1;
                 }
                 model.mapFilename = infile;
@@ -55,19 +65,28 @@ int main(int argc, char **argv)
 
     auto args = app.arguments();
     for (int i = 1; i < args.size(); ++i) {
+        if (args.at(i) == "--autosave") {
+            ++i;
+            continue;
+        }
         Proj proj;
-        if (!LoadProject(proj, args.at(i))) {
-            printf("ERROR: failed to load %s\n", args.at(i).toStdString().c_str());
+        ProjLayout layout;
+        ReadError err;
+        if (!LoadProject(proj, args.at(i), &layout, &err)) {
+            printf("ERROR: failed to load %s: %s\n", args.at(i).toStdString().c_str(), err.ToString().c_str());
             continue;
         }
         Model* ed = new Model();
+        ed->autosaveInterval = autosaveInterval;
         ed->proj = proj;
+        ed->savedLayout = layout;
         ed->mapFilename = args.at(i).toStdString();
         editors.push_back(ed);
     }
     if(editors.empty()) {
         // blank
         Model* ed = new Model();
+        ed->autosaveInterval = autosaveInterval;
         editors.push_back(ed);
     }
 
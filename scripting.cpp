@@ -47,12 +47,10 @@ static void pushmap(lua_State* L, Tilemap const& m)
 
     lua_pushstring(L, "rows");
     lua_newtable(L);
-    auto cell = m.cells.cbegin();
     for (int y = 0; y < m.h; ++y) {
         lua_newtable(L);
         for (int x = 0; x < m.w; ++x) {
-            pushcell(L, *cell);
-            ++cell;
+            pushcell(L, m.CellAt(TilePoint(x, y)));
             lua_rawseti(L, -2, x+1);
         } 
         lua_rawseti(L, -2, y+1);
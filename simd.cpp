@@ -0,0 +1,38 @@
+#include "simd.h"
+
+#ifdef SIMD_X86
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+static bool DetectAVX2()
+{
+#if defined(__GNUC__) || defined(__clang__)
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx2");
+#elif defined(_MSC_VER)
+    int regs[4];
+    __cpuid(regs, 0);
+    if (regs[0] < 7) {
+        return false;
+    }
+    // The OS has to save the AVX registers too (OSXSAVE, then XCR0).
+    __cpuid(regs, 1);
+    if (!(regs[2] & (1 << 27)) || (_xgetbv(0) & 6) != 6) {
+        return false;
+    }
+    __cpuidex(regs, 7, 0);
+    return (regs[1] & (1 << 5)) != 0;
+#else
+    return false;
+#endif
+}
+
+bool CPUHasAVX2()
+{
+    static bool const avx2 = DetectAVX2();
+    return avx2;
+}
+
+#endif  // SIMD_X86
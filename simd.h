@@ -0,0 +1,22 @@
+#pragma once
+
+// What the SIMD kernels (see glyphs.cpp and draw.cpp) can use.
+
+// x86 with SSE2 (all x86-64 has it).
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define SIMD_X86
+#include <immintrin.h>
+#endif
+
+// Functions using AVX2 are compiled for it individually (rather than the
+// whole build needing -mavx2), and only called if the CPU has it.
+#if defined(__GNUC__) || defined(__clang__)
+#define TARGET_AVX2 __attribute__((target("avx2")))
+#else
+#define TARGET_AVX2
+#endif
+
+#ifdef SIMD_X86
+// Does this CPU (and OS) support AVX2? Checked once.
+bool CPUHasAVX2();
+#endif
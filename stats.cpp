@@ -0,0 +1,111 @@
+#include "stats.h"
+
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <new>
+
+#if defined(__linux__) || defined(__APPLE__)
+#include <sys/resource.h>
+#endif
+
+static std::atomic<uint64_t> sAllocCount{0};
+
+uint64_t AllocCount()
+{
+    return sAllocCount.load(std::memory_order_relaxed);
+}
+
+// Replace the global allocation functions, to count calls.
+// (Aligned new/delete are left alone - they're rare, and must pair up
+// with each other anyway.)
+
+static void* countedAlloc(std::size_t size) noexcept
+{
+    sAllocCount.fetch_add(1, std::memory_order_relaxed);
+    return std::malloc(size ? size : 1);
+}
+
+void* operator new(std::size_t size)
+{
+    void* p = countedAlloc(size);
+    if (!p) {
+        throw std::bad_alloc();
+    }
+    return p;
+}
+
+void* operator new[](std::size_t size)
+{
+    return operator new(size);
+}
+
+void* operator new(std::size_t size, std::nothrow_t const&) noexcept
+{
+    return countedAlloc(size);
+}
+
+void* operator new[](std::size_t size, std::nothrow_t const&) noexcept
+{
+    return countedAlloc(size);
+}
+
+void operator delete(void* p) noexcept {std::free(p);}
+void operator delete[](void* p) noexcept {std::free(p);}
+void operator delete(void* p, std::size_t) noexcept {std::free(p);}
+void operator delete[](void* p, std::size_t) noexcept {std::free(p);}
+void operator delete(void* p, std::nothrow_t const&) noexcept {std::free(p);}
+void operator delete[](void* p, std::nothrow_t const&) noexcept {std::free(p);}
+
+size_t PeakRSS()
+{
+#if defined(__linux__)
+    // VmHWM is reset by ResetPeakRSS() (getrusage()'s peak isn't).
+    FILE* fp = std::fopen("/proc/self/status", "r");
+    if (fp) {
+        char line[256];
+        size_t kb = 0;
+        while (std::fgets(line, sizeof(line), fp)) {
+            if (std::sscanf(line, "VmHWM: %zu kB", &kb) == 1) {
+                break;
+            }
+        }
+        std::fclose(fp);
+        return kb * 1024;
+    }
+    struct rusage usage;
+    return getrusage(RUSAGE_SELF, &usage) == 0 ? (size_t)usage.ru_maxrss * 1024 : 0;
+#elif defined(__APPLE__)
+    struct rusage usage;
+    return getrusage(RUSAGE_SELF, &usage) == 0 ? (size_t)usage.ru_maxrss : 0;
+#else
+    return 0;
+#endif
+}
+
+void ResetPeakRSS()
+{
+#if defined(__linux__)
+    FILE* fp = std::fopen("/proc/self/clear_refs", "w");
+    if (fp) {
+        std::fputs("5", fp);
+        std::fclose(fp);
+    }
+#endif
+}
+
+StrokeStep::~StrokeStep()
+{
+    auto end = std::chrono::steady_clock::now();
+    double ms = std::chrono::duration<double, std::milli>(end - mStart).count();
+    ++mStats.steps;
+    if (mCopied) {
+        ++mStats.copySteps;
+    } else {
+        mStats.allocs += AllocCount() - mAllocs;
+    }
+    mStats.totalMs += ms;
+    if (ms > mStats.worstStepMs) {
+        mStats.worstStepMs = ms;
+    }
+}
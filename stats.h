@@ -0,0 +1,54 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <chrono>
+
+// Instrumentation, for keeping an eye on performance.
+
+// Number of heap allocations (via operator new) made so far, on all
+// threads.
+uint64_t AllocCount();
+
+// Peak resident set size of the process (in bytes) since the last
+// ResetPeakRSS(), or 0 if the platform can't tell us.
+size_t PeakRSS();
+// Start measuring the peak again from the current RSS. Only Linux supports
+// this - elsewhere the peak is for the life of the process.
+void ResetPeakRSS();
+
+// Stats for a drawing stroke (from button press to release), counting the
+// press and each move, which should all be cheap.
+// Steps which touch a chunk of the map for the first time in the stroke
+// have to copy it (see Tilemap), so their allocations are expected, and
+// aren't counted in allocs (they're copySteps instead). Otherwise a stroke
+// should make no allocations at all.
+struct StrokeStats
+{
+    int steps{0};
+    int copySteps{0};
+    uint64_t allocs{0};
+    double totalMs{0.0};
+    double worstStepMs{0.0};
+
+    void Reset() {*this = StrokeStats();}
+};
+
+// Measures a step of a stroke, from construction to destruction.
+class StrokeStep
+{
+public:
+    StrokeStep(StrokeStats& stats) :
+        mStats(stats),
+        mAllocs(AllocCount()),
+        mStart(std::chrono::steady_clock::now())
+    {}
+    ~StrokeStep();
+    // The step copied chunks, so its allocations are expected.
+    void Copied() {mCopied = true;}
+private:
+    StrokeStats& mStats;
+    uint64_t mAllocs;
+    bool mCopied{false};
+    std::chrono::steady_clock::time_point mStart;
+};
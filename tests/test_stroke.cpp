@@ -0,0 +1,80 @@
+// Drawing stroke regression test (see StrokeStats in stats.h).
+// Draws strokes with the DrawTool, going back over chunks each stroke has
+// already touched, and checks that none of those steps allocate.
+//
+//   meson setup build -Dtests=true
+//   meson test -C build
+
+#include <cstdio>
+
+#include "mapeditor.h"
+#include "model.h"
+#include "stats.h"
+
+// Drives the tool, as the GUI would.
+class TestEditor : public MapEditor
+{
+public:
+    TestEditor(Model& model) : MapEditor(model) {}
+    virtual void CurMapChanged() {}
+    virtual void MapModified(MapRect const& dirty) {}
+    virtual void EntsModified() {}
+    virtual void SetCursor(MapRect const& area) {}
+    virtual void HideCursor() {}
+    virtual void EntSelectionChanged() {}
+
+    void Press(TilePoint const& tp) {MapEditor::Press(ToPix(tp), Tool::LEFT);}
+    void Move(TilePoint const& tp) {MapEditor::Move(ToPix(tp), Tool::LEFT);}
+    void Release(TilePoint const& tp) {MapEditor::Release(ToPix(tp), 0);}
+
+private:
+    PixPoint ToPix(TilePoint const& tp) const {
+        return PixPoint(tp.x * mProj.charset.tw, tp.y * mProj.charset.th);
+    }
+};
+
+static int sFailures = 0;
+
+static void Check(bool ok, char const* what)
+{
+    if (!ok) {
+        fprintf(stderr, "FAIL: %s\n", what);
+        ++sFailures;
+    }
+}
+
+int main()
+{
+    Model model;
+    model.proj.maps.clear();
+    model.proj.maps.push_back(Tilemap(100, 100));
+    TestEditor ed(model);
+    model.listeners.insert(&ed);
+
+    // The stroke's first row crosses 3 chunks. The rest go back over them.
+    int const len = CHUNK_SIZE * 3;
+    for (int stroke = 0; stroke < 3; ++stroke) {
+        model.leftPen.tile = stroke + 1;
+        ed.Press(TilePoint(0, 0));
+        for (int x = 1; x < len; ++x) {
+            ed.Move(TilePoint(x, 0));
+        }
+        for (int y = 1; y < CHUNK_SIZE; ++y) {
+            for (int x = 0; x < len; ++x) {
+                ed.Move(TilePoint((y & 1) ? len - 1 - x : x, y));
+            }
+            model.FlushDamage();
+        }
+        StrokeStats const& stats = model.strokeStats;
+        printf("stroke %d: %d steps (%d copying), %llu allocs, worst step %.3fms\n",
+            stroke, stats.steps, stats.copySteps, (unsigned long long)stats.allocs, stats.worstStepMs);
+        Check(stats.steps == len * CHUNK_SIZE, "every step counted");
+        Check(stats.copySteps == 3, "a copying step per chunk");
+        Check(stats.allocs == 0, "no allocations once chunks are copied");
+        ed.Release(TilePoint(0, CHUNK_SIZE - 1));
+    }
+    Check(model.proj.maps[0].CellAt(TilePoint(len - 1, CHUNK_SIZE - 1)).tile == 3, "strokes drawn");
+
+    model.listeners.erase(&ed);
+    return sFailures ? 1 : 0;
+}
@@ -35,32 +35,20 @@ void DrawTool::Press(MapEditor* view, int mapNum, PixPoint const& pos, int b)
     TilePoint tp = mProj.ToTilePoint(pos);
     mPrevPos = tp;
     Tilemap& map = mProj.maps[mapNum];
+    if (!map.Materialize()) {
+        return;     // Bad cells are read-only (see Tilemap::IsBad()).
+    }
 
     if (!mCmd) {
         mCmd = new MapDrawCmd(mEd, mapNum);
+        mEd.strokeStats.Reset();
     }
 
 
     if (!map.IsValid(tp)) {
         return;
     }
-
-    MapRect damage;
-    if (b & LEFT) {
-        if (mEd.useBrush) {
-            damage = DrawBrush(map, tp, mEd.brush, mEd.rightPen, mEd.drawFlags);
-        } else {
-            damage = Plonk(map, tp, mEd.leftPen, mEd.drawFlags);
-        }
-    }
-    if (b & RIGHT) {
-        if (mEd.useBrush) {
-            damage = EraseBrush(map, tp, mEd.brush, mEd.rightPen, mEd.drawFlags);
-        } else {
-            damage = Plonk(map, tp, mEd.rightPen, mEd.drawFlags);
-        }
-    }
-    mCmd->AddDamage(damage);
+    Draw(mapNum, tp, b);
 }
 
 void DrawTool::Move(MapEditor* view, int mapNum, PixPoint const& pos, int b)
@@ -89,23 +77,34 @@ void DrawTool::Move(MapEditor* view, int mapNum, PixPoint const& pos, int b)
         return;
     }
     mPrevPos = tp;
+    Draw(mapNum, tp, b);
+}
+
+void DrawTool::Draw(int mapNum, TilePoint const& tp, int b)
+{
+    StrokeStep step(mEd.strokeStats);
+    size_t backedUp = mCmd->NumBackedUp();
+    Tilemap& map = mProj.maps[mapNum];
 
     MapRect damage;
     if (b & LEFT) {
         if (mEd.useBrush) {
-            damage = DrawBrush(map, tp, mEd.brush, mEd.rightPen, mEd.drawFlags);
+            damage = DrawBrush(map, tp, mEd.brush, mEd.rightPen, mEd.drawFlags, mCmd);
         } else {
-            damage = Plonk(map, tp, mEd.leftPen, mEd.drawFlags);
+            damage = Plonk(map, tp, mEd.leftPen, mEd.drawFlags, mCmd);
         }
     }
     if (b & RIGHT) {
         if (mEd.useBrush) {
-            damage = EraseBrush(map, tp, mEd.brush, mEd.rightPen, mEd.drawFlags);
+            damage = EraseBrush(map, tp, mEd.brush, mEd.rightPen, mEd.drawFlags, mCmd);
         } else {
-            damage = Plonk(map, tp, mEd.rightPen, mEd.drawFlags);
+            damage = Plonk(map, tp, mEd.rightPen, mEd.drawFlags, mCmd);
         }
     }
     mCmd->AddDamage(damage);
+    if (mCmd->NumBackedUp() > backedUp) {
+        step.Copied();  // New chunks in the stroke, so the map copied them.
+    }
 }
 
 void DrawTool::Release(MapEditor* view, int mapNum, PixPoint const& pos, int b)
@@ -162,7 +161,7 @@ void PickupTool::Release(MapEditor* view, int mapNum, PixPoint const& pos, int b
         if (mSelection.w == 1 && mSelection.h == 1) {
             // Special case - 1x1 pickup just sets one of the pens rather
             // than picking up a brush.
-            Tilemap& map = mProj.maps[mapNum];
+            Tilemap const& map = mProj.maps[mapNum];
             Cell cell = map.CellAt(mSelection.Pos());
 
             if (mLatch & LEFT) {
@@ -206,7 +205,7 @@ void RectTool::Press(MapEditor* view, int mapNum, PixPoint const& pos, int b)
 {
     TilePoint tp = mProj.ToTilePoint(pos);
     Tilemap& map = mProj.maps[mapNum];
-    if (!map.IsValid(tp)) {
+    if (!map.IsValid(tp) || !map.Materialize()) {
         return;
     }
 
@@ -245,7 +244,7 @@ void RectTool::Release(MapEditor* view, int mapNum, PixPoint const& pos, int b)
 
         // go.
         MapDrawCmd* cmd = new MapDrawCmd(mEd, mapNum);
-        MapRect damage = DrawRect(mProj.maps[mapNum], mSelection, pen, mEd.drawFlags);
+        MapRect damage = DrawRect(mProj.maps[mapNum], mSelection, pen, mEd.drawFlags, cmd);
         cmd->AddDamage(damage);
         cmd->Commit();
         mEd.AddCmd(cmd);
@@ -268,7 +267,7 @@ void FloodFillTool::Press(MapEditor* view, int mapNum, PixPoint const& pos, int
 {
     TilePoint tp = mProj.ToTilePoint(pos);
     Tilemap& map = mProj.maps[mapNum];
-    if (!map.IsValid(tp)) {
+    if (!map.IsValid(tp) || !map.Materialize()) {
         return;
     }
 
@@ -283,7 +282,7 @@ void FloodFillTool::Press(MapEditor* view, int mapNum, PixPoint const& pos, int
         return;
     }
 
-    MapRect damage = FloodFill(map, tp, pen, mEd.drawFlags);
+    MapRect damage = FloodFill(map, tp, pen, mEd.drawFlags, cmd);
     cmd->AddDamage(damage);
     cmd->Commit();
     mEd.AddCmd(cmd);
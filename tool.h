@@ -54,6 +54,8 @@ public:
     virtual void Release(MapEditor* view, int mapNum, PixPoint const& pos, int b);
     virtual void Reset() {} //TODO!
 private:
+    // Draw at tp, as a step of the stroke (see StrokeStats).
+    void Draw(int mapNum, TilePoint const& tp, int b);
     TilePoint mPrevPos;
     MapDrawCmd* mCmd{nullptr};
     //void Plonk(int mapNum, TilePoint const& tp, Cell const& pen);
@@ -0,0 +1,125 @@
+#include "workers.h"
+
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace {
+
+// Set while running a job (std::mutex can't tell us if we already hold it).
+thread_local bool tInJob = false;
+
+struct Pool
+{
+    std::vector<std::thread> threads;
+    std::mutex busy;    // Held by whoever is running a job.
+
+    // Current job.
+    std::mutex m;
+    std::condition_variable wake;
+    std::condition_variable done;
+    std::function<void(int)> const* fn{nullptr};
+    int n{0};
+    std::atomic<int> next{0};
+    int active{0};  // Workers yet to finish the job.
+    unsigned generation{0};
+    bool quit{false};
+
+    Pool()
+    {
+        int count = (int)std::thread::hardware_concurrency() - 1;
+        for (int i = 0; i < count; ++i) {
+            threads.emplace_back([this]() {Run();});
+        }
+    }
+
+    ~Pool()
+    {
+        {
+            std::lock_guard<std::mutex> lock(m);
+            quit = true;
+        }
+        wake.notify_all();
+        for (auto& t : threads) {
+            t.join();
+        }
+    }
+
+    void Work()
+    {
+        tInJob = true;
+        int i;
+        while ((i = next++) < n) {
+            (*fn)(i);
+        }
+        tInJob = false;
+    }
+
+    void Run()
+    {
+        unsigned seen = 0;
+        while (true) {
+            {
+                std::unique_lock<std::mutex> lock(m);
+                wake.wait(lock, [&]() {return quit || generation != seen;});
+                if (quit) {
+                    return;
+                }
+                seen = generation;
+            }
+            Work();
+            {
+                std::lock_guard<std::mutex> lock(m);
+                if (--active == 0) {
+                    done.notify_all();
+                }
+            }
+        }
+    }
+};
+
+Pool& pool()
+{
+    static Pool p;
+    return p;
+}
+
+}   // namespace
+
+
+int NumWorkers()
+{
+    return (int)pool().threads.size() + 1;
+}
+
+void ParallelFor(int n, std::function<void(int)> const& fn)
+{
+    Pool& p = pool();
+    std::unique_lock<std::mutex> busy;
+    if (!tInJob) {
+        busy = std::unique_lock<std::mutex>(p.busy, std::try_to_lock);
+    }
+    if (n <= 1 || p.threads.empty() || !busy.owns_lock()) {
+        for (int i = 0; i < n; ++i) {
+            fn(i);
+        }
+        return;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(p.m);
+        p.fn = &fn;
+        p.n = n;
+        p.next = 0;
+        p.active = (int)p.threads.size();
+        ++p.generation;
+    }
+    p.wake.notify_all();
+    // Pitch in.
+    p.Work();
+    std::unique_lock<std::mutex> lock(p.m);
+    p.done.wait(lock, [&]() {return p.active == 0;});
+    p.fn = nullptr;
+}
@@ -0,0 +1,14 @@
+#pragma once
+
+#include <functional>
+
+// A shared pool of worker threads, for splitting up big jobs.
+
+// Number of threads ParallelFor() will use (including the caller).
+int NumWorkers();
+
+// Call fn(i) for each i in [0, n), spread across the worker threads, and
+// return when they're all done. The calls can happen in any order.
+// If the pool is already busy (eg ParallelFor() is called from within fn,
+// or from another thread), it all just runs on the calling thread.
+void ParallelFor(int n, std::function<void(int)> const& fn);